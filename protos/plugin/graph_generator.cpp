@@ -0,0 +1,556 @@
+#include "graph_generator.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/unknown_field_set.h>
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace gp = google::protobuf;
+
+namespace gen {
+
+namespace {
+
+struct GraphNode {
+    const gp::Descriptor* desc;
+    std::string type; // fully qualified C++ type
+    std::string name; // snake case name used for the member and accessor
+    std::string kind; // SYNC or ASYNC
+    std::vector<std::pair<const gp::FieldDescriptor*, const gp::Descriptor*>> inputs = {};
+    std::vector<const gp::Descriptor*> outputs = {};
+};
+
+// Ordered by full name so the generated code doesn't depend on pointer values
+using Graph = std::map<std::string, GraphNode>;
+
+std::string strip_proto_extension(const std::string& filename) {
+    const std::string extension = ".proto";
+    if (filename.size() > extension.size()
+        and filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0) {
+        return filename.substr(0, filename.size() - extension.size());
+    }
+    return filename;
+}
+
+std::string snake_case(const std::string& name) {
+    std::string result;
+    for (auto i = 0u; i < name.size(); ++i) {
+        auto c = static_cast<unsigned char>(name[i]);
+        bool word_start = (i > 0 and name[i - 1] != '_' and not std::isupper(static_cast<unsigned char>(name[i - 1])));
+        if (std::isupper(c) and word_start) {
+            result += '_';
+        }
+        result += static_cast<char>(std::tolower(c));
+    }
+    return result;
+}
+
+std::string camel_case(const std::string& name) {
+    std::string result;
+    bool capitalize = true;
+    for (char c : name) {
+        if (c == '_' or c == '-' or c == '.') {
+            capitalize = true;
+            continue;
+        }
+        result += (capitalize ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : c);
+        capitalize = false;
+    }
+    return result;
+}
+
+std::string replace_all(std::string str, const std::string& from, const std::string& to) {
+    for (auto pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size())) {
+        str.replace(pos, from.size(), to);
+    }
+    return str;
+}
+
+std::string cpp_namespace(const gp::FileDescriptor* file) {
+    return replace_all(file->package(), ".", "::");
+}
+
+std::string cpp_type(const gp::Descriptor* desc) {
+    const std::string& package = desc->file()->package();
+    std::string local_name = (package.empty() ? desc->full_name() : desc->full_name().substr(package.size() + 1));
+
+    // Nested messages are generated as Outer_Inner
+    local_name = replace_all(local_name, ".", "_");
+    return "::" + (package.empty() ? local_name : cpp_namespace(desc->file()) + "::" + local_name);
+}
+
+std::string header_name(const gp::FileDescriptor* file) {
+    return strip_proto_extension(file->name()) + ".pb.h";
+}
+
+// The printer indents by two spaces at a time
+void indent(gp::io::Printer* printer) {
+    printer->Indent();
+    printer->Indent();
+}
+
+void outdent(gp::io::Printer* printer) {
+    printer->Outdent();
+    printer->Outdent();
+}
+
+/**
+ * @return the name of the message's `(node)` option value, or an empty string if it isn't a node
+ */
+std::string node_kind(const gp::Descriptor* desc) {
+    const gp::FieldDescriptor* node_extension = desc->file()->pool()->FindExtensionByName("proj.proto.node");
+    if (not node_extension or not node_extension->enum_type()) {
+        return "";
+    }
+
+    // The plugin isn't linked against the annotations so the option is kept as an unknown field
+    const gp::MessageOptions& options = desc->options();
+    const gp::UnknownFieldSet& unknown_fields = options.GetReflection()->GetUnknownFields(options);
+
+    int value = 0;
+    for (auto i = 0; i < unknown_fields.field_count(); ++i) {
+        const gp::UnknownField& field = unknown_fields.field(i);
+        if (field.number() == node_extension->number() and field.type() == gp::UnknownField::TYPE_VARINT) {
+            value = static_cast<int>(field.varint());
+        }
+    }
+
+    if (value == 0) {
+        return "";
+    }
+
+    const gp::EnumValueDescriptor* enum_value = node_extension->enum_type()->FindValueByNumber(value);
+    return enum_value ? enum_value->name() : std::to_string(value);
+}
+
+/**
+ * @return true if the message is a keyed collection source or a node that gathers one
+ */
+bool uses_collections(const gp::Descriptor* desc) {
+    if (node_kind(desc).empty()) {
+        return false;
+    }
+
+    const gp::FieldDescriptor* key_extension = desc->file()->pool()->FindExtensionByName("proj.proto.collection_key");
+    if (key_extension) {
+        const gp::MessageOptions& options = desc->options();
+        const gp::UnknownFieldSet& unknown_fields = options.GetReflection()->GetUnknownFields(options);
+        for (auto i = 0; i < unknown_fields.field_count(); ++i) {
+            if (unknown_fields.field(i).number() == key_extension->number()) {
+                return true;
+            }
+        }
+    }
+
+    for (auto i = 0; i < desc->field_count(); ++i) {
+        const gp::FieldDescriptor* field = desc->field(i);
+        if (field->is_repeated() and field->cpp_type() == gp::FieldDescriptor::CPPTYPE_MESSAGE
+            and not node_kind(field->message_type()).empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool add_node(const gp::Descriptor* desc, Graph* graph, std::string* error) {
+    if (graph->find(desc->full_name()) != graph->end()) {
+        return true;
+    }
+
+    GraphNode new_node{desc, cpp_type(desc), snake_case(desc->name()), node_kind(desc)};
+    GraphNode& node = graph->emplace(desc->full_name(), std::move(new_node)).first->second;
+
+    for (auto i = 0; i < desc->field_count(); ++i) {
+        const gp::FieldDescriptor* field = desc->field(i);
+
+        if (field->cpp_type() != gp::FieldDescriptor::CPPTYPE_MESSAGE) {
+            continue;
+        }
+
+        const gp::Descriptor* input = field->message_type();
+        if (node_kind(input).empty()) {
+            continue;
+        }
+
+        // Gathers of collections declared in other files
+        if (field->is_repeated()) {
+            *error = "repeated " + input->full_name() + " nodes are only supported by svr::ServerTree ("
+                + field->full_name() + ")";
+            return false;
+        }
+
+        if (field->containing_oneof()) {
+            *error = input->full_name() + " node cannot be part of a 'oneof' (" + field->full_name() + ")";
+            return false;
+        }
+
+        if (not add_node(input, graph, error)) {
+            return false;
+        }
+
+        node.inputs.emplace_back(field, input);
+        graph->at(input->full_name()).outputs.emplace_back(desc);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Depth first post-order traversal of the outputs. Reversing it gives a topological ordering.
+ */
+bool schedule(const Graph& graph, const GraphNode& source, std::vector<const GraphNode*>* steps, std::string* error) {
+    enum class State { VISITING, DONE };
+    std::map<std::string, State> states;
+    std::vector<const GraphNode*> post_order;
+
+    std::vector<std::pair<const GraphNode*, bool>> stack{{&source, false}};
+    while (not stack.empty()) {
+        auto [node, children_visited] = stack.back();
+        stack.pop_back();
+
+        if (children_visited) {
+            states[node->desc->full_name()] = State::DONE;
+            post_order.emplace_back(node);
+            continue;
+        }
+
+        if (not states.emplace(node->desc->full_name(), State::VISITING).second) {
+            continue;
+        }
+        stack.emplace_back(node, true);
+
+        // Reversed so the first declared output is scheduled first
+        for (auto output = node->outputs.rbegin(); output != node->outputs.rend(); ++output) {
+            const GraphNode& output_node = graph.at((*output)->full_name());
+            auto output_state = states.find(output_node.desc->full_name());
+
+            // Visiting nodes are the ones on the current path
+            if (output_state != states.end() and output_state->second == State::VISITING) {
+                *error = "node cycle through " + output_node.desc->full_name();
+                return false;
+            }
+            if (output_state == states.end()) {
+                stack.emplace_back(&output_node, false);
+            }
+        }
+    }
+
+    steps->assign(post_order.rbegin(), post_order.rend());
+    return true;
+}
+
+void print_class(gp::io::Printer* printer,
+                 const std::string& class_name,
+                 const gp::FileDescriptor* file,
+                 const Graph& graph) {
+    std::vector<const GraphNode*> sources;
+    for (const auto& node_pair : graph) {
+        if (node_pair.second.inputs.empty()) {
+            sources.emplace_back(&node_pair.second);
+        }
+    }
+
+    printer->Print(
+        "/**\n"
+        " * Statically scheduled executor for the nodes in $file$\n"
+        " *\n"
+        " * `Handlers` provides `void compute(T*)` for every node type with a compute function and\n"
+        " * `void send(const T&)` for every sink it listens to. Input fields point at the values of\n"
+        " * their input nodes, which are owned by the graph, so compute functions must only modify\n"
+        " * the fields of the node they are given. ASYNC nodes are computed in line.\n"
+        " *\n"
+        " * Standalone: svr::Server propagates through svr::ServerTree and doesn't use this class.\n"
+        " *\n"
+        " * Like svr::ServerTree, a node is valid once every one of its inputs is valid and sources\n"
+        " * (nodes without inputs) are valid once updated. Compute functions only run on valid nodes,\n"
+        " * including the compute function of the updated source.\n"
+        " */\n"
+        "template <typename Handlers>\n"
+        "class $class$ {\n"
+        "public:\n",
+        "file", file->name(), "class", class_name);
+    indent(printer);
+
+    printer->Print("explicit $class$(Handlers handlers = Handlers());\n"
+                   "~$class$();\n"
+                   "\n"
+                   "// Input fields point into this object\n"
+                   "$class$(const $class$&) = delete;\n"
+                   "$class$($class$&&) noexcept = delete;\n"
+                   "$class$& operator=(const $class$&) = delete;\n"
+                   "$class$& operator=($class$&&) noexcept = delete;\n"
+                   "\n",
+                   "class", class_name);
+
+    for (const GraphNode* source : sources) {
+        printer->Print("void update(const $type$& value);\n", "type", source->type);
+    }
+    printer->Print("\n");
+
+    for (const auto& node_pair : graph) {
+        const GraphNode& node = node_pair.second;
+        printer->Print("const $type$& $name$() const { return $name$_; }\n", "type", node.type, "name", node.name);
+    }
+    printer->Print("\n");
+    for (const auto& node_pair : graph) {
+        const GraphNode& node = node_pair.second;
+        printer->Print("bool $name$_valid() const { return $name$_valid_; }\n", "name", node.name);
+    }
+
+    printer->Print("\n"
+                   "Handlers& handlers() { return handlers_; }\n"
+                   "const Handlers& handlers() const { return handlers_; }\n");
+
+    outdent(printer);
+    printer->Print("\nprivate:\n");
+    indent(printer);
+
+    printer->Print(
+        "template <typename T, typename = void>\n"
+        "struct HasCompute : std::false_type {};\n"
+        "template <typename T>\n"
+        "struct HasCompute<T, std::void_t<decltype(std::declval<Handlers&>().compute(std::declval<T*>()))>>\n"
+        "    : std::true_type {};\n"
+        "\n"
+        "template <typename T, typename = void>\n"
+        "struct HasSend : std::false_type {};\n"
+        "template <typename T>\n"
+        "struct HasSend<T, std::void_t<decltype(std::declval<Handlers&>().send(std::declval<const T&>()))>>\n"
+        "    : std::true_type {};\n"
+        "\n"
+        "template <typename T>\n"
+        "void compute(T* value) {\n"
+        "    if constexpr (HasCompute<T>::value) {\n"
+        "        handlers_.compute(value);\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "template <typename T>\n"
+        "void send(const T& value) {\n"
+        "    if constexpr (HasSend<T>::value) {\n"
+        "        handlers_.send(value);\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "Handlers handlers_;\n"
+        "\n");
+
+    for (const auto& node_pair : graph) {
+        const GraphNode& node = node_pair.second;
+        printer->Print("$type$ $name$_; // $kind$\n", "type", node.type, "name", node.name, "kind", node.kind);
+    }
+    printer->Print("\n");
+    for (const auto& node_pair : graph) {
+        printer->Print("bool $name$_valid_ = false;\n", "name", node_pair.second.name);
+    }
+
+    outdent(printer);
+    printer->Print("};\n");
+
+    // Constructor: link every input field to the value owned by its input node
+    printer->Print("\n"
+                   "template <typename Handlers>\n"
+                   "$class$<Handlers>::$class$(Handlers handlers) : handlers_(std::move(handlers)) {\n",
+                   "class", class_name);
+    indent(printer);
+    for (const auto& node_pair : graph) {
+        const GraphNode& node = node_pair.second;
+        for (const auto& [field, input] : node.inputs) {
+            printer->Print("$name$_.unsafe_arena_set_allocated_$field$(&$input$_);\n",
+                           "name",
+                           node.name,
+                           "field",
+                           field->lowercase_name(),
+                           "input",
+                           graph.at(input->full_name()).name);
+        }
+    }
+    outdent(printer);
+    printer->Print("}\n");
+
+    // Destructor: the aliased inputs are owned by this graph
+    printer->Print("\n"
+                   "template <typename Handlers>\n"
+                   "$class$<Handlers>::~$class$() {\n",
+                   "class", class_name);
+    indent(printer);
+    for (const auto& node_pair : graph) {
+        const GraphNode& node = node_pair.second;
+        for (const auto& input_pair : node.inputs) {
+            printer->Print("$name$_.unsafe_arena_release_$field$();\n",
+                           "name",
+                           node.name,
+                           "field",
+                           input_pair.first->lowercase_name());
+        }
+    }
+    outdent(printer);
+    printer->Print("}\n");
+}
+
+bool print_updates(gp::io::Printer* printer, const std::string& class_name, const Graph& graph, std::string* error) {
+    for (const auto& node_pair : graph) {
+        const GraphNode& source = node_pair.second;
+        if (not source.inputs.empty()) {
+            continue;
+        }
+
+        std::vector<const GraphNode*> steps;
+        if (not schedule(graph, source, &steps, error)) {
+            return false;
+        }
+
+        printer->Print("\n"
+                       "template <typename Handlers>\n"
+                       "void $class$<Handlers>::update(const $type$& value) {\n",
+                       "class", class_name, "type", source.type);
+        indent(printer);
+        printer->Print("$name$_.CopyFrom(value);\n"
+                       "$name$_valid_ = true;\n"
+                       "compute(&$name$_);\n",
+                       "name",
+                       source.name);
+
+        // The first step is the source itself
+        for (auto step = std::next(steps.begin()); step != steps.end(); ++step) {
+            std::string valid_inputs;
+            for (const auto& input_pair : (*step)->inputs) {
+                valid_inputs += (valid_inputs.empty() ? "" : " and ") + graph.at(input_pair.second->full_name()).name
+                    + "_valid_";
+            }
+            printer->Print("\n"
+                           "$name$_valid_ = $valid_inputs$;\n"
+                           "if ($name$_valid_) {\n"
+                           "    compute(&$name$_);\n"
+                           "}\n",
+                           "name",
+                           (*step)->name,
+                           "valid_inputs",
+                           valid_inputs);
+        }
+
+        // Sinks are sent whether or not they are valid, as svr::ServerTree does
+        printer->Print("\n");
+        for (const GraphNode* step : steps) {
+            if (step->outputs.empty()) {
+                printer->Print("send($name$_);\n", "name", step->name);
+            }
+        }
+
+        outdent(printer);
+        printer->Print("}\n");
+    }
+    return true;
+}
+
+} // namespace
+
+GraphGenerator::~GraphGenerator() = default;
+
+bool GraphGenerator::Generate(const gp::FileDescriptor* file,
+                              const std::string& /*parameter*/,
+                              gp::compiler::GeneratorContext* context,
+                              std::string* error) const {
+    std::string base_name = strip_proto_extension(file->name());
+
+    // Keyed collections need per-element state that the fixed schedule doesn't have
+    for (auto i = 0; i < file->message_type_count(); ++i) {
+        if (uses_collections(file->message_type(i))) {
+            std::unique_ptr<gp::io::ZeroCopyOutputStream> output(context->Open(base_name + ".graph.h"));
+            gp::io::Printer printer(output.get(), '$');
+            printer.Print("// Generated by protoc-gen-graph. DO NOT EDIT!\n"
+                          "// source: $file$\n"
+                          "#pragma once\n"
+                          "\n"
+                          "// Keyed collection nodes are only supported by svr::ServerTree\n",
+                          "file", file->name());
+            return not printer.failed();
+        }
+    }
+
+    Graph graph;
+    for (auto i = 0; i < file->message_type_count(); ++i) {
+        const gp::Descriptor* desc = file->message_type(i);
+        if (not node_kind(desc).empty() and not add_node(desc, &graph, error)) {
+            return false;
+        }
+    }
+
+    // Cycles that can't be reached from a source would otherwise never be scheduled
+    for (const auto& node_pair : graph) {
+        std::vector<const GraphNode*> steps;
+        if (not schedule(graph, node_pair.second, &steps, error)) {
+            return false;
+        }
+    }
+
+    std::set<std::string> names;
+    std::set<const gp::FileDescriptor*> files;
+    for (const auto& node_pair : graph) {
+        if (not names.emplace(node_pair.second.name).second) {
+            *error = "more than one node named " + node_pair.second.name;
+            return false;
+        }
+        files.emplace(node_pair.second.desc->file());
+    }
+
+    std::unique_ptr<gp::io::ZeroCopyOutputStream> output(context->Open(base_name + ".graph.h"));
+    gp::io::Printer printer(output.get(), '$');
+
+    printer.Print("// Generated by protoc-gen-graph. DO NOT EDIT!\n"
+                  "// source: $file$\n"
+                  "#pragma once\n"
+                  "\n"
+                  "#include \"$header$\"\n",
+                  "file", file->name(), "header", header_name(file));
+
+    for (const gp::FileDescriptor* dependency : files) {
+        if (dependency != file) {
+            printer.Print("#include \"$header$\"\n", "header", header_name(dependency));
+        }
+    }
+
+    if (graph.empty()) {
+        printer.Print("\n// No nodes\n");
+        return not printer.failed();
+    }
+
+    printer.Print("\n"
+                  "#include <type_traits>\n"
+                  "#include <utility>\n");
+
+    std::string name_space = cpp_namespace(file);
+    if (not name_space.empty()) {
+        printer.Print("\nnamespace $namespace$ {\n", "namespace", name_space);
+    }
+    printer.Print("\n");
+
+    std::string class_name = camel_case(base_name.substr(base_name.rfind('/') + 1)) + "Graph";
+
+    print_class(&printer, class_name, file, graph);
+
+    if (not print_updates(&printer, class_name, graph, error)) {
+        return false;
+    }
+
+    if (not name_space.empty()) {
+        printer.Print("\n} // namespace $namespace$\n", "namespace", name_space);
+    }
+
+    return not printer.failed();
+}
+
+std::uint64_t GraphGenerator::GetSupportedFeatures() const {
+    return FEATURE_PROTO3_OPTIONAL;
+}
+
+} // namespace gen
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <google/protobuf/compiler/code_generator.h>
+
+#include <cstdint>
+#include <string>
+
+namespace gen {
+
+/**
+ * @brief Generates `<file>.graph.h` with a statically typed executor for the `(node)` messages of a .proto file
+ *
+ * The generated class template owns one value per node, links every input field to the value of
+ * its input node once, and updates the graph with a fixed topological schedule per source. Compute
+ * functions and sinks are called directly on a `Handlers` type so the update path needs no reflection.
+ * Graph errors (e.g. a node inside a `oneof` or a cycle between nodes) fail the protoc invocation.
+ * Files with keyed collection nodes get a header without an executor.
+ *
+ * The executor is standalone: svr::Server always propagates through svr::ServerTree and never uses it.
+ * It's meant for embedding a graph in a single thread, so ASYNC nodes are computed in line (no
+ * invalidation, superseding, or notices) and repeated node fields aren't supported.
+ */
+class GraphGenerator : public google::protobuf::compiler::CodeGenerator {
+public:
+    ~GraphGenerator() override;
+
+    bool Generate(const google::protobuf::FileDescriptor* file,
+                  const std::string& parameter,
+                  google::protobuf::compiler::GeneratorContext* context,
+                  std::string* error) const override;
+
+    std::uint64_t GetSupportedFeatures() const override;
+};
+
+} // namespace gen
@@ -0,0 +1,9 @@
+// project
+#include "graph_generator.h"
+// third party
+#include <google/protobuf/compiler/plugin.h>
+
+int main(int argc, char* argv[]) {
+    gen::GraphGenerator generator;
+    return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
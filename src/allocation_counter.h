@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+namespace bench {
+
+/**
+ * @brief Totals of every heap allocation made by the process since it started
+ *
+ * Only available to executables that compile allocation_counter.cpp, which replaces the global
+ * allocation functions. It's a separate translation unit so the replacements are never inlined
+ * into code that calls them.
+ */
+std::size_t num_allocations();
+std::size_t num_allocated_bytes();
+
+} // namespace bench
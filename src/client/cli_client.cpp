@@ -1,5 +1,7 @@
 #include "client/cli_client.h"
 
+#include <util/message_util.h>
+
 #include <grpcpp/create_channel.h>
 
 namespace gp = google::protobuf;
@@ -13,14 +15,30 @@ CliClient::CliClient(std::string server_address)
 
     receive_thread_ = std::thread([&] {
         google::protobuf::Empty unused;
-        std::unique_ptr<grpc::ClientReader<proj::proto::Sink2>> stream;
+        std::unique_ptr<grpc::ClientReader<proj::proto::Sink2Delta>> stream;
 
-        stream = stub_->stream_state2(&context_, unused);
+        stream = stub_->stream_state2_deltas(&context_, unused);
 
         proj::proto::Sink2 state;
-        while (stream->Read(&state)) {
+        proj::proto::Sink2Delta delta;
+        while (stream->Read(&delta)) {
+            // The next message holds the result of the propagation
+            if (delta.invalidated()) {
+                std::cout << "STATE INVALIDATED AT VERSION " << delta.version() << std::endl;
+                if (not delta.snapshot() and delta.changed().paths_size() == 0) {
+                    continue;
+                }
+            }
+
+            if (delta.snapshot()) {
+                state.Swap(delta.mutable_values());
+            } else {
+                util::apply_field_delta(delta.changed(), delta.values(), &state);
+            }
+
             std::cout << "*******************************************\n";
-            std::cout << "RECEIVED STATE: \n";
+            std::cout << (delta.invalidated() ? "RECEIVED STALE STATE" : "RECEIVED STATE") << " (version "
+                      << delta.version() << "): \n";
             std::cout << state.DebugString();
             std::cout << "*******************************************\n";
             std::cout << std::flush;
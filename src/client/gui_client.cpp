@@ -61,6 +61,12 @@ void GuiClient::configure_gui(int, int h) {
     shared_data_.use_safely([&](const SharedData& data) {
         if (data.connected_to_server) {
             ImGui::TextColored(ImVec4(0, 1, 0, 1), "Conneted");
+
+            ImGui::Text("State Version: %llu", static_cast<unsigned long long>(data.state_version));
+            if (data.state_invalidated) {
+                ImGui::SameLine();
+                ImGui::TextColored(ImVec4(1, 1, 0, 1), "(Updating)");
+            }
         } else {
             ImGui::TextColored(ImVec4(1, 0, 0, 1), "Not Connected");
 
@@ -165,21 +171,40 @@ void GuiClient::reset_channel() {
 
         receive_thread_ = std::thread([&] {
             google::protobuf::Empty unused;
-            std::unique_ptr<grpc::ClientReader<proj::proto::Sink2>> stream;
+            std::unique_ptr<grpc::ClientReader<proj::proto::Sink2Delta>> stream;
 
             shared_data_.use_safely([&](SharedData& data) {
                 data.stream_context = std::make_unique<grpc::ClientContext>();
-                stream = stub_->stream_state2(data.stream_context.get(), unused);
+                stream = stub_->stream_state2_deltas(data.stream_context.get(), unused);
             });
 
             proj::proto::Sink2 state;
+            proj::proto::Sink2Delta delta;
 
             {
                 std::ofstream graphvis_file("client_state.dot.ps");
                 graphvis_file << util::graphvis_string(state);
             }
 
-            while (stream->Read(&state)) {
+            while (stream->Read(&delta)) {
+                shared_data_.use_safely([&](SharedData& data) {
+                    data.state_version = delta.version();
+                    data.state_invalidated = delta.invalidated();
+                });
+
+                // A notice that the next message holds the result of a propagation
+                if (delta.invalidated() and not delta.snapshot() and delta.changed().paths_size() == 0) {
+                    glfwPostEmptyEvent();
+                    continue;
+                }
+
+                // Only the fields that changed are sent after the first message
+                if (delta.snapshot()) {
+                    state.Swap(delta.mutable_values());
+                } else {
+                    util::apply_field_delta(delta.changed(), delta.values(), &state);
+                }
+
                 std::cout << "*******************************************\n";
                 std::cout << "RECEIVED STATE: \n";
                 std::cout << state.DebugString();
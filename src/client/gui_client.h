@@ -33,6 +33,8 @@ private:
         std::unique_ptr<grpc::ClientContext> stream_context = {};
         bool connected_to_server = false;
         std::string error_messages = {};
+        std::uint64_t state_version = 0;
+        bool state_invalidated = false; // the server is recomputing the state
     };
 
     util::AtomicData<SharedData> shared_data_;
@@ -0,0 +1,251 @@
+// project
+#include <server/action_log.h>
+#include <server/server.h>
+// third party
+#include <grpcpp/create_channel.h>
+// standard
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Recording {
+    std::vector<proj::proto::Actions> actions;
+    std::vector<std::chrono::microseconds> offsets; // from the first action
+};
+
+Recording read_recording(const std::string& filename) {
+    Recording recording;
+    std::int64_t first_micros = 0;
+
+    svr::ActionLog::read(filename, [&](std::unique_ptr<google::protobuf::Message> message) {
+        auto* recorded = dynamic_cast<proj::proto::RecordedAction*>(message.get());
+        if (not recorded) {
+            return;
+        }
+        if (recording.actions.empty()) {
+            first_micros = recorded->received_micros();
+        }
+        recording.offsets.emplace_back(recorded->received_micros() - first_micros);
+        recording.actions.emplace_back(std::move(*recorded->mutable_actions()));
+    });
+
+    return recording;
+}
+
+void print_percentiles(const std::string& name, std::vector<double> micros) {
+    if (micros.empty()) {
+        std::cout << name << ": no samples" << std::endl;
+        return;
+    }
+    std::sort(micros.begin(), micros.end());
+
+    auto percentile = [&](double p) {
+        return micros[static_cast<std::size_t>(p * static_cast<double>(micros.size() - 1u))];
+    };
+
+    std::cout << name << " (us): p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 "
+              << percentile(0.99) << ", max " << micros.back() << " (" << micros.size() << " samples)" << std::endl;
+}
+
+} // namespace
+
+/**
+ * Replays a file recorded with `svr::ServerOptions::record_file` into an in-process server.
+ *
+ * Actions are dispatched asynchronously on their recorded schedule (or all at once with --fast),
+ * so a slow response never delays the actions after it. Latencies are measured from the time an
+ * action was scheduled to be sent rather than when it was sent. Each response carries the
+ * sequence number the server gave the update, which ties the action to `applied_sequence`.
+ *
+ * Propagation latency is the time until the server has propagated the update. Sink emission
+ * latency is the time until a streaming client receives the first Sink2 value (not an
+ * invalidation notice) sent after the update was propagated.
+ */
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: replay_bench <recording> [--fast] [server address]" << std::endl;
+        return 1;
+    }
+
+    std::string recording_file = argv[1];
+    bool as_fast_as_possible = false;
+    std::string server_address("0.0.0.0:50051");
+
+    for (int i = 2; i < argc; ++i) {
+        if (argv[i] == std::string("--fast")) {
+            as_fast_as_possible = true;
+        } else {
+            server_address = argv[i];
+        }
+    }
+
+    Recording recording = read_recording(recording_file);
+    std::size_t num_actions = recording.actions.size();
+
+    std::cout << "Replaying " << num_actions << " actions from " << recording_file
+              << (as_fast_as_possible ? " as fast as possible" : " at the recorded pace") << std::endl;
+
+    svr::Server server(server_address);
+    std::uint64_t first_sequence = server.applied_sequence() + 1u;
+
+    auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+    std::unique_ptr<proj::proto::Server::Stub> stub = proj::proto::Server::NewStub(channel);
+
+    // Indexed by sequence number - `first_sequence`. Every action makes at most one source update.
+    // Times are nanoseconds since `start`, -1 until set.
+    std::vector<std::int64_t> scheduled(num_actions, -1);
+    std::vector<std::atomic<std::int64_t>> propagated(num_actions);
+    std::vector<std::int64_t> emitted(num_actions, -1);
+    for (auto& time : propagated) {
+        time = -1;
+    }
+
+    auto start = Clock::now();
+    auto since_start = [start](Clock::time_point time = Clock::now()) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time - start).count();
+    };
+
+    std::atomic_bool done = false;
+
+    std::thread propagation_thread([&] {
+        std::uint64_t seen = first_sequence - 1u;
+        while (not done.load()) {
+            std::uint64_t applied = server.wait_for_applied_sequence(seen, 100);
+            std::int64_t now = since_start();
+            for (; seen < applied and seen + 1u - first_sequence < num_actions; ++seen) {
+                propagated[seen + 1u - first_sequence] = now;
+            }
+        }
+    });
+
+    grpc::ClientContext stream_context;
+    std::promise<void> stream_connected;
+
+    std::thread stream_thread([&] {
+        google::protobuf::Empty unused;
+        std::unique_ptr<grpc::ClientReader<proj::proto::Sink2Update>> stream
+            = stub->stream_state2_updates(&stream_context, unused);
+        std::size_t next_unemitted = 0;
+        bool connected = false;
+
+        proj::proto::Sink2Update update;
+        while (stream->Read(&update)) {
+            if (not connected) {
+                connected = true;
+                stream_connected.set_value();
+            }
+            if (update.invalidated()) {
+                continue; // not a result
+            }
+
+            std::int64_t now = since_start();
+            for (; next_unemitted < num_actions and propagated[next_unemitted].load() >= 0; ++next_unemitted) {
+                emitted[next_unemitted] = now;
+            }
+        }
+        if (not connected) {
+            stream_connected.set_value();
+        }
+        stream->Finish();
+    });
+
+    // The server sends the current state when a client connects
+    stream_connected.get_future().wait();
+
+    struct PendingCall {
+        std::int64_t scheduled;
+        grpc::ClientContext context;
+        proj::proto::Response response;
+        grpc::Status status;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<proj::proto::Response>> reader;
+    };
+    std::vector<std::unique_ptr<PendingCall>> calls;
+    calls.reserve(num_actions);
+
+    grpc::CompletionQueue completion_queue;
+    std::size_t num_errors = 0;
+    std::uint64_t last_sequence = 0;
+
+    std::thread response_thread([&] {
+        void* tag;
+        bool ok;
+        for (auto i = 0u; i < num_actions and completion_queue.Next(&tag, &ok); ++i) {
+            auto* call = static_cast<PendingCall*>(tag);
+
+            if (not ok or not call->status.ok() or not call->response.error_msg().empty()) {
+                ++num_errors;
+                continue;
+            }
+            // Actions that don't update a source (or that the server rejected) have no sequence number
+            std::uint64_t sequence = call->response.sequence();
+            if (sequence >= first_sequence and sequence - first_sequence < num_actions) {
+                scheduled[sequence - first_sequence] = call->scheduled;
+                last_sequence = std::max(last_sequence, sequence);
+            }
+        }
+    });
+
+    auto dispatch_start = Clock::now();
+
+    for (auto i = 0u; i < num_actions; ++i) {
+        auto scheduled_time = Clock::now();
+        if (not as_fast_as_possible) {
+            scheduled_time = dispatch_start + recording.offsets[i];
+            std::this_thread::sleep_until(scheduled_time);
+        }
+
+        calls.emplace_back(std::make_unique<PendingCall>());
+        PendingCall* call = calls.back().get();
+        call->scheduled = since_start(scheduled_time);
+        call->reader = stub->Asyncdispatch_action(&call->context, recording.actions[i], &completion_queue);
+        call->reader->Finish(&call->response, &call->status, call);
+    }
+
+    response_thread.join();
+    completion_queue.Shutdown();
+
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (server.applied_sequence() < last_sequence and Clock::now() < deadline) {
+        server.wait_for_applied_sequence(server.applied_sequence(), 100);
+    }
+    done = true;
+    propagation_thread.join();
+
+    auto duration = std::chrono::duration<double>(Clock::now() - dispatch_start).count();
+
+    // Give the last sinks time to arrive
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    stream_context.TryCancel();
+    stream_thread.join();
+
+    std::vector<double> propagation_micros;
+    std::vector<double> emission_micros;
+
+    for (auto i = 0u; i < num_actions; ++i) {
+        if (scheduled[i] < 0 or propagated[i] < 0) {
+            continue;
+        }
+        propagation_micros.emplace_back(static_cast<double>(propagated[i] - scheduled[i]) * 1e-3);
+
+        if (emitted[i] >= 0) {
+            emission_micros.emplace_back(static_cast<double>(emitted[i] - scheduled[i]) * 1e-3);
+        }
+    }
+    std::size_t num_updates = propagation_micros.size();
+
+    std::cout << std::endl;
+    std::cout << "Throughput: " << static_cast<double>(num_updates) / duration << " actions/s (" << num_updates
+              << " source updates in " << duration << " s, " << num_errors << " errors)" << std::endl;
+    print_percentiles("Propagation latency", std::move(propagation_micros));
+    print_percentiles("Sink emission latency", std::move(emission_micros));
+
+    return 0;
+}
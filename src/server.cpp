@@ -2,6 +2,7 @@
 #include <server/server.h>
 // standard
 #include <iostream>
+#include <string>
 
 int main(int argc, const char* argv[]) {
     std::string server_address("0.0.0.0:50050");
@@ -13,8 +14,12 @@ int main(int argc, const char* argv[]) {
     {
         svr::Server server(server_address);
 
-        std::cout << "Press enter to exit." << std::endl;
-        std::cin.ignore();
+        std::cout << "Enter 'stats' to print node stats or press enter to exit." << std::endl;
+
+        std::string command;
+        while (std::getline(std::cin, command) and command == "stats") {
+            std::cout << server.stats_string() << std::flush;
+        }
         std::cout << "Exiting." << std::endl;
     }
 
@@ -0,0 +1,319 @@
+#include "server/action_log.h"
+#include "server/server_tree.h"
+#include "util/mapped_file.h"
+#include "util/util.h"
+
+#include <google/protobuf/descriptor.h>
+
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string_view>
+#include <vector>
+
+namespace gp = google::protobuf;
+
+namespace svr {
+
+namespace {
+
+// Record layout (little endian):
+//   u32 payload size, u32 payload checksum, payload = u32 type name size, type name, serialized message
+constexpr std::size_t record_header_size = 8u;
+
+std::uint32_t checksum(std::string_view data) {
+    // FNV-1a
+    std::uint32_t hash = 2166136261u;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+void append_u32(std::string* out, std::uint32_t value) {
+    for (auto i = 0u; i < 4u; ++i) {
+        out->push_back(static_cast<char>((value >> (8u * i)) & 0xffu));
+    }
+}
+
+std::uint32_t read_u32(const char* data) {
+    std::uint32_t value = 0;
+    for (auto i = 0u; i < 4u; ++i) {
+        value |= std::uint32_t(static_cast<unsigned char>(data[i])) << (8u * i);
+    }
+    return value;
+}
+
+void append_record(std::string* out, std::string_view type_name, std::string_view message_bytes) {
+    std::string payload;
+    payload.reserve(4u + type_name.size() + message_bytes.size());
+    append_u32(&payload, static_cast<std::uint32_t>(type_name.size()));
+    payload.append(type_name);
+    payload.append(message_bytes);
+
+    append_u32(out, static_cast<std::uint32_t>(payload.size()));
+    append_u32(out, checksum(payload));
+    out->append(payload);
+}
+
+/**
+ * @brief Calls `func(type_name, message_bytes, record)` for each record, stopping at the first incomplete one
+ * @return the size of the valid part of the log
+ */
+template <typename Func>
+std::size_t read_records(std::string_view log, const Func& func) {
+    std::size_t offset = 0;
+
+    while (log.size() - offset >= record_header_size) {
+        std::size_t payload_size = read_u32(log.data() + offset);
+        std::uint32_t payload_checksum = read_u32(log.data() + offset + 4u);
+
+        if (log.size() - offset - record_header_size < payload_size) {
+            break;
+        }
+        std::string_view payload = log.substr(offset + record_header_size, payload_size);
+
+        if (payload.size() < 4u or checksum(payload) != payload_checksum) {
+            break;
+        }
+        std::size_t type_name_size = read_u32(payload.data());
+        if (payload.size() - 4u < type_name_size) {
+            break;
+        }
+
+        func(payload.substr(4u, type_name_size),
+             payload.substr(4u + type_name_size),
+             log.substr(offset, record_header_size + payload_size));
+        offset += record_header_size + payload_size;
+    }
+    return offset;
+}
+
+/**
+ * @return null if the type isn't compiled into this binary or the message can't be parsed
+ */
+std::unique_ptr<gp::Message> parse_record(std::string_view type_name, std::string_view message_bytes) {
+    const gp::Descriptor* desc = gp::DescriptorPool::generated_pool()->FindMessageTypeByName(std::string(type_name));
+    if (not desc) {
+        return nullptr;
+    }
+
+    std::unique_ptr<gp::Message> message(gp::MessageFactory::generated_factory()->GetPrototype(desc)->New());
+    if (not message->ParseFromArray(message_bytes.data(), static_cast<int>(message_bytes.size()))) {
+        return nullptr;
+    }
+    return message;
+}
+
+std::string_view contents(const std::shared_ptr<const util::MappedFile>& file) {
+    return (file ? std::string_view(file->data(), file->size()) : std::string_view());
+}
+
+} // namespace
+
+ActionLog::ActionLog(std::string filename) : filename_(std::move(filename)) {
+    // Drop a record that was cut off by a crash so new records aren't appended after it
+    std::size_t valid_size = 0;
+    std::size_t file_size = 0;
+    {
+        auto existing = util::MappedFile::open(filename_);
+        file_size = contents(existing).size();
+        valid_size = read_records(contents(existing), [](std::string_view, std::string_view, std::string_view) {});
+    }
+    if (valid_size < file_size) {
+        std::cerr << "Discarding " << (file_size - valid_size) << " bytes of incomplete records from " << filename_
+                  << std::endl;
+        std::filesystem::resize_file(filename_, valid_size);
+    }
+
+    file_ = std::fopen(filename_.c_str(), "ab");
+    if (not file_) {
+        throw std::runtime_error("Failed to open action log '" + filename_ + "'");
+    }
+
+    writer_thread_ = std::thread([this] { run_writer(); });
+}
+
+ActionLog::~ActionLog() {
+    // Everything already appended is written before the thread exits
+    queue_.use_safely([](WriteQueue& queue) { queue.stop = true; });
+    queue_.notify_all();
+    writer_thread_.join();
+
+    std::fclose(file_);
+}
+
+std::uint64_t ActionLog::append(const google::protobuf::Message& message, std::function<void(bool)> on_durable) {
+    std::string record;
+    append_record(&record, message.GetDescriptor()->full_name(), message.SerializeAsString());
+
+    std::uint64_t sequence = 0;
+    queue_.use_safely([&](WriteQueue& queue) {
+        queue.pending += record;
+        sequence = ++queue.appended;
+
+        // Pending records always reach the writer thread, even once the log has failed
+        if (on_durable) {
+            queue.callbacks.emplace(sequence, std::move(on_durable));
+        }
+    });
+    queue_.notify_all();
+
+    return sequence;
+}
+
+bool ActionLog::wait_until_durable(std::uint64_t sequence) {
+    bool durable = false;
+    queue_.wait_to_use_safely([sequence](const WriteQueue& queue) { return queue.failed or queue.durable >= sequence; },
+                              [&durable](const WriteQueue& queue) { durable = not queue.failed; });
+    return durable;
+}
+
+void ActionLog::run_writer() {
+    bool stop = false;
+
+    while (not stop) {
+        std::string group;
+        std::uint64_t last_sequence = 0;
+
+        // Takes everything appended since the last group
+        queue_.wait_to_use_safely([](const WriteQueue& queue) { return queue.stop or not queue.pending.empty(); },
+                                  [&](WriteQueue& queue) {
+                                      group.swap(queue.pending);
+                                      last_sequence = queue.appended;
+                                      stop = queue.stop;
+                                  });
+
+        if (group.empty()) {
+            continue;
+        }
+
+        bool written = (std::fwrite(group.data(), 1, group.size(), file_) == group.size()
+                        and util::sync_to_disk(file_));
+        if (not written) {
+            std::cerr << "Failed to write to action log '" << filename_ << "'" << std::endl;
+        }
+
+        std::vector<std::function<void(bool)>> callbacks;
+        bool durable = true;
+
+        queue_.use_safely([&](WriteQueue& queue) {
+            queue.durable = last_sequence;
+            queue.failed |= not written;
+            durable = not queue.failed;
+
+            // Every callback is called once the log fails
+            auto end = (queue.failed ? queue.callbacks.end() : queue.callbacks.upper_bound(queue.durable));
+            for (auto iter = queue.callbacks.begin(); iter != end; ++iter) {
+                callbacks.emplace_back(std::move(iter->second));
+            }
+            queue.callbacks.erase(queue.callbacks.begin(), end);
+        });
+        queue_.notify_all();
+
+        for (const auto& callback : callbacks) {
+            callback(durable);
+        }
+    }
+}
+
+std::size_t ActionLog::read(const std::string& filename,
+                            const std::function<void(std::unique_ptr<gp::Message>)>& func) {
+    auto file = util::MappedFile::open(filename);
+    std::size_t num_records = 0;
+
+    read_records(contents(file), [&](std::string_view type_name, std::string_view message_bytes, std::string_view) {
+        ++num_records;
+
+        if (std::unique_ptr<gp::Message> message = parse_record(type_name, message_bytes)) {
+            func(std::move(message));
+        }
+    });
+    return num_records;
+}
+
+std::size_t ActionLog::replay(const std::string& filename, ServerTree* server_tree, std::size_t batch_size) {
+    std::map<std::pair<const gp::Descriptor*, std::string>, std::unique_ptr<gp::Message>> batch;
+    std::size_t batch_records = 0;
+
+    auto apply_batch = [&] {
+        std::vector<const gp::Message*> messages;
+        messages.reserve(batch.size());
+        for (const auto& source_pair : batch) {
+            messages.emplace_back(source_pair.second.get());
+        }
+        server_tree->update_sources(messages);
+
+        batch.clear();
+        batch_records = 0;
+    };
+
+    std::size_t num_records = read(filename, [&](std::unique_ptr<gp::Message> message) {
+        // Sources removed from the graph since the record was written are skipped
+        if (not server_tree->is_source(*message)) {
+            return;
+        }
+
+        auto key = std::make_pair(message->GetDescriptor(), server_tree->element_key(*message));
+        batch.insert_or_assign(std::move(key), std::move(message));
+
+        if (++batch_records >= batch_size) {
+            apply_batch();
+        }
+    });
+
+    if (not batch.empty()) {
+        apply_batch();
+    }
+    return num_records;
+}
+
+bool ActionLog::compact(const std::string& filename, const ServerTree& server_tree) {
+    auto file = util::MappedFile::open(filename);
+    if (not file) {
+        return true; // Nothing to compact
+    }
+
+    // The latest record for each source (or element) ordered by when it was written
+    std::map<std::pair<std::string_view, std::string>, std::size_t> latest_indices;
+    std::vector<std::string_view> records;
+
+    auto keep_latest = [&](std::string_view type_name, std::string_view message_bytes, std::string_view record) {
+        // Records this binary can't parse can't be keyed, so they are all kept
+        std::unique_ptr<gp::Message> message = parse_record(type_name, message_bytes);
+        if (not message) {
+            records.emplace_back(record);
+            return;
+        }
+        auto key = std::make_pair(type_name, server_tree.element_key(*message));
+
+        auto [iter, inserted] = latest_indices.try_emplace(std::move(key), records.size());
+        if (not inserted) {
+            records[iter->second] = {};
+            iter->second = records.size();
+        }
+        records.emplace_back(record);
+    };
+    read_records(contents(file), keep_latest);
+
+    std::string temp_filename = filename + ".tmp";
+    std::FILE* compacted = std::fopen(temp_filename.c_str(), "wb");
+    if (not compacted) {
+        return false;
+    }
+
+    bool written = true;
+    for (std::string_view record : records) {
+        written &= (std::fwrite(record.data(), 1, record.size(), compacted) == record.size());
+    }
+    written &= util::sync_to_disk(compacted);
+    written &= (std::fclose(compacted) == 0);
+
+    if (not written or std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace svr
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "util/atomic_data.h"
+
+#include <google/protobuf/message.h>
+
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace svr {
+
+class ServerTree;
+
+/**
+ * @brief An append-only log of accepted source updates that is replayed on startup
+ *
+ * Records are written by a single writer thread. Everything appended while the previous
+ * group is being synced to disk is written and synced as the next group, so one fsync
+ * covers any number of concurrent appends. Durability callbacks run on the writer thread
+ * in the order their records were appended.
+ *
+ * Each record holds the full name of the message type and the serialized message, prefixed
+ * by its size and a checksum. A record that was only partly written when the process died
+ * ends the log and is removed when the log is next opened.
+ */
+class ActionLog {
+public:
+    /**
+     * @brief Opens (or creates) the log at `filename` for appending
+     * @throws std::runtime_error if the file can't be opened
+     */
+    explicit ActionLog(std::string filename);
+    ~ActionLog();
+
+    ActionLog(const ActionLog&) = delete;
+    ActionLog(ActionLog&&) noexcept = delete;
+    ActionLog& operator=(const ActionLog&) = delete;
+    ActionLog& operator=(ActionLog&&) noexcept = delete;
+
+    /**
+     * @brief Queues `message` to be written. Never waits for the disk.
+     *
+     * `on_durable(durable)` is called on the writer thread once the record is synced to disk (or
+     * the log fails). The record's sequence number and its place in the callback order are taken
+     * together, so callbacks run in sequence order no matter how many threads append.
+     *
+     * @return the sequence number of the record, for `wait_until_durable`
+     */
+    std::uint64_t append(const google::protobuf::Message& message,
+                         std::function<void(bool durable)> on_durable = nullptr);
+
+    /**
+     * @brief Blocks until the record with `sequence` (and every record before it) is synced to disk
+     * @return false if the log could not be written
+     */
+    bool wait_until_durable(std::uint64_t sequence);
+
+    /**
+     * @brief Calls `func` with each record in the log, in the order they were appended
+     *
+     * Records of message types that aren't compiled into this binary are skipped.
+     *
+     * @return the number of records read, 0 if the log doesn't exist
+     */
+    static std::size_t read(const std::string& filename,
+                            const std::function<void(std::unique_ptr<google::protobuf::Message>)>& func);
+
+    /**
+     * @brief Applies every record in the log to `server_tree`
+     *
+     * The file is memory mapped and records are applied in batches of up to `batch_size`
+     * updates. Only the latest update to each source (or collection element) in a batch is
+     * applied, so recovery isn't limited by propagation speed.
+     *
+     * @return the number of records read, 0 if the log doesn't exist
+     */
+    static std::size_t replay(const std::string& filename, ServerTree* server_tree, std::size_t batch_size = 4096);
+
+    /**
+     * @brief Rewrites the log so it only holds the latest update to each source (or collection element)
+     *
+     * Records of message types that aren't compiled into this binary (or can't be parsed) are kept
+     * as they are. The compacted log replaces the original once it is synced to disk. Must not be
+     * used while the log is open.
+     *
+     * @return false if the compacted log couldn't be written
+     */
+    static bool compact(const std::string& filename, const ServerTree& server_tree);
+
+private:
+    struct WriteQueue {
+        std::string pending; // serialized records waiting for the writer thread
+        std::uint64_t appended = 0;
+        std::uint64_t durable = 0;
+        bool stop = false;
+        bool failed = false;
+        std::map<std::uint64_t, std::function<void(bool)>> callbacks; // by sequence
+    };
+
+    std::string filename_;
+    std::FILE* file_;
+    util::AtomicData<WriteQueue> queue_;
+    std::thread writer_thread_;
+
+    void run_writer();
+};
+
+} // namespace svr
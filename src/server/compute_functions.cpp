@@ -14,36 +14,49 @@ void Compute::compute_state(proj::proto::State* data) {
 }
 #endif
 
-void Compute::register_compute_functions(ServerTree* server_tree) {
-    server_tree->register_function<proj::proto::Inner1>(
-        [](proj::proto::Inner1* inner) { inner->set_state("_" + inner->source1().state() + "_"); });
+void Compute::compute(proj::proto::Inner1* inner) {
+    inner->set_state("_" + inner->source1().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner2>(
-        [](proj::proto::Inner2* inner) { inner->set_state("_" + inner->source2().state() + "_"); });
+void Compute::compute(proj::proto::Inner2* inner) {
+    inner->set_state("_" + inner->source2().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner3>([](proj::proto::Inner3* inner) {
-        inner->set_state("_" + inner->source2().state() + "_" + inner->inner1().state() + "_" + inner->inner2().state()
-                         + "_");
-    });
+void Compute::compute(proj::proto::Inner3* inner) {
+    inner->set_state("_" + inner->source2().state() + "_" + inner->inner1().state() + "_" + inner->inner2().state()
+                     + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner4>([](proj::proto::Inner4* inner) {
-        inner->set_state("_" + inner->source3().state() + "_" + inner->inner3().state() + "_");
-    });
+void Compute::compute(proj::proto::Inner4* inner) {
+    inner->set_state("_" + inner->source3().state() + "_" + inner->inner3().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner5>([](proj::proto::Inner5* inner) {
-        inner->set_state("_" + inner->inner3().state() + "_" + inner->inner4().state() + "_");
-    });
+void Compute::compute(proj::proto::Inner5* inner) {
+    inner->set_state("_" + inner->inner3().state() + "_" + inner->inner4().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner6>(
-        [](proj::proto::Inner6* inner) { inner->set_state("_" + inner->inner4().state() + "_"); });
+void Compute::compute(proj::proto::Inner6* inner) {
+    inner->set_state("_" + inner->inner4().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Inner7>(
-        [](proj::proto::Inner7* inner) { inner->set_state("_" + inner->inner4().state() + "_"); });
+void Compute::compute(proj::proto::Inner7* inner) {
+    inner->set_state("_" + inner->inner4().state() + "_");
+}
 
-    server_tree->register_function<proj::proto::Sink2>([](proj::proto::Sink2* sink) {
-        sink->set_final_update("_" + sink->inner5().state() + "_" + sink->inner6().state() + "_"
-                               + sink->inner7().state() + "_");
-    });
+void Compute::compute(proj::proto::Sink2* sink) {
+    sink->set_final_update("_" + sink->inner5().state() + "_" + sink->inner6().state() + "_" + sink->inner7().state()
+                           + "_");
+}
+
+void Compute::register_compute_functions(ServerTree* server_tree) {
+    server_tree->register_function<proj::proto::Inner1>([](proj::proto::Inner1* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner2>([](proj::proto::Inner2* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner3>([](proj::proto::Inner3* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner4>([](proj::proto::Inner4* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner5>([](proj::proto::Inner5* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner6>([](proj::proto::Inner6* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Inner7>([](proj::proto::Inner7* inner) { compute(inner); });
+    server_tree->register_function<proj::proto::Sink2>([](proj::proto::Sink2* sink) { compute(sink); });
 }
 
 } // namespace svr
@@ -13,6 +13,18 @@ public:
         static void compute_state(proj::proto::State* data);
 #endif
 
+    static void compute(proj::proto::Inner1* inner);
+    static void compute(proj::proto::Inner2* inner);
+    static void compute(proj::proto::Inner3* inner);
+    static void compute(proj::proto::Inner4* inner);
+    static void compute(proj::proto::Inner5* inner);
+    static void compute(proj::proto::Inner6* inner);
+    static void compute(proj::proto::Inner7* inner);
+    static void compute(proj::proto::Sink2* sink);
+
+    /**
+     * @brief Registers the `compute` overloads. Compute is also a valid `Handlers` type for proj::proto::StateGraph.
+     */
     void register_compute_functions(ServerTree* server_tree);
 };
 
@@ -0,0 +1,48 @@
+#include "server/debug_exporter.h"
+
+#include <fstream>
+
+namespace svr {
+
+DebugExporter::DebugExporter(std::chrono::milliseconds min_interval)
+    : min_interval_(min_interval), export_thread_([this] { run_exports(); }) {}
+
+DebugExporter::~DebugExporter() {
+    pending_.use_safely([](Pending& pending) { pending.stop = true; });
+    pending_.notify_all();
+    export_thread_.join();
+}
+
+void DebugExporter::export_file(const std::string& filename, std::function<std::string()> render) {
+    pending_.use_safely([&](Pending& pending) { pending.exports.insert_or_assign(filename, std::move(render)); });
+    pending_.notify_all();
+}
+
+void DebugExporter::run_exports() {
+    bool stop = false;
+
+    while (not stop) {
+        std::map<std::string, std::function<std::string()>> exports;
+
+        pending_.wait_to_use_safely([](const Pending& pending) { return pending.stop or not pending.exports.empty(); },
+                                    [&](Pending& pending) {
+                                        exports.swap(pending.exports);
+                                        stop = pending.stop;
+                                    });
+
+        for (const auto& [filename, render] : exports) {
+            std::ofstream file(filename);
+            file << render();
+        }
+
+        if (not stop) {
+            // Returns early only if the exporter is being destroyed
+            auto interval_ms = static_cast<unsigned>(min_interval_.count());
+            pending_.wait_to_use_safely(interval_ms,
+                                        [](const Pending& pending) { return pending.stop; },
+                                        [](const Pending&) {});
+        }
+    }
+}
+
+} // namespace svr
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "util/atomic_data.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+namespace svr {
+
+/**
+ * @brief Writes debug files (graphviz exports) on a background thread
+ *
+ * Each file has at most one pending export, so requesting an export only marks the file dirty
+ * and replaces what will be written. The thread writes everything pending and then waits
+ * `min_interval` before writing again, so files are rewritten at most that often no matter
+ * how fast the graph changes.
+ */
+class DebugExporter {
+public:
+    explicit DebugExporter(std::chrono::milliseconds min_interval);
+
+    /**
+     * @brief Writes any pending exports before returning
+     */
+    ~DebugExporter();
+
+    DebugExporter(const DebugExporter&) = delete;
+    DebugExporter(DebugExporter&&) noexcept = delete;
+    DebugExporter& operator=(const DebugExporter&) = delete;
+    DebugExporter& operator=(DebugExporter&&) noexcept = delete;
+
+    /**
+     * @brief Replaces the pending export of `filename`
+     *
+     * `render` is called on the export thread so it must only use data it owns, such as a
+     * ServerTree::GraphView or a sink message.
+     */
+    void export_file(const std::string& filename, std::function<std::string()> render);
+
+private:
+    struct Pending {
+        std::map<std::string, std::function<std::string()>> exports; // keyed by filename
+        bool stop = false;
+    };
+
+    std::chrono::milliseconds min_interval_;
+    util::AtomicData<Pending> pending_;
+    std::thread export_thread_;
+
+    void run_exports();
+};
+
+} // namespace svr
@@ -1,64 +1,243 @@
 #include "server/server.h"
+#include "server/action_log.h"
+#include "server/debug_exporter.h"
 #include "server/server_tree.h"
 #include "server/stream_handler.h"
 #include "server/compute_functions.h"
+#include "server/source_batcher.h"
 #include "../../cmake-build-debug/protos/proto/proj/state.pb.h"
 #include "server.h"
 
+#include <grpcpp/alarm.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 
+#include <google/protobuf/text_format.h>
+
+#include <array>
 #include <sstream>
 #include <fstream>
 #include <util/message_util.h>
 
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
 namespace gp = google::protobuf;
 
 namespace svr {
 
-Server::Server(std::string server_address)
+namespace {
+
+proj::proto::InitialState read_initial_state(const std::string& filename) {
+    proj::proto::InitialState initial_state;
+    if (filename.empty()) {
+        return initial_state;
+    }
+
+    std::ifstream file(filename);
+    std::stringstream contents;
+    contents << file.rdbuf();
+
+    if (not file or not gp::TextFormat::ParseFromString(contents.str(), &initial_state)) {
+        throw std::runtime_error("Failed to read initial state from '" + filename + "'");
+    }
+    return initial_state;
+}
+
+void pin_to_core(std::thread* thread, unsigned index) {
+#if defined(__linux__)
+    unsigned num_cores = std::max(std::thread::hardware_concurrency(), 1u);
+
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(index % num_cores, &cores);
+
+    if (pthread_setaffinity_np(thread->native_handle(), sizeof(cpu_set_t), &cores) != 0) {
+        std::cerr << "Failed to pin completion queue thread " << index << std::endl;
+    }
+#else
+    (void)thread;
+    (void)index;
+#endif
+}
+
+} // namespace
+
+struct Server::Sink2Broadcast {
+    std::shared_ptr<const proj::proto::Sink2Update> update;
+    // The update `delta` was diffed against. Null for notices and when there was no earlier value.
+    std::shared_ptr<const proj::proto::Sink2Update> delta_base;
+    // Computed once on the stream thread for every client that was sent `delta_base`
+    proj::proto::Sink2Delta delta;
+};
+
+Server::Server(std::string server_address, ServerOptions options)
     : server_address_(std::move(server_address))
-    , stream_queue_(std::make_shared<util::BlockingQueue<proj::proto::Sink2>>())
+    , active_calls_(0u)
+    , stream_queue_(std::make_shared<util::BlockingQueue<SinkValue<proj::proto::Sink2>>>())
+    , invalidation_queue_(std::make_shared<util::BlockingQueue<SinkInvalidation>>())
+    , debug_exporter_(options.debug_exports ? std::make_shared<DebugExporter>(options.debug_export_interval)
+                                            : nullptr)
     , server_tree_(std::make_unique<ServerTree>())
-    , stream_handler_(std::make_unique<StreamHandler<proj::proto::Sink2>>())
-    , compute_test_(std::make_unique<Compute>()) {
+    , source_batcher_(std::make_unique<SourceBatcher>(server_tree_.get(),
+                                                      options.batch_window,
+                                                      options.max_batch_size,
+                                                      options.ingest_queue_size))
+    , stream_handler_(std::make_unique<StreamHandler<Sink2Broadcast>>(options.stream_buffer_size,
+                                                                                SlowClientPolicy::SKIP_TO_LATEST))
+    , invalidation_handler_(std::make_unique<StreamHandler<proj::proto::Invalidation>>(options.stream_buffer_size,
+                                                                                       SlowClientPolicy::DISCONNECT))
+    , compute_test_(std::make_unique<Compute>())
+    , checkpoint_file_(options.checkpoint_file)
+    , exit_checkpoint_thread_(false) {
 
-    server_tree_->add_output(stream_queue_);
+    server_tree_->set_debug_exporter(debug_exporter_);
+    server_tree_->add_output(stream_queue_,
+                             options.send_invalidated_sinks ? SinkEmission::INVALIDATED_AND_FINAL
+                                                            : SinkEmission::NOTICE_AND_FINAL);
+    server_tree_->add_invalidation_output(invalidation_queue_);
+    server_tree_->set_lazy_evaluation(options.lazy_evaluation);
 
     compute_test_->register_compute_functions(server_tree_.get());
 
+    if (not checkpoint_file_.empty() and server_tree_->restore_checkpoint(checkpoint_file_)) {
+        std::cout << "Restored " << checkpoint_file_ << std::endl;
+
+    } else {
+        // Clients never see the graph before it is computed
+        proj::proto::InitialState initial_state = read_initial_state(options.initial_state_file);
+        std::vector<const gp::Message*> initial_values;
+
+        for (const proj::proto::Actions& action : initial_state.actions()) {
+            util::iterate_msg_fields(action, [&](const gp::FieldDescriptor* field, int /*index*/) {
+                if (util::message_has_field(action, field)) {
+                    initial_values.emplace_back(&action.GetReflection()->GetMessage(action, field));
+                }
+            });
+        }
+
+        if (not server_tree_->initialize_startup_sources(initial_values)) {
+            throw std::runtime_error("Initial state contains an action that does not correspond to a source");
+        }
+    }
+
+    if (not options.action_log_file.empty()) {
+        if (options.compact_action_log and not ActionLog::compact(options.action_log_file, *server_tree_)) {
+            std::cerr << "Failed to compact " << options.action_log_file << std::endl;
+        }
+        std::size_t num_actions = ActionLog::replay(options.action_log_file, server_tree_.get());
+        std::cout << "Replayed " << num_actions << " actions from " << options.action_log_file << std::endl;
+
+        action_log_ = std::make_unique<ActionLog>(options.action_log_file);
+    }
+
+    if (not options.record_file.empty()) {
+        recorder_ = std::make_unique<ActionLog>(options.record_file);
+    }
+
     grpc::ServerBuilder builder;
     builder.AddListeningPort(server_address_, grpc::InsecureServerCredentials());
-    builder.RegisterService(this);
+    builder.RegisterService(&service_);
+
+    for (auto i = 0u; i < std::max(options.num_completion_queues, 1u); ++i) {
+        completion_queues_.emplace_back(builder.AddCompletionQueue());
+    }
 
     server_ = builder.BuildAndStart();
     std::cout << "Server listening on " << server_address_ << std::endl;
 
-    {
-        std::ofstream graphvis_file("server_state.dot.ps");
-        proj::proto::Sink2 empty_state;
-        graphvis_file << util::graphvis_string(empty_state);
+    call_work_thread_ = std::thread([this] {
+        while (std::function<void()> work = call_work_queue_.pop_front()) {
+            work();
+        }
+    });
+
+    for (auto i = 0u; i < completion_queues_.size(); ++i) {
+        grpc::ServerCompletionQueue* queue = completion_queues_[i].get();
+        completion_threads_.emplace_back([this, queue] { run_completion_queue(queue); });
+
+        if (options.pin_completion_threads) {
+            pin_to_core(&completion_threads_.back(), i);
+        }
+    }
+
+    if (debug_exporter_) {
+        debug_exporter_->export_file("server_state.dot.ps",
+                                     [] { return util::graphvis_string(proj::proto::Sink2()); });
     }
 
     exit_stream_thread_ = false;
-    run_thread_ = std::thread([this] { server_->Wait(); });
+
+    if (not checkpoint_file_.empty()) {
+        checkpoint_thread_ = std::thread([this, interval = options.checkpoint_interval] {
+            auto interval_ms = static_cast<unsigned>(std::chrono::milliseconds(interval).count());
+            // Only returns true once the thread should exit
+            while (not exit_checkpoint_thread_.wait_to_use_safely(interval_ms,
+                                                                  [](bool exit) { return exit; },
+                                                                  [](bool) {})) {
+                if (not server_tree_->save_checkpoint(checkpoint_file_)) {
+                    std::cerr << "Failed to write checkpoint " << checkpoint_file_ << std::endl;
+                }
+            }
+        });
+    }
 
     stream_thread_ = std::thread([this] {
+        std::shared_ptr<const proj::proto::Sink2Update> last_value; // the last update that had a value
+
         while (not exit_stream_thread_.load()) {
-            auto updated_state = stream_queue_->pop_front();
+            SinkValue<proj::proto::Sink2> sink_value = stream_queue_->pop_front();
+
+            auto update = std::make_shared<proj::proto::Sink2Update>();
+            update->set_version(sink_value.version);
+            update->set_invalidated(sink_value.invalidated);
+
+            auto broadcast = std::make_shared<Sink2Broadcast>();
+            broadcast->delta.set_version(sink_value.version);
+            broadcast->delta.set_invalidated(sink_value.invalidated);
 
-            if (not exit_stream_thread_.load()) {
-                {
-                    std::ofstream graphvis_file("server_state.dot.ps");
-                    graphvis_file << util::graphvis_string(updated_state);
+            if (sink_value.value) {
+                // Copied once here and shared by every client
+                *update->mutable_value() = *sink_value.value;
+
+                // Diffed once here for every delta client that is caught up
+                if (last_value) {
+                    util::diff_fields(last_value->value(), update->value(), broadcast->delta.mutable_changed());
+                    util::apply_field_delta(broadcast->delta.changed(),
+                                            update->value(),
+                                            broadcast->delta.mutable_values());
+                    broadcast->delta_base = last_value;
                 }
-                {
-                    std::ofstream graphvis_file("nodes.dot.ps");
-                    graphvis_file << server_tree_->graphvis_string();
+                last_value = update;
+
+                if (debug_exporter_ and not exit_stream_thread_.load()) {
+                    debug_exporter_->export_file("server_state.dot.ps", [value = std::move(sink_value.value)] {
+                        return util::graphvis_string(*value);
+                    });
                 }
             }
 
-            stream_handler_->send_data(std::move(updated_state));
+            broadcast->update = std::move(update);
+            stream_handler_->send_data(std::move(broadcast));
+        }
+    });
+
+    invalidation_thread_ = std::thread([this] {
+        while (not exit_stream_thread_.load()) {
+            SinkInvalidation invalidation = invalidation_queue_->pop_front();
+
+            auto notice = std::make_shared<proj::proto::Invalidation>();
+            if (invalidation.sink) {
+                notice->set_sink(invalidation.sink->full_name());
+            }
+            notice->set_version(invalidation.version);
+            for (std::string& element : invalidation.elements) {
+                notice->add_elements(std::move(element));
+            }
+            notice->set_removed(invalidation.removed);
+
+            invalidation_handler_->send_data(std::move(notice));
         }
     });
 }
@@ -66,76 +245,656 @@ Server::Server(std::string server_address)
 Server::~Server() {
     // Close the streaming client connections
     stream_handler_->attempt_shutdown();
+    invalidation_handler_->attempt_shutdown();
 
-    // The deadline forces calls to terminate even if they aren't completed.
-    // This is necessary because the client is using a continuous streaming call.
+    // The deadline forces calls to terminate even if they aren't completed (subscriptions never complete)
     auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(100);
     server_->Shutdown(deadline);
 
-    // Wait for the server to finish
-    run_thread_.join();
+    // Calls are cleaned up on the completion queue threads so the queues must outlive them
+    active_calls_.wait_to_use_safely([](std::size_t calls) { return calls == 0u; }, [](std::size_t) {});
+    for (auto& queue : completion_queues_) {
+        queue->Shutdown();
+    }
+    for (std::thread& thread : completion_threads_) {
+        thread.join();
+    }
+    call_work_queue_.push_back(nullptr);
+    call_work_thread_.join();
+
+    // Apply any remaining updates
+    source_batcher_ = nullptr;
+
+    if (checkpoint_thread_.joinable()) {
+        exit_checkpoint_thread_.use_safely([](bool& exit) { exit = true; });
+        exit_checkpoint_thread_.notify_one();
+        checkpoint_thread_.join();
+
+        if (not server_tree_->save_checkpoint(checkpoint_file_)) {
+            std::cerr << "Failed to write checkpoint " << checkpoint_file_ << std::endl;
+        }
+    }
 
-    // Cause the `stream_thread_` loop to exit
+    // Cause the `stream_thread_` and `invalidation_thread_` loops to exit
     exit_stream_thread_.store(true);
-    stream_queue_->push_back(proj::proto::Sink2());
+    stream_queue_->push_back({0, false, nullptr});
+    invalidation_queue_->push_back({nullptr, 0, {}});
 
     stream_thread_.join();
+    invalidation_thread_.join();
 }
 
-grpc::Status Server::dispatch_action(grpc::ServerContext* /*context*/,
-                                     const proj::proto::Actions* request,
-                                     proj::proto::Response* response) {
+std::uint64_t Server::applied_sequence() const {
+    return source_batcher_->applied_sequence();
+}
 
-    bool action_received = false;
+std::uint64_t Server::wait_for_applied_sequence(std::uint64_t sequence, unsigned max_wait_time_millis) const {
+    return source_batcher_->wait_for_applied_sequence(sequence, max_wait_time_millis);
+}
 
-    util::iterate_msg_fields(*request, [&](const gp::FieldDescriptor* field, int /*index*/) {
-        if (util::message_has_field(*request, field)) {
-            action_received = true;
-            const gp::Message& msg = request->GetReflection()->GetMessage(*request, field);
+std::string Server::stats_string() const {
+    return server_tree_->stats_string();
+}
 
-            std::cout << "Received " << msg.GetDescriptor()->name() << " Action" << std::endl;
+std::shared_ptr<const Server::Sink2Broadcast> Server::latest_sink2() const {
+    std::shared_ptr<const ServerTree::GraphView> view = server_tree_->view();
+    std::shared_ptr<const gp::Message> latest = view->value(proj::proto::Sink2::descriptor());
+    if (not latest) {
+        return nullptr;
+    }
 
-            if (not server_tree_->update_source(msg)) {
-                std::cerr << "Action does not correspond to a source" << std::endl;
-            }
+    auto update = std::make_shared<proj::proto::Sink2Update>();
+    update->set_version(view->value_version(proj::proto::Sink2::descriptor()));
+    update->mutable_value()->CopyFrom(*latest);
+
+    auto broadcast = std::make_shared<Sink2Broadcast>();
+    broadcast->update = std::move(update);
+    return broadcast;
+}
+
+void Server::dispatch_action(const proj::proto::Actions& request,
+                             std::function<void(std::string error_msg, std::uint64_t sequence)> respond) {
+    if (recorder_) {
+        // Recording never waits for the disk
+        proj::proto::RecordedAction recorded;
+        recorded.set_received_micros(std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::system_clock::now().time_since_epoch())
+                                         .count());
+        *recorded.mutable_actions() = request;
+        recorder_->append(recorded);
+    }
+
+    const gp::Message* action = nullptr;
+
+    util::iterate_msg_fields(request, [&](const gp::FieldDescriptor* field, int /*index*/) {
+        if (util::message_has_field(request, field)) {
+            action = &request.GetReflection()->GetMessage(request, field);
         }
     });
 
-    if (not action_received) {
-        response->set_error_msg("No action specified");
+    if (not action) {
+        respond("No action specified", 0);
+        return;
+    }
+
+    std::cout << "Received " << action->GetDescriptor()->name() << " Action" << std::endl;
+
+    if (not server_tree_->is_source(*action)) {
+        std::cerr << "Action does not correspond to a source" << std::endl;
+        respond("", 0);
+        return;
+    }
+
+    if (not action_log_) {
+        // Pushing waits for room in the ingest queue, which mustn't hold up the completion queue thread
+        call_work_queue_.push_back([this, action, respond = std::move(respond)] {
+            std::uint64_t sequence = 0;
+            source_batcher_->push(*action, &sequence);
+            respond("", sequence);
+        });
+        return;
     }
 
-    return grpc::Status::OK;
+    // The action isn't applied unless it will survive a restart. Waiting for the disk doesn't hold up
+    // the completion queue thread. A full ingest queue mustn't hold up the log's writer thread either,
+    // so the push is handed to the call work thread, which keeps the actions in log order.
+    action_log_->append(*action, [this, action, respond](bool durable) {
+        if (not durable) {
+            respond("Failed to log action", 0);
+            return;
+        }
+        call_work_queue_.push_back([this, action, respond] {
+            std::uint64_t sequence = 0;
+            source_batcher_->push(*action, &sequence);
+            respond("", sequence);
+        });
+    });
 }
 
-//grpc::Status
-//Server::stream_state2(::grpc::ServerContext* /*context*/,
-//                      ::grpc::ServerReaderWriter<::proj::proto::Sink2, ::google::protobuf::Empty>* stream) {
-//    std::cout << "Client connected" << std::endl;
-//#if 0
-//    proj::proto::Sink2 sink;
-//    sink.set_final_update("Blargy blarsa sdfwef");
-//    stream->Write(sink);
-//    std::this_thread::sleep_for(std::chrono::seconds(5));
-//    sink.set_final_update("Write 2");
-//    stream->Write(sink);
-//    std::this_thread::sleep_for(std::chrono::seconds(2));
-//    sink.set_final_update("Final write");
-//    stream->Write(sink);
-//#else
-//    stream_handler_->handle_client(context, writer);
-//#endif
-//    std::cout << "Client disconnected" << std::endl;
-//    return grpc::Status::OK;
-//}
-
-grpc::Status Server::stream_state2(grpc::ServerContext* context,
-                                   const google::protobuf::Empty* /*request*/,
-                                   grpc::ServerWriter<::proj::proto::Sink2>* writer) {
-    std::cout << "Client connected" << std::endl;
-    stream_handler_->handle_client(context, writer);
-    std::cout << "Client disconnected" << std::endl;
-    return grpc::Status::OK;
+/**
+ * A call that owns itself. Every operation it starts on its completion queue completes with one
+ * of its tags, and the call deletes itself once it won't receive any more of them.
+ */
+class Server::Call {
+public:
+    enum class Event {
+        REQUESTED, // a client made the call (not ok once the server shuts down)
+        WRITTEN,
+        WOKEN, // a stream has something new to write
+        WORKED, // work queued with `run_off_queue` is done
+        FINISHED,
+        DONE, // the call is over, either finished or cancelled
+    };
+
+    struct Tag {
+        Call* call;
+        Event event;
+    };
+
+    Call(Server* server, grpc::ServerCompletionQueue* queue) : owner_(server), queue_(queue) {
+        for (auto i = 0u; i < tags_.size(); ++i) {
+            tags_[i] = {this, static_cast<Event>(i)};
+        }
+    }
+
+    virtual ~Call() {
+        if (started_) {
+            owner_->active_calls_.use_safely([](std::size_t& calls) { --calls; });
+            owner_->active_calls_.notify_all();
+        }
+    }
+
+    Call(const Call&) = delete;
+    Call(Call&&) noexcept = delete;
+    Call& operator=(const Call&) = delete;
+    Call& operator=(Call&&) noexcept = delete;
+
+    virtual void proceed(Event event, bool ok) = 0;
+
+protected:
+    Server* owner_;
+    grpc::ServerCompletionQueue* queue_;
+    grpc::ServerContext context_;
+
+    Tag* tag(Event event) { return &tags_[static_cast<std::size_t>(event)]; }
+
+    void mark_started() {
+        started_ = true;
+        owner_->active_calls_.use_safely([](std::size_t& calls) { ++calls; });
+    }
+
+    /**
+     * @brief Runs `work` on the server's call work thread, then completes WORKED on this call's queue
+     * through an alarm. The call must not be deleted until WORKED comes back.
+     */
+    void run_off_queue(std::function<void()> work) {
+        // Alarms are only used once
+        work_alarm_ = std::make_unique<grpc::Alarm>();
+        grpc::Alarm* alarm = work_alarm_.get();
+        grpc::ServerCompletionQueue* queue = queue_;
+        Tag* worked = tag(Event::WORKED);
+
+        owner_->call_work_queue_.push_back([work = std::move(work), alarm, queue, worked] {
+            work();
+            alarm->Set(queue, std::chrono::system_clock::now(), worked);
+        });
+    }
+
+private:
+    std::array<Tag, 6> tags_;
+    std::unique_ptr<grpc::Alarm> work_alarm_;
+    bool started_ = false;
+};
+
+class Server::DispatchActionCall : public Server::Call {
+public:
+    DispatchActionCall(Server* server, grpc::ServerCompletionQueue* queue) : Call(server, queue), responder_(&context_) {
+        owner_->service_.Requestdispatch_action(&context_, &request_, &responder_, queue_, queue_, tag(Event::REQUESTED));
+    }
+
+    void proceed(Event event, bool ok) override {
+        if (event != Event::REQUESTED or not ok) {
+            delete this;
+            return;
+        }
+        mark_started();
+        new DispatchActionCall(owner_, queue_);
+
+        owner_->dispatch_action(request_, [this](std::string error_msg, std::uint64_t sequence) {
+            response_.set_error_msg(std::move(error_msg));
+            response_.set_sequence(sequence);
+            responder_.Finish(response_, grpc::Status::OK, tag(Event::FINISHED));
+        });
+    }
+
+private:
+    proj::proto::Actions request_;
+    proj::proto::Response response_;
+    grpc::ServerAsyncResponseWriter<proj::proto::Response> responder_;
+};
+
+/**
+ * A call that streams what a StreamHandler broadcasts. The call only holds a thread while it
+ * writes; while there is nothing new it waits for the handler to wake it through an alarm.
+ * `begin` and `end` can wait on the graph so they run on the call work thread.
+ */
+template <typename Value, typename Reply, typename Handler>
+class Server::StreamCall : public Server::Call {
+public:
+    StreamCall(Server* server, grpc::ServerCompletionQueue* queue) : Call(server, queue), writer_(&context_) {
+        context_.AsyncNotifyWhenDone(tag(Event::DONE));
+    }
+
+    void proceed(Event event, bool ok) override {
+        switch (event) {
+        case Event::REQUESTED:
+            // A call that never started won't receive DONE
+            if (not ok) {
+                delete this;
+                return;
+            }
+            mark_started();
+            ++pending_; // DONE
+            listen_for_next();
+            start();
+            return;
+
+        case Event::WRITTEN:
+            --pending_;
+            // Otherwise the client is gone. A write can still succeed after DONE.
+            if (ok and not done_) {
+                write_next();
+            }
+            break;
+
+        case Event::WOKEN:
+            --pending_;
+            waiting_ = false;
+            if (not done_) {
+                write_next();
+            }
+            break;
+
+        case Event::WORKED:
+            --pending_;
+            if (ending_) {
+                delete this;
+                return;
+            }
+            // Otherwise the client left while the stream was beginning
+            if (not done_) {
+                write_first();
+            }
+            break;
+
+        case Event::FINISHED:
+            --pending_;
+            break;
+
+        case Event::DONE:
+            --pending_;
+            done_ = true;
+            if (waiting_ and handler().cancel_wake(wake_id_)) {
+                --pending_;
+                waiting_ = false;
+            }
+            break;
+        }
+
+        if (done_ and pending_ == 0u) {
+            ending_ = true;
+            ++pending_;
+            run_off_queue([this] { end(); });
+        }
+    }
+
+protected:
+    grpc::ServerAsyncWriter<Reply> writer_;
+
+    virtual void listen_for_next() = 0; // creates the call that waits for the next client
+    virtual Handler& handler() = 0;
+
+    /**
+     * @brief Sets up the stream once a client has made the call. Runs on the call work thread.
+     * @param initial_value is set to a value to write before anything from the handler
+     */
+    virtual grpc::Status begin(std::shared_ptr<const Value>* initial_value) = 0;
+
+    /**
+     * @return the message to write for `value`, null to skip it. Only used until the next call.
+     */
+    virtual const Reply* reply_for(const std::shared_ptr<const Value>& value) = 0;
+
+    /**
+     * @brief Cleans up once the call is over. Runs on the call work thread.
+     */
+    virtual void end() {}
+
+private:
+    std::uint64_t cursor_ = 0;
+    std::unique_ptr<grpc::Alarm> alarm_;
+    std::uint64_t wake_id_ = 0;
+    bool waiting_ = false;
+    bool finishing_ = false;
+    bool done_ = false;
+    bool ending_ = false;
+    unsigned pending_ = 0; // operations whose tags haven't come back
+
+    // Set by `begin` on the call work thread
+    grpc::Status begin_status_;
+    std::shared_ptr<const Value> initial_value_;
+
+    void start() {
+        // Anything sent from here on is written, even if it is also in the initial value
+        cursor_ = handler().end();
+
+        ++pending_;
+        run_off_queue([this] { begin_status_ = begin(&initial_value_); });
+    }
+
+    void write_first() {
+        std::shared_ptr<const Value> initial_value = std::move(initial_value_);
+
+        const Reply* reply = nullptr;
+        if (not begin_status_.ok()) {
+            finish(begin_status_);
+        } else if (initial_value and (reply = reply_for(initial_value))) {
+            write(*reply);
+        } else {
+            write_next();
+        }
+    }
+
+    void write_next() {
+        while (true) {
+            std::shared_ptr<const Value> value;
+
+            switch (handler().try_read(&cursor_, &value)) {
+            case StreamRead::VALUE:
+                if (const Reply* reply = reply_for(value)) {
+                    write(*reply);
+                    return;
+                }
+                break;
+
+            case StreamRead::NOTHING_NEW:
+                wait();
+                return;
+
+            case StreamRead::TOO_FAR_BEHIND:
+                finish({grpc::StatusCode::RESOURCE_EXHAUSTED, "Fell too far behind the stream"});
+                return;
+
+            case StreamRead::SHUT_DOWN:
+                finish(grpc::Status::OK);
+                return;
+            }
+        }
+    }
+
+    void write(const Reply& reply) {
+        // The message is serialized before this returns
+        ++pending_;
+        writer_.Write(reply, tag(Event::WRITTEN));
+    }
+
+    void wait() {
+        ++pending_;
+        waiting_ = true;
+
+        // Alarms are only used once. The handler wakes the call from whichever thread sends the value.
+        alarm_ = std::make_unique<grpc::Alarm>();
+        grpc::Alarm* alarm = alarm_.get();
+        grpc::ServerCompletionQueue* queue = queue_;
+        Tag* woken = tag(Event::WOKEN);
+
+        wake_id_ = handler().wake_when_readable(cursor_, [alarm, queue, woken] {
+            alarm->Set(queue, std::chrono::system_clock::now(), woken);
+        });
+    }
+
+    void finish(const grpc::Status& status) {
+        if (finishing_) {
+            return;
+        }
+        finishing_ = true;
+        ++pending_;
+        writer_.Finish(status, tag(Event::FINISHED));
+    }
+};
+
+/**
+ * A call that streams Sink2 as `Reply` messages. Sink2 is kept up to date while a client is connected.
+ */
+template <typename Reply>
+class Server::Sink2StreamCall : public Server::StreamCall<Server::Sink2Broadcast, Reply> {
+public:
+    using StreamCall<Sink2Broadcast, Reply>::StreamCall;
+
+protected:
+    StreamHandler<Sink2Broadcast>& handler() override { return *this->owner_->stream_handler_; }
+
+    grpc::Status begin(std::shared_ptr<const Sink2Broadcast>* initial_value) override {
+        std::cout << "Client connected" << std::endl;
+
+        // With lazy evaluation this brings Sink2 up to date if nobody was streaming it
+        this->owner_->server_tree_->add_subscriber(proj::proto::Sink2::descriptor());
+
+        // New clients start from the latest state instead of waiting for the next update
+        *initial_value = this->owner_->latest_sink2();
+        return grpc::Status::OK;
+    }
+
+    void end() override {
+        this->owner_->server_tree_->remove_subscriber(proj::proto::Sink2::descriptor());
+        std::cout << "Client disconnected" << std::endl;
+    }
+};
+
+/**
+ * Only the Sink2 values, as `stream_state2` has always sent them. Notices without a value are skipped.
+ */
+class Server::Sink2Call : public Server::Sink2StreamCall<proj::proto::Sink2> {
+public:
+    Sink2Call(Server* server, grpc::ServerCompletionQueue* queue) : Sink2StreamCall(server, queue) {
+        owner_->service_.Requeststream_state2(&context_, &request_, &writer_, queue_, queue_, tag(Event::REQUESTED));
+    }
+
+private:
+    google::protobuf::Empty request_;
+
+    void listen_for_next() override { new Sink2Call(owner_, queue_); }
+
+    const proj::proto::Sink2* reply_for(const std::shared_ptr<const Sink2Broadcast>& broadcast) override {
+        const proj::proto::Sink2Update& update = *broadcast->update;
+        return update.has_value() ? &update.value() : nullptr;
+    }
+};
+
+/**
+ * Sink2 values with their versions, and the invalidation notices they resolve
+ */
+class Server::Sink2UpdateCall : public Server::Sink2StreamCall<proj::proto::Sink2Update> {
+public:
+    Sink2UpdateCall(Server* server, grpc::ServerCompletionQueue* queue) : Sink2StreamCall(server, queue) {
+        owner_->service_.Requeststream_state2_updates(&context_,
+                                                       &request_,
+                                                       &writer_,
+                                                       queue_,
+                                                       queue_,
+                                                       tag(Event::REQUESTED));
+    }
+
+private:
+    google::protobuf::Empty request_;
+
+    void listen_for_next() override { new Sink2UpdateCall(owner_, queue_); }
+
+    const proj::proto::Sink2Update* reply_for(const std::shared_ptr<const Sink2Broadcast>& broadcast) override {
+        return broadcast->update.get();
+    }
+};
+
+class Server::Sink2DeltaCall : public Server::StreamCall<Server::Sink2Broadcast, proj::proto::Sink2Delta> {
+public:
+    Sink2DeltaCall(Server* server, grpc::ServerCompletionQueue* queue) : StreamCall(server, queue) {
+        owner_->service_.Requeststream_state2_deltas(&context_,
+                                                      &request_,
+                                                      &writer_,
+                                                      queue_,
+                                                      queue_,
+                                                      tag(Event::REQUESTED));
+    }
+
+private:
+    google::protobuf::Empty request_;
+    std::shared_ptr<const proj::proto::Sink2Update> client_state_; // what the client has been sent so far
+    bool notified_ = false; // the client was sent a notice its next value must resolve
+    proj::proto::Sink2Delta delta_; // only used when the client can't be sent the shared delta
+
+    void listen_for_next() override { new Sink2DeltaCall(owner_, queue_); }
+    StreamHandler<Sink2Broadcast>& handler() override { return *owner_->stream_handler_; }
+
+    grpc::Status begin(std::shared_ptr<const Sink2Broadcast>* initial_value) override {
+        owner_->server_tree_->add_subscriber(proj::proto::Sink2::descriptor());
+        *initial_value = owner_->latest_sink2();
+        return grpc::Status::OK;
+    }
+
+    const proj::proto::Sink2Delta* reply_for(const std::shared_ptr<const Sink2Broadcast>& broadcast) override {
+        const proj::proto::Sink2Update& update = *broadcast->update;
+
+        if (not update.has_value()) {
+            notified_ = true;
+            return &broadcast->delta;
+        }
+
+        const proj::proto::Sink2Delta* delta = &delta_;
+
+        if (client_state_ and client_state_ == broadcast->delta_base) {
+            // Caught up, so the delta computed on the stream thread applies
+            delta = &broadcast->delta;
+        } else {
+            // Only after connecting or skipping ahead
+            delta_.Clear();
+            delta_.set_version(update.version());
+            delta_.set_invalidated(update.invalidated());
+
+            if (client_state_) {
+                util::diff_fields(client_state_->value(), update.value(), delta_.mutable_changed());
+                util::apply_field_delta(delta_.changed(), update.value(), delta_.mutable_values());
+            } else {
+                delta_.set_snapshot(true);
+                *delta_.mutable_values() = update.value();
+            }
+        }
+
+        // Kept even when nothing is sent so the next shared delta still applies
+        client_state_ = broadcast->update;
+
+        // A value that resolves a notice is always sent, even if nothing changed
+        if (not delta->snapshot() and delta->changed().paths_size() == 0 and not notified_
+            and not update.invalidated()) {
+            return nullptr; // Nothing the client doesn't already have
+        }
+
+        notified_ = update.invalidated();
+        return delta;
+    }
+
+    void end() override { owner_->server_tree_->remove_subscriber(proj::proto::Sink2::descriptor()); }
+};
+
+class Server::InvalidationCall : public Server::StreamCall<proj::proto::Invalidation, proj::proto::Invalidation> {
+public:
+    InvalidationCall(Server* server, grpc::ServerCompletionQueue* queue) : StreamCall(server, queue) {
+        owner_->service_.Requeststream_invalidations(&context_,
+                                                      &request_,
+                                                      &writer_,
+                                                      queue_,
+                                                      queue_,
+                                                      tag(Event::REQUESTED));
+    }
+
+private:
+    google::protobuf::Empty request_;
+
+    void listen_for_next() override { new InvalidationCall(owner_, queue_); }
+    StreamHandler<proj::proto::Invalidation>& handler() override { return *owner_->invalidation_handler_; }
+
+    grpc::Status begin(std::shared_ptr<const proj::proto::Invalidation>* /*initial_value*/) override {
+        return grpc::Status::OK;
+    }
+
+    const proj::proto::Invalidation* reply_for(const std::shared_ptr<const proj::proto::Invalidation>& value) override {
+        return value.get();
+    }
+};
+
+class Server::SubscribeCall
+    : public Server::StreamCall<NodeUpdate, proj::proto::NodeValue, LatestPerKeyStream<NodeUpdate>> {
+public:
+    SubscribeCall(Server* server, grpc::ServerCompletionQueue* queue)
+        : StreamCall(server, queue), updates_([](const NodeUpdate& update) { return update.element; }) {
+        owner_->service_.Requestsubscribe(&context_, &request_, &writer_, queue_, queue_, tag(Event::REQUESTED));
+    }
+
+private:
+    proj::proto::Subscription request_;
+    // The latest unsent update of each element of the subscribed node, for this client only. A client
+    // that falls behind (or subscribes to a node with many elements) skips to the newest values.
+    LatestPerKeyStream<NodeUpdate> updates_;
+    std::uint64_t watcher_id_ = 0;
+    proj::proto::NodeValue node_value_;
+
+    void listen_for_next() override { new SubscribeCall(owner_, queue_); }
+    LatestPerKeyStream<NodeUpdate>& handler() override { return updates_; }
+
+    grpc::Status begin(std::shared_ptr<const NodeUpdate>* /*initial_value*/) override {
+        const gp::Descriptor* desc = gp::DescriptorPool::generated_pool()->FindMessageTypeByName(request_.node());
+
+        // The current value is pushed right away
+        if (desc) {
+            watcher_id_ = owner_->server_tree_->watch(desc, [this](NodeUpdate update) {
+                updates_.send_data(std::make_shared<const NodeUpdate>(std::move(update)));
+            });
+        }
+        if (watcher_id_ == 0u) {
+            return {grpc::StatusCode::NOT_FOUND, "'" + request_.node() + "' is not a node in the graph"};
+        }
+        return grpc::Status::OK;
+    }
+
+    const proj::proto::NodeValue* reply_for(const std::shared_ptr<const NodeUpdate>& update) override {
+        node_value_.set_node(request_.node());
+        node_value_.set_element(update->element);
+        node_value_.set_version(update->version);
+        node_value_.mutable_value()->PackFrom(*update->value);
+        return &node_value_;
+    }
+
+    void end() override {
+        if (watcher_id_ != 0u) {
+            owner_->server_tree_->unwatch(watcher_id_);
+        }
+    }
+};
+
+void Server::run_completion_queue(grpc::ServerCompletionQueue* queue) {
+    // One call of each kind waits for a client at all times
+    new DispatchActionCall(this, queue);
+    new Sink2Call(this, queue);
+    new Sink2UpdateCall(this, queue);
+    new Sink2DeltaCall(this, queue);
+    new InvalidationCall(this, queue);
+    new SubscribeCall(this, queue);
+
+    void* tag;
+    bool ok;
+    while (queue->Next(&tag, &ok)) {
+        Call::Tag* call_tag = static_cast<Call::Tag*>(tag);
+        call_tag->call->proceed(call_tag->event, ok);
+    }
 }
 
 } // namespace svr
@@ -3,55 +3,171 @@
 #include <proj/server.grpc.pb.h>
 
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
+#include <grpcpp/completion_queue.h>
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <thread>
 #include <unordered_map>
 #include <condition_variable>
 #include <queue>
+#include <vector>
+#include <util/atomic_data.h>
 #include <util/blocking_deque.h>
 #include "../../cmake-build-debug/protos/proto/proj/server.pb.h"
 
 namespace svr {
 class ServerTree;
 
+class SourceBatcher;
+
+class ActionLog;
+
+class DebugExporter;
+
+struct SinkInvalidation;
+
+template <typename T>
+struct SinkValue;
+
+struct NodeUpdate;
+
 class Compute;
 
 template <typename T>
 class StreamHandler;
 
-class Server : private proj::proto::Server::Service {
+struct ServerOptions {
+    // How long a source update may wait for newer updates to coalesce with
+    std::chrono::milliseconds batch_window = std::chrono::milliseconds(2);
+    // Propagate immediately once this many updates are waiting
+    std::size_t max_batch_size = 64;
+    // Number of received source updates that may wait for the propagation thread before
+    // `dispatch_action` calls start yielding
+    std::size_t ingest_queue_size = 1024;
+    // Text format `proj.proto.InitialState` with values for the sources computed at startup.
+    // Sources without a value start from their defaults.
+    std::string initial_state_file = {};
+    // Node values are saved here periodically and on shutdown, and restored from here (instead of
+    // computing the initial state) on startup. Empty disables checkpoints.
+    std::string checkpoint_file = {};
+    std::chrono::seconds checkpoint_interval = std::chrono::seconds(60);
+    // Accepted actions are applied in log order once synced, and replayed on startup. Empty disables the log.
+    std::string action_log_file = {};
+    // Rewrite the log with only the latest value of each source before replaying it
+    bool compact_action_log = true;
+    // Every received `Actions` is appended here with the time it was received (see replay_bench).
+    // Empty disables recording.
+    std::string record_file = {};
+    // Write `nodes.dot.ps` and `server_state.dot.ps` in the background, at most once per interval
+    bool debug_exports = true;
+    std::chrono::milliseconds debug_export_interval = std::chrono::milliseconds(250);
+    // Send the stale Sink2 (with cleared fields) when a propagation invalidates it, instead of a
+    // notice without a value. `stream_invalidations` receives its own notices either way.
+    bool send_invalidated_sinks = false;
+    // Only recompute what a connected Sink2 stream client depends on. Nodes nobody is streaming
+    // are marked stale when their sources change and computed once a client connects.
+    bool lazy_evaluation = false;
+    // Recent values kept for each stream so a slow client can catch up without holding up the others.
+    // Clients further behind skip to the latest Sink2, or are disconnected from `stream_invalidations`.
+    // `subscribe` clients don't use the buffer; they only keep the latest unsent value of each element.
+    std::size_t stream_buffer_size = 64;
+    // Every call is handled on one of these completion queues, each served by a single thread, so the
+    // number of threads doesn't grow with the number of connected clients
+    unsigned num_completion_queues = 2;
+    // Pin the thread of completion queue `i` to core `i` (Linux only)
+    bool pin_completion_threads = true;
+};
+
+class Server {
 public:
-    explicit Server(std::string server_address);
-    ~Server() override;
+    explicit Server(std::string server_address, ServerOptions options = {});
+    ~Server();
+
+    /**
+     * @brief The number of source updates that have been propagated through the graph. Updates are
+     * numbered in the order `dispatch_action` received them (their order in the action log when it
+     * is enabled), starting at 1.
+     */
+    std::uint64_t applied_sequence() const;
+
+    /**
+     * @brief Blocks until an update after `sequence` has been propagated or `max_wait_time_millis` has passed
+     * @return `applied_sequence()`
+     */
+    std::uint64_t wait_for_applied_sequence(std::uint64_t sequence, unsigned max_wait_time_millis) const;
+
+    /**
+     * @brief Compute time, input copy time and invalidation counts of every node (see ServerTree::stats_string)
+     */
+    std::string stats_string() const;
 
 private:
+    // A Sink2 update and its delta from the previous value, shared by every client (defined in server.cpp)
+    struct Sink2Broadcast;
+
     std::string server_address_;
     std::unique_ptr<grpc::Server> server_;
     grpc::reflection::ProtoServerReflectionPlugin plugin_;
+    proj::proto::Server::AsyncService service_;
+
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> completion_queues_;
+    std::vector<std::thread> completion_threads_;
+    // Work that can wait on the graph (subscribing, watching, pushing updates) runs here, in the order
+    // it was queued, so the completion queue threads never block. A null function stops the thread.
+    std::thread call_work_thread_;
+    util::BlockingQueue<std::function<void()>> call_work_queue_;
+    util::AtomicData<std::size_t> active_calls_; // calls that have started and not yet been cleaned up
 
-    std::thread run_thread_;
     std::thread stream_thread_;
-    std::shared_ptr<util::BlockingQueue<proj::proto::Sink2>> stream_queue_;
+    std::thread invalidation_thread_;
+    std::shared_ptr<util::BlockingQueue<SinkValue<proj::proto::Sink2>>> stream_queue_;
+    std::shared_ptr<util::BlockingQueue<SinkInvalidation>> invalidation_queue_;
 
+    std::shared_ptr<DebugExporter> debug_exporter_; // null when exports are disabled
     std::unique_ptr<ServerTree> server_tree_;
-    std::unique_ptr<StreamHandler<proj::proto::Sink2>> stream_handler_;
+    std::unique_ptr<SourceBatcher> source_batcher_;
+    std::unique_ptr<ActionLog> action_log_;
+    std::unique_ptr<ActionLog> recorder_;
+    std::unique_ptr<StreamHandler<Sink2Broadcast>> stream_handler_;
+    std::unique_ptr<StreamHandler<proj::proto::Invalidation>> invalidation_handler_;
 
     std::unique_ptr<Compute> compute_test_;
 
     std::atomic_bool exit_stream_thread_;
 
-    grpc::Status dispatch_action(grpc::ServerContext* context,
-                                 const proj::proto::Actions* request,
-                                 proj::proto::Response* response) override;
-
-    //    grpc::Status
-    //    stream_state2(grpc::ServerContext* context,
-    //                  grpc::ServerReaderWriter<::proj::proto::Sink2, google::protobuf::Empty>* stream) override;
-
-    grpc::Status stream_state2(grpc::ServerContext* context,
-                               const google::protobuf::Empty* request,
-                               grpc::ServerWriter<::proj::proto::Sink2>* writer) override;
+    std::string checkpoint_file_;
+    std::thread checkpoint_thread_;
+    util::AtomicData<bool> exit_checkpoint_thread_;
+
+    // Calls handled on the completion queues (defined in server.cpp)
+    class Call;
+    class DispatchActionCall;
+    template <typename Value, typename Reply, typename Handler = StreamHandler<Value>>
+    class StreamCall;
+    template <typename Reply>
+    class Sink2StreamCall;
+    class Sink2Call;
+    class Sink2UpdateCall;
+    class Sink2DeltaCall;
+    class InvalidationCall;
+    class SubscribeCall;
+
+    void run_completion_queue(grpc::ServerCompletionQueue* queue);
+
+    /**
+     * @brief The current Sink2, which new Sink2 stream clients start from
+     */
+    std::shared_ptr<const Sink2Broadcast> latest_sink2() const;
+
+    /**
+     * @brief Applies the action and calls `respond` with an error message (empty on success) and the
+     * sequence number of the source update (0 if nothing was applied). Once the action log is enabled
+     * the action is only applied (and the response sent) after it is durable.
+     */
+    void dispatch_action(const proj::proto::Actions& request,
+                         std::function<void(std::string error_msg, std::uint64_t sequence)> respond);
 };
 
 } // namespace svr
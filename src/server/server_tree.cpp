@@ -1,18 +1,29 @@
 #include "server/server_tree.h"
+#include "server/debug_exporter.h"
 #include "util/message_util.h"
 #include "util/util.h"
+#include "util/work_stealing_pool.h"
+#include "util/arena_pool.h"
+#include "util/atomic_data.h"
+#include "util/mapped_file.h"
 #include "server_tree.h"
 
 #include <proj/annotations.pb.h>
 
+#include <google/protobuf/io/coded_stream.h>
+
 #include <imgui.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 #include <thread>
 
-#define ADD_SLEEPS
-
 #ifdef ADD_SLEEPS
 #define MAYBE_SLEEP_MS() std::this_thread::sleep_for(std::chrono::milliseconds(1000))
 #else
@@ -24,312 +35,2283 @@ namespace gp = google::protobuf;
 
 namespace svr {
 
+namespace {
+
+// Grows to fit a whole epoch after the first few updates
+constexpr std::size_t initial_epoch_arena_size = 16u * 1024u;
+
+// Node values still on an epoch arena this many epochs later are copied to the heap
+constexpr std::uint64_t max_epoch_arena_age = 8u;
+
+std::uint64_t nanos_since(std::chrono::steady_clock::time_point start) {
+    auto duration = std::chrono::steady_clock::now() - start;
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+// Checkpoints are written in the native byte order. Bump the version whenever the layout changes.
+constexpr char checkpoint_magic[8] = {'P', 'R', 'O', 'J', 'C', 'K', 'P', 'T'};
+constexpr std::uint32_t checkpoint_version = 2;
+
+struct CheckpointHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t num_entries;
+    std::uint64_t index_offset; // entries are stored at the end of the file
+};
+
+// Offsets are from the start of the file
+struct CheckpointEntry {
+    std::uint64_t node_offset; // full name of the node's message type
+    std::uint64_t node_size;
+    std::uint64_t element_offset; // element key, empty unless the node is derived from a keyed collection
+    std::uint64_t element_size;
+    std::uint64_t computed_fields_offset; // serialized non-input fields (the whole value of sources)
+    std::uint64_t computed_fields_size;
+    std::uint64_t valid;
+    std::uint64_t version; // of the snapshot, so restored values aren't mistaken for older ones than they are
+};
+
+} // namespace
+
+// Shared by the steps of one parallel update
+struct ServerTree::ParallelUpdate {
+    ServerTree* tree;
+    const PropagationPlan& plan;
+    std::atomic_bool validity_changed = false;
+    util::AtomicData<std::size_t> steps_left;
+
+    ParallelUpdate(ServerTree* server_tree, const PropagationPlan& propagation_plan)
+        : tree(server_tree), plan(propagation_plan), steps_left(propagation_plan.steps.size()) {}
+};
+
 ServerTree::Computer::~Computer() = default;
 ServerTree::Sink::~Sink() = default;
 
-ServerTree::ServerNode::ServerNode(std::unique_ptr<google::protobuf::Message> msg) : message(std::move(msg)) {
-    debug_name = message->GetDescriptor()->name();
+ServerTree::ServerTree(unsigned num_compute_threads, unsigned num_async_threads, bool use_epoch_arenas)
+    : async_pending_(0u), async_pool_(std::make_unique<util::WorkStealingPool>(num_async_threads)) {
+    if (num_compute_threads > 1) {
+        compute_pool_ = std::make_unique<util::WorkStealingPool>(num_compute_threads);
+    }
+    if (use_epoch_arenas) {
+        arena_pool_ = util::ArenaPool::create(initial_epoch_arena_size);
+    }
+    build_layout();
+    publish_view();
 }
 
-bool ServerTree::update_source(const google::protobuf::Message& message) {
-    NodeKey key = get_key(message);
+ServerTree::~ServerTree() {
+    // Async computations still running are drained by the pool but no longer propagated
+    shutting_down_.store(true);
+    async_pool_ = nullptr;
+}
 
-    auto iter = sources_.find(key);
-    if (iter == sources_.end()) {
-        return false;
+ServerTree::Snapshot::Snapshot(std::shared_ptr<google::protobuf::Arena> msg_arena,
+                               std::atomic<std::size_t>* msg_arena_snapshots,
+                               const google::protobuf::Message& prototype)
+    : arena(std::move(msg_arena)), arena_snapshots(msg_arena_snapshots), message(prototype.New(arena.get())) {
+    if (arena_snapshots) {
+        ++*arena_snapshots;
     }
+}
 
-    // TODO: Error check send back errors before updating server in separate thread
-    // Copy source data into node
-    nodes_.at(key)->message->CopyFrom(message);
+ServerTree::Snapshot::~Snapshot() {
+    // The aliased inputs are owned by their own snapshots. Collection elements are released from the back.
+    for (auto iter = inputs.rbegin(); iter != inputs.rend(); ++iter) {
+        if (iter->first->is_repeated()) {
+            message->GetReflection()->UnsafeArenaReleaseLast(message, iter->first);
+        } else {
+            message->GetReflection()->UnsafeArenaReleaseMessage(message, iter->first);
+        }
+    }
+    // Arena messages are freed with the arena
+    if (not arena) {
+        delete message;
+    }
+    if (arena_snapshots) {
+        --*arena_snapshots;
+    }
+}
 
-    {
-        std::unordered_set<NodeKey> updated_sinks = invalidate_node(key, -1);
+void ServerTree::Snapshot::restore() const {
+    std::call_once(restore_flag, [this] {
+        if (not checkpointed) {
+            return;
+        }
+        alias_inputs(std::move(checkpointed->inputs));
 
-        for (NodeKey sink_key : updated_sinks) {
-            auto& sink = sinks_.at(sink_key);
-            sink->send_data();
+        // Invalid values only keep their inputs
+        if (checkpointed->computed_fields) {
+            gp::io::CodedInputStream stream(reinterpret_cast<const std::uint8_t*>(checkpointed->computed_fields),
+                                            static_cast<int>(checkpointed->computed_fields_size));
+            message->MergeFromCodedStream(&stream);
         }
-    }
 
-    MAYBE_SLEEP_MS();
+        // Releases the file once every value from it is restored
+        checkpointed = nullptr;
+    });
+}
 
-    {
-        std::unordered_set<NodeKey> updated_sinks = update_node(key, -1);
+void ServerTree::Snapshot::alias_inputs(SnapshotInputs snapshot_inputs) const {
+    const gp::Reflection* refl = message->GetReflection();
 
-        for (NodeKey sink_key : updated_sinks) {
-            auto& sink = sinks_.at(sink_key);
-            sink->send_data();
+    for (const auto& input_pair : snapshot_inputs) {
+        input_pair.second->restore();
+
+        if (input_pair.first->is_repeated()) {
+            refl->UnsafeArenaAddAllocatedMessage(message, input_pair.first, input_pair.second->message);
+        } else {
+            refl->UnsafeArenaSetAllocatedMessage(message, input_pair.second->message, input_pair.first);
         }
     }
+    inputs = std::move(snapshot_inputs);
+}
 
-    {
-        std::ofstream graphvis_file("nodes.dot.ps");
-        graphvis_file << graphvis_string();
+ServerTree::ServerNode::ServerNode(const google::protobuf::Message* default_instance) : prototype(default_instance) {
+    debug_name = prototype->GetDescriptor()->name();
+}
+
+ServerTree::ComputedFields::ComputedFields(std::shared_ptr<const util::MappedFile> file, std::string_view bytes)
+    : file_(std::move(file)), bytes_(bytes) {}
+
+void ServerTree::ComputedFields::assign(std::string_view bytes) {
+    // Only this state can add owners so a unique buffer can't gain a reader while it is overwritten
+    if (owned_ and owned_.use_count() == 1) {
+        owned_->assign(bytes.data(), bytes.size());
+    } else {
+        owned_ = std::make_shared<std::string>(bytes);
     }
-    return true;
+    file_ = nullptr;
+    bytes_ = *owned_;
 }
 
-std::string ServerTree::graphvis_string() const {
-    std::stringstream ss;
-    ss << "digraph {\n";
+std::pair<std::map<std::string, ServerTree::NodeState>::iterator, bool>
+ServerTree::ServerNode::add_element(const std::string& element) {
+    auto result = elements.try_emplace(element);
+    if (result.second) {
+        ++invalid_elements;
+        mark_element_dirty(element);
+    }
+    return result;
+}
 
-    for (const auto& node_pair : nodes_) {
-        const ServerNode& node = *node_pair.second;
-        const std::string& node_name = node.debug_name;
+void ServerTree::ServerNode::remove_element(std::map<std::string, NodeState>::iterator iter) {
+    if (not iter->second.valid) {
+        --invalid_elements;
+    }
+    mark_element_dirty(iter->first);
+    elements.erase(iter);
+}
 
-        std::string color;
-        std::string shape;
+void ServerTree::ServerNode::clear_elements() {
+    elements.clear();
+    invalid_elements = 0;
+    dirty_elements.clear();
+    all_elements_dirty = true;
+}
 
-        if (node.outputs.empty()) {
-            color = "azure";
-            shape = "trapezium";
+void ServerTree::ServerNode::set_element_valid(const std::string& element, NodeState* state, bool now_valid) {
+    element_validity_changed(element, state->valid, now_valid);
+    state->valid = now_valid;
+}
 
-        } else if (node.inputs.empty()) {
-            color = "darkolivegreen";
-            shape = "invtrapezium";
+void ServerTree::ServerNode::element_validity_changed(const std::string& element, bool was_valid, bool now_valid) {
+    if (was_valid and not now_valid) {
+        ++invalid_elements;
+    } else if (now_valid and not was_valid) {
+        --invalid_elements;
+    }
+    mark_element_dirty(element);
+}
 
-        } else /*if (node.type == proj::proto::Node::SYNC)*/ {
-            color = "burlywood";
-            shape = "box";
+void ServerTree::ServerNode::mark_element_dirty(const std::string& element) {
+    if (all_elements_dirty) {
+        return;
+    }
+    // Patching more elements than the collection holds costs more than republishing it
+    if (dirty_elements.size() >= elements.size()) {
+        dirty_elements.clear();
+        all_elements_dirty = true;
+        return;
+    }
+    dirty_elements.emplace_back(element);
+}
 
-            //        } else {
-            //            assert(node_type == proj::proto::Node::ASYNC);
-            //            color = "lightsalmon";
-            //            shape = "octagon";
-        }
+bool ServerTree::update_source(const google::protobuf::Message& message) {
+    return update_sources({&message});
+}
 
-        color += (node.valid ? "1" : "4");
+bool ServerTree::update_sources(const std::vector<const google::protobuf::Message*>& messages) {
+    std::vector<NodeKey> keys;
 
-        ss << "\t" << node_name << " [shape=" << shape << ", style=filled, fillcolor=" << color;
-        ss << ", label=<" << node_name << "<font point-size=\"10\">";
+    for (const gp::Message* message : messages) {
+        if (not is_source(*message)) {
+            return false;
+        }
+        NodeKey key = get_key(*message);
+        if (std::find(keys.begin(), keys.end(), key) == keys.end()) {
+            keys.emplace_back(key);
+        }
+    }
 
-        int num_fields = 0;
+    if (keys.empty()) {
+        return true;
+    }
 
-        util::iterate_msg_fields(node.message.get(), [&](const gp::FieldDescriptor* field, int /*index*/) {
-            if (field->cpp_type() != gp::FieldDescriptor::CPPTYPE_MESSAGE) {
-                ss << "<br/>" << field->name() << ": ";
-                util::print_field(ss, *node.message, field, node.message->GetReflection());
-                ++num_fields;
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    begin_epoch();
 
-            } else {
-                // Messages
-                // TODO: print names of non-input messages
-            }
-        });
-        if (num_fields == 0) {
-            ss << "<br/>(no data)";
+    for (NodeKey key : keys) {
+        nodes_.at(key)->epoch_elements.clear();
+    }
+
+    // TODO: Error check send back errors before updating server in separate thread
+    // Copy source data into nodes
+    for (const gp::Message* message : messages) {
+        NodeKey key = get_key(*message);
+        ServerNode& node = *nodes_.at(key);
+
+        auto snapshot = allocate_snapshot(*message);
+        snapshot->message->CopyFrom(*message);
+        snapshot->version = epoch_;
+
+        if (not node.key_field) {
+            node.snapshot = std::move(snapshot);
+            continue;
         }
-        ss << "</font>>]\n";
 
-        for (const auto& output_pair : node.outputs) {
-            const ServerNode& output = *nodes_.at(output_pair.first);
-            const std::string& output_name = output.debug_name;
-            ss << "\t" << node_name << " -> {" << output_name << "} "
-               << "[color=blue4, label=output]"
-               << "\n";
+        std::string element = element_key(*message);
+        if (std::find(node.epoch_elements.begin(), node.epoch_elements.end(), element) == node.epoch_elements.end()) {
+            node.epoch_elements.emplace_back(element);
         }
 
-        for (const auto& input_pair : node.inputs) {
-            const ServerNode& input = *nodes_.at(input_pair.second);
-            const std::string& input_name = input.debug_name;
-            ss << "\t" << input_name << " -> {" << node_name << "} "
-               << "[color=green4, label=input]"
-               << "\n";
+        auto [iter, inserted] = node.add_element(element);
+        iter->second.snapshot = std::move(snapshot);
+        if (inserted) {
+            node.elements_changed_epoch = epoch_;
         }
     }
 
-    ss << "}\n";
+    PropagationPlan batch_plan;
+    if (keys.size() > 1) {
+        batch_plan = compile_plan(keys);
+    }
+    const PropagationPlan& plan = (keys.size() > 1 ? batch_plan : plans_.at(keys.front()));
 
-    return ss.str();
+    run_epoch(keys, plan);
+    end_epoch();
+    return true;
 }
 
-ServerTree::NodeKey ServerTree::get_key(const google::protobuf::Descriptor* desc) {
-    return desc;
-}
+bool ServerTree::remove_source_element(const google::protobuf::Message& message) {
+    if (not is_source(message)) {
+        return false;
+    }
 
-ServerTree::NodeKey ServerTree::get_key(const google::protobuf::Message& message) {
-    return get_key(message.GetDescriptor());
-}
+    NodeKey key = get_key(message);
+    ServerNode& source = *nodes_.at(key);
+    if (not source.key_field) {
+        return false;
+    }
+    std::string element = element_key(message);
 
-ServerTree::NodeKey ServerTree::get_key(google::protobuf::Message* message) {
-    return get_key(*message);
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    if (source.elements.find(element) == source.elements.end()) {
+        return false;
+    }
+
+    begin_epoch();
+    source.epoch_elements.clear();
+
+    // Async computes for the element are cancelled
+    for (auto& node_pair : nodes_) {
+        ServerNode& node = *node_pair.second;
+        auto iter = (node.scope == key ? node.elements.find(element) : node.elements.end());
+        if (iter != node.elements.end()) {
+            supersede_async(&iter->second);
+            node.remove_element(iter);
+            node.elements_changed_epoch = epoch_;
+        }
+    }
+
+    // Keyed sinks never send the element again so their consumers are told it's gone
+    for (const auto& sink_pair : sinks_) {
+        if (nodes_.at(sink_pair.first)->scope == key) {
+            sink_pair.second->sent_element_versions.erase(element);
+            sink_pair.second->awaiting_final.erase(element);
+            for (const auto& queue : invalidation_queues_) {
+                queue->push_back({sink_pair.first, epoch_, {element}, true});
+            }
+        }
+    }
+
+    // Only the nodes that gather the collection have anything to recompute
+    run_epoch({key}, plans_.at(key));
+    end_epoch();
+    return true;
 }
 
-ServerTree::NodeKey ServerTree::build_node(google::protobuf::Message* message) {
-    NodeKey key = get_key(message);
-    util::MsgPkg msg_pkg(message);
+bool ServerTree::initialize_startup_sources(const std::vector<const google::protobuf::Message*>& initial_values) {
+    for (const gp::Message* message : initial_values) {
+        if (not is_source(*message)) {
+            return false;
+        }
+    }
 
-    auto iter = nodes_.find(key);
-    if (iter == nodes_.end()) {
+    // Every source the marked nodes are derived from
+    std::unordered_set<NodeKey> startup_sources;
+    std::unordered_set<NodeKey> visited;
+    std::vector<NodeKey> stack(startup_nodes_.begin(), startup_nodes_.end());
 
-        proj::proto::Node node_type = msg_pkg.desc->options().GetExtension(proj::proto::node);
+    while (not stack.empty()) {
+        NodeKey key = stack.back();
+        stack.pop_back();
 
-        if (node_type == proj::proto::Node::NONE) {
-            return nullptr;
+        if (not visited.emplace(key).second) {
+            continue;
+        }
+        if (sources_.find(key) != sources_.end()) {
+            startup_sources.emplace(key);
+        }
+        for (const auto& input_key_pair : nodes_.at(key)->inputs) {
+            stack.emplace_back(input_key_pair.second);
         }
+    }
 
-        auto node = std::make_unique<ServerNode>(util::clone_msg(*message));
-        std::tie(iter, std::ignore) = nodes_.emplace(key, std::move(node));
-    } else {
-        return key;
+    std::vector<const gp::Message*> messages = initial_values;
+    for (const gp::Message* message : initial_values) {
+        startup_sources.erase(get_key(*message));
+    }
+    for (NodeKey key : startup_sources) {
+        const ServerNode& node = *nodes_.at(key);
+        // A default element would just be an element with an empty key
+        if (not node.key_field) {
+            messages.emplace_back(node.prototype);
+        }
     }
 
-    auto& node = *iter->second;
-    msg_pkg = util::MsgPkg(node.message.get());
+    // Shared descendants are only computed once
+    update_sources(messages);
 
-    util::iterate_msg_fields(*node.message, [&](const gp::FieldDescriptor* field, int field_index) {
-        if (field->is_repeated()) {
-            return; // Temporarily skipping repeated fields
-        }
+    if (lazy_) {
+        std::lock_guard<std::mutex> scoped_lock(update_lock_);
+        pull(std::vector<NodeKey>(startup_nodes_.begin(), startup_nodes_.end()));
+    }
 
-        msg_pkg.set_field_index(field_index);
+    async_pending_.wait_to_use_safely([](std::size_t pending) { return pending == 0; }, [](std::size_t) {});
+    return true;
+}
 
-        if (field->cpp_type() == gp::FieldDescriptor::CPPTYPE_MESSAGE) {
+bool ServerTree::save_checkpoint(const std::string& filename) {
+    struct SavedState {
+        const std::string* node_name;
+        std::string element;
+        ComputedFields computed_fields; // shares the bytes with the graph
+        bool valid;
+        std::uint64_t version;
+    };
+    std::vector<SavedState> saved;
+
+    // Only the states are copied while updates are blocked
+    {
+        std::lock_guard<std::mutex> scoped_lock(update_lock_);
 
-            if (field->containing_oneof()) {
-                util::MsgPkg child_pkg(msg_pkg.refl->MutableMessage(msg_pkg.msg, field));
-                if (child_pkg.desc->options().GetExtension(proj::proto::node) != proj::proto::Node::NONE) {
-                    throw std::runtime_error(child_pkg.desc->name() + " node cannot be part of a 'oneof'");
-                }
+        for (const auto& node_pair : nodes_) {
+            const ServerNode& node = *node_pair.second;
+            const std::string* node_name = &node_pair.first->full_name();
 
-            } else if (auto input = build_node(msg_pkg.refl->MutableMessage(msg_pkg.msg, field))) {
-                node.inputs.emplace(field_index, input);
-                auto& input_node = *nodes_.at(input);
-                input_node.outputs.emplace(key, field_index);
+            if (not node.scope and node.snapshot) {
+                saved.push_back({node_name, "", node.computed_fields, node.valid, node.snapshot->version});
+            }
+            for (const auto& element_pair : node.elements) {
+                if (element_pair.second.snapshot) {
+                    saved.push_back({node_name,
+                                     element_pair.first,
+                                     element_pair.second.computed_fields,
+                                     element_pair.second.valid,
+                                     element_pair.second.snapshot->version});
+                }
             }
-
-            msg_pkg.refl->ClearField(msg_pkg.msg, msg_pkg.field);
         }
-    });
+    }
 
-    if (node.inputs.empty()) {
-        sources_.emplace(key);
-        std::cout << "SOURCE: " << msg_pkg.desc->name() << std::endl;
-    } else {
-        std::cout << node.inputs.size() << " input(s) for " << msg_pkg.desc->name() << std::endl;
+    std::string temp_filename = filename + ".tmp";
+    std::FILE* file = std::fopen(temp_filename.c_str(), "wb");
+    if (not file) {
+        return false;
     }
 
-    return key;
+    CheckpointHeader header = {};
+    std::copy(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic);
+    header.version = checkpoint_version;
+
+    bool written = true;
+    std::uint64_t offset = 0u;
+
+    auto write_blob = [&](const void* data, std::size_t size) {
+        written &= (std::fwrite(data, 1, size, file) == size);
+        std::uint64_t data_offset = offset;
+        offset += size;
+        return data_offset;
+    };
+
+    // The header is rewritten once everything else is, so only complete checkpoints have one
+    write_blob(&header, sizeof(header));
+
+    std::vector<CheckpointEntry> entries;
+    entries.reserve(saved.size());
+
+    for (const SavedState& state : saved) {
+        std::string_view computed_fields = state.computed_fields.bytes();
+
+        CheckpointEntry entry = {};
+        entry.node_offset = write_blob(state.node_name->data(), state.node_name->size());
+        entry.node_size = state.node_name->size();
+        entry.element_offset = write_blob(state.element.data(), state.element.size());
+        entry.element_size = state.element.size();
+        entry.computed_fields_offset = write_blob(computed_fields.data(), computed_fields.size());
+        entry.computed_fields_size = computed_fields.size();
+        entry.valid = state.valid;
+        entry.version = state.version;
+        entries.emplace_back(entry);
+    }
+
+    header.num_entries = entries.size();
+    header.index_offset = write_blob(entries.data(), entries.size() * sizeof(CheckpointEntry));
+
+    written &= (std::fseek(file, 0, SEEK_SET) == 0);
+    written &= (std::fwrite(&header, 1, sizeof(header), file) == sizeof(header));
+
+    // Synced before the rename so a crash can't leave the new name pointing at unwritten data
+    written &= util::sync_to_disk(file);
+    written &= (std::fclose(file) == 0);
+
+    if (not written or std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
 }
 
-std::unordered_set<ServerTree::NodeKey> ServerTree::invalidate_node(NodeKey key, int input_index) {
+bool ServerTree::restore_checkpoint(const std::string& filename) {
+    std::shared_ptr<const util::MappedFile> file = util::MappedFile::open(filename);
+    if (not file or file->size() < sizeof(CheckpointHeader)) {
+        return false;
+    }
 
-    ServerNode& node = *nodes_.at(key);
-    util::MsgPkg msg_pkg(node.message.get());
+    // The mapping has no alignment guarantees so everything is copied out of it
+    CheckpointHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
 
-    if (input_index > -1) {
+    if (not std::equal(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic)
+        or header.version != checkpoint_version or header.index_offset > file->size()
+        or header.num_entries > (file->size() - header.index_offset) / sizeof(CheckpointEntry)) {
+        return false;
+    }
 
-        // Clear all non-input fields and copy parent input
-        util::iterate_msg_fields(msg_pkg.msg, [&](const gp::FieldDescriptor* field, int field_index) {
-            auto iter = node.inputs.find(field_index);
-            if (iter == node.inputs.end()) {
-                msg_pkg.refl->ClearField(msg_pkg.msg, field);
+    std::vector<CheckpointEntry> entries(header.num_entries);
+    std::memcpy(entries.data(), file->data() + header.index_offset, entries.size() * sizeof(CheckpointEntry));
+
+    auto in_bounds = [&file](std::uint64_t blob_offset, std::uint64_t blob_size) {
+        return blob_offset <= file->size() and blob_size <= file->size() - blob_offset;
+    };
+    auto blob_view = [&file](std::uint64_t blob_offset, std::uint64_t blob_size) {
+        return std::string_view(file->data() + blob_offset, blob_size);
+    };
+    auto blob = [&blob_view](std::uint64_t blob_offset, std::uint64_t blob_size) {
+        return std::string(blob_view(blob_offset, blob_size));
+    };
+
+    for (const CheckpointEntry& entry : entries) {
+        if (not in_bounds(entry.node_offset, entry.node_size) or not in_bounds(entry.element_offset, entry.element_size)
+            or not in_bounds(entry.computed_fields_offset, entry.computed_fields_size)
+            or entry.computed_fields_size > std::numeric_limits<int>::max()) {
+            return false;
+        }
+    }
 
-            } else if (input_index == field_index) {
-                const ServerNode& input_node = *nodes_.at(iter->second);
-                msg_pkg.refl->MutableMessage(msg_pkg.msg, field)->CopyFrom(*input_node.message);
-            }
-        });
+    std::unordered_map<std::string, NodeKey> keys_by_name;
+    for (const auto& node_pair : nodes_) {
+        keys_by_name.emplace(node_pair.first->full_name(), node_pair.first);
+    }
+
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
 
-        // Mark as invalid
-        node.valid = false;
+    // Drop the current values, including any async results still being computed
+    for (auto& node_pair : nodes_) {
+        ServerNode& node = *node_pair.second;
+        for (auto& element_pair : node.elements) {
+            supersede_async(&element_pair.second);
+        }
+        supersede_async(&node);
+
+        NodeState reset;
+        reset.generation = node.generation;
+        static_cast<NodeState&>(node) = std::move(reset);
+        node.clear_elements();
+        node.deferred = false;
     }
 
-    if (not node.outputs.empty()) {
+    struct RestoredState {
+        ServerNode* node;
+        NodeState* state;
+        const std::string* element;
+    };
+    std::vector<RestoredState> restored;
+
+    // Create every value first so they can point at each other
+    for (const CheckpointEntry& entry : entries) {
+        auto key_iter = keys_by_name.find(blob(entry.node_offset, entry.node_size));
+        if (key_iter == keys_by_name.end()) {
+            continue;
+        }
+
+        ServerNode& node = *nodes_.at(key_iter->second);
+        std::string element = blob(entry.element_offset, entry.element_size);
+        if (node.scope == nullptr and not element.empty()) {
+            continue;
+        }
 
-        std::unordered_set<NodeKey> updated_sinks;
+        const std::string* element_ptr = nullptr;
+        NodeState* state = &node;
+        if (node.scope) {
+            auto element_iter = node.add_element(element).first;
+            element_ptr = &element_iter->first;
+            state = &element_iter->second;
+        }
 
-        // Invalidate all children nodes
-        for (const auto& output_key_pair : node.outputs) {
-            auto sinks = invalidate_node(output_key_pair.first, output_key_pair.second);
-            updated_sinks.insert(sinks.begin(), sinks.end());
+        auto snapshot = std::make_shared<Snapshot>(nullptr, nullptr, *node.prototype);
+        snapshot->version = entry.version;
+        snapshot->checkpointed = std::make_unique<Snapshot::Checkpointed>();
+        snapshot->checkpointed->file = file;
+        if (entry.valid) {
+            snapshot->checkpointed->computed_fields = file->data() + entry.computed_fields_offset;
+            snapshot->checkpointed->computed_fields_size = entry.computed_fields_size;
+        }
+
+        state->snapshot = std::move(snapshot);
+        if (element_ptr) {
+            node.set_element_valid(*element_ptr, state, entry.valid);
+        } else {
+            state->valid = entry.valid;
         }
-        return updated_sinks;
+        // Viewed in place until the state is recomputed
+        state->computed_fields = ComputedFields(file,
+                                                blob_view(entry.computed_fields_offset, entry.computed_fields_size));
+        state->outputs_current = entry.valid;
+        restored.push_back({&node, state, element_ptr});
+
+        // Later updates must be newer than every restored value
+        epoch_ = std::max(epoch_, entry.version);
+    }
+
+    for (const RestoredState& restored_state : restored) {
+        restored_state.state->snapshot->checkpointed->inputs = input_snapshots(*restored_state.node,
+                                                                               restored_state.element);
     }
 
-    // Must be a sink
-    assert(sinks_.find(key) != sinks_.end());
-    auto& sink = sinks_.at(key);
-    sink->get_data()->CopyFrom(*node.message);
-    return {key};
+    resume_interrupted_nodes();
+    publish_view();
+    return true;
 }
 
-std::unordered_set<ServerTree::NodeKey> ServerTree::update_node(NodeKey key, int input_index) {
+void ServerTree::resume_interrupted_nodes() {
+    std::vector<NodeKey> roots(sources_.begin(), sources_.end());
+    PropagationPlan plan = compile_plan(roots);
 
-    ServerNode& node = *nodes_.at(key);
-    util::MsgPkg msg_pkg(node.message.get());
+    begin_epoch();
 
-    bool valid_before = node.valid;
+    // Invalid nodes with valid inputs were interrupted while computing. Running them in topological
+    // order lets each one see the results of the ones before it.
+    for (const PropagationStep& step : plan.steps) {
+        ServerNode& node = *nodes_.at(step.key);
+        PropagationStep resume_step{step.key, {}};
 
-    // Check if all inputs are valid
-    node.valid = true;
-    for (const auto& input_key_pair : node.inputs) {
-        const ServerNode& input_node = *nodes_.at(input_key_pair.second);
-        node.valid &= input_node.valid;
+        auto resume = [&](NodeState* state, const std::string* element) {
+            bool inputs_valid = true;
+            for (const auto& input_key_pair : node.inputs) {
+                inputs_valid &= input_valid(node, input_key_pair.first, element);
+            }
+            if (state->snapshot and not state->valid and inputs_valid) {
+                update_state(resume_step, &node, state, element);
+                if (element) {
+                    node.element_validity_changed(*element, false, state->valid);
+                }
+            }
+        };
 
-        if (input_index == input_key_pair.first) {
-            msg_pkg.set_field_index(input_key_pair.first);
-            msg_pkg.refl->MutableMessage(msg_pkg.msg, msg_pkg.field)->CopyFrom(*input_node.message);
+        if (not node.scope) {
+            resume(&node, nullptr);
+        }
+        for (auto& element_pair : node.elements) {
+            resume(&element_pair.second, &element_pair.first);
         }
     }
 
-    if (node.valid) {
-        // Run the registered compute function if it exists
-        auto iter = compute_functions_.find(key);
-        if (iter != compute_functions_.end()) {
-            // TODO: make COMPUTE_FUNC macro
-            iter->second->compute(msg_pkg.msg);
+    // Nodes lazy evaluation skips are left to be computed when they are next needed
+    for (NodeKey key : plan.deferred) {
+        ServerNode& node = *nodes_.at(key);
+        node.deferred = (not node.scope and not node.valid);
+        for (const auto& element_pair : node.elements) {
+            node.deferred |= not element_pair.second.valid;
+        }
+        for (const auto& input_key_pair : node.inputs) {
+            node.deferred |= nodes_.at(input_key_pair.second)->deferred;
         }
     }
 
-    if (valid_before != node.valid) {
-        {
-            std::ofstream graphvis_file("nodes.dot.ps");
-            graphvis_file << graphvis_string();
+    end_epoch();
+}
+
+bool ServerTree::is_source(const google::protobuf::Message& message) const {
+    return sources_.find(get_key(message)) != sources_.end();
+}
+
+std::string ServerTree::element_key(const google::protobuf::Message& message) const {
+    auto iter = nodes_.find(get_key(message));
+    if (iter == nodes_.end() or not iter->second->key_field) {
+        return "";
+    }
+
+    const gp::FieldDescriptor* field = iter->second->key_field;
+    const gp::Reflection* refl = message.GetReflection();
+
+    switch (field->cpp_type()) {
+    case gp::FieldDescriptor::CPPTYPE_STRING:
+        return refl->GetString(message, field);
+    case gp::FieldDescriptor::CPPTYPE_INT32:
+        return std::to_string(refl->GetInt32(message, field));
+    case gp::FieldDescriptor::CPPTYPE_INT64:
+        return std::to_string(refl->GetInt64(message, field));
+    case gp::FieldDescriptor::CPPTYPE_UINT32:
+        return std::to_string(refl->GetUInt32(message, field));
+    case gp::FieldDescriptor::CPPTYPE_UINT64:
+        return std::to_string(refl->GetUInt64(message, field));
+    default:
+        // Rejected when the node is built
+        assert(false);
+        return "";
+    }
+}
+
+std::shared_ptr<const ServerTree::GraphView> ServerTree::view() const {
+    return std::atomic_load(&view_);
+}
+
+std::string ServerTree::graphvis_string() const {
+    return view()->graphvis_string();
+}
+
+void ServerTree::set_debug_exporter(std::shared_ptr<DebugExporter> exporter) {
+    debug_exporter_ = std::move(exporter);
+}
+
+void ServerTree::set_lazy_evaluation(bool lazy) {
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    lazy_ = lazy;
+    update_demand();
+
+    if (not lazy_) {
+        std::vector<NodeKey> stale;
+        for (const auto& node_pair : nodes_) {
+            if (node_pair.second->deferred) {
+                stale.emplace_back(node_pair.first);
+            }
         }
-        MAYBE_SLEEP_MS();
+        pull(stale);
     }
+}
 
-    if (not node.outputs.empty()) {
-        std::unordered_set<NodeKey> updated_sinks;
+bool ServerTree::add_subscriber(const google::protobuf::Descriptor* desc) {
+    NodeKey key = get_key(desc);
+    if (sinks_.find(key) == sinks_.end()) {
+        return false;
+    }
 
-        // Update children
-        for (const auto& output_key_pair : node.outputs) {
-            auto sinks = update_node(output_key_pair.first, output_key_pair.second);
-            updated_sinks.insert(sinks.begin(), sinks.end());
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    if (++subscribers_[key] == 1u and lazy_) {
+        update_demand();
+        pull({key});
+    }
+    return true;
+}
+
+bool ServerTree::remove_subscriber(const google::protobuf::Descriptor* desc) {
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+
+    auto iter = subscribers_.find(get_key(desc));
+    if (iter == subscribers_.end()) {
+        return false;
+    }
+    if (--iter->second == 0u) {
+        subscribers_.erase(iter);
+        if (lazy_) {
+            update_demand();
         }
-        return updated_sinks;
     }
+    return true;
+}
 
-    assert(sinks_.find(key) != sinks_.end());
-    auto& sink = sinks_.at(key);
-    sink->get_data()->CopyFrom(*node.message);
-    return {key};
+std::shared_ptr<const ServerTree::GraphView> ServerTree::evaluate(const google::protobuf::Descriptor* desc) {
+    NodeKey key = get_key(desc);
+    nodes_.at(key);
+
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    pull({key});
+    return view();
 }
 
-std::unordered_set<gp::Message*> ServerTree::copy_node_to_messages(
-    const ServerNode& node, int field_index, const std::unordered_set<gp::Message*>& parent_msgs) {
-    std::unordered_set<gp::Message*> msgs_to_return;
+std::uint64_t ServerTree::watch(const google::protobuf::Descriptor* desc, std::function<void(NodeUpdate)> push) {
+    NodeKey key = get_key(desc);
+    if (nodes_.find(key) == nodes_.end()) {
+        return 0u;
+    }
 
-    for (gp::Message* msg : parent_msgs) {
-        util::MsgPkg data_pkg(msg);
-        data_pkg.set_field_index(field_index);
-        gp::Message* msg_to_update = data_pkg.refl->MutableMessage(data_pkg.msg, data_pkg.field);
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    std::uint64_t watcher_id = ++last_watcher_id_;
+    Watcher& watcher = watchers_.emplace(watcher_id, Watcher{key, std::move(push)}).first->second;
 
-#if 1
-        msg_to_update->CopyFrom(*node.message);
-#else
-        util::iterate_msg_fields(msg_to_update, [&](const gp::FieldDescriptor*, int input_index) {
-            if (node.inputs.find(input_index) == node.inputs.end()) {
-                util::copy_field(msg_to_update, *node.message, input_index);
-            }
-        });
-#endif
+    std::vector<Watcher*>& node_watchers = watched_nodes_[key];
+    node_watchers.emplace_back(&watcher);
+
+    // Only the first watcher of a node changes what lazy evaluation computes
+    if (node_watchers.size() == 1u and lazy_) {
+        update_demand();
+        pull({key});
+    }
 
-        msgs_to_return.emplace(msg_to_update);
+    // Start from the current value (unless pulling the node just pushed it)
+    send_watched(&watcher, /*all_elements=*/true);
+    return watcher_id;
+}
+
+bool ServerTree::unwatch(std::uint64_t watcher_id) {
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    auto iter = watchers_.find(watcher_id);
+    if (iter == watchers_.end()) {
+        return false;
+    }
+
+    auto node_iter = watched_nodes_.find(iter->second.key);
+    std::vector<Watcher*>& node_watchers = node_iter->second;
+    node_watchers.erase(std::find(node_watchers.begin(), node_watchers.end(), &iter->second));
+    watchers_.erase(iter);
+
+    if (node_watchers.empty()) {
+        watched_nodes_.erase(node_iter);
+        if (lazy_) {
+            update_demand();
+        }
+    }
+    return true;
+}
+
+bool ServerTree::add_sink(std::unique_ptr<Sink> data, SinkEmission emission) {
+    data->emission = emission;
+
+    auto key = get_key(data->get_data());
+    if (sinks_.find(key) != sinks_.end()) {
+        return false;
+    }
+
+    auto sink_key = build_node(data->get_data());
+    assert(key == sink_key);
+    sinks_.emplace(sink_key, std::move(data));
+
+    compile_plans();
+    build_layout();
+    publish_view();
+
+    return true;
+}
+
+void ServerTree::add_invalidation_output(std::shared_ptr<util::BlockingQueue<SinkInvalidation>> queue) {
+    invalidation_queues_.emplace_back(std::move(queue));
+}
+
+const ServerTree::NodeStats& ServerTree::stats(const google::protobuf::Descriptor* desc) const {
+    return get_node(desc).stats;
+}
+
+std::string ServerTree::stats_string() const {
+    std::vector<const ServerNode*> nodes;
+    for (const auto& node_pair : nodes_) {
+        nodes.emplace_back(node_pair.second.get());
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const ServerNode* lhs, const ServerNode* rhs) {
+        return lhs->stats.compute_nanos.total() > rhs->stats.compute_nanos.total();
+    });
+
+    auto micros = [](std::uint64_t nanos) { return static_cast<double>(nanos) * 1e-3; };
+
+    std::stringstream stats_stream;
+    for (const ServerNode* node : nodes) {
+        const NodeStats& stats = node->stats;
+        const util::LatencyHistogram& compute = stats.compute_nanos;
+
+        stats_stream << node->debug_name << ": " << compute.count() << " computes";
+        if (compute.count() > 0u) {
+            stats_stream << " (p50 " << micros(compute.percentile(0.5)) << " us, p99 "
+                         << micros(compute.percentile(0.99)) << " us, max " << micros(compute.max())
+                         << " us, total " << micros(compute.total()) << " us)";
+        }
+        stats_stream << ", " << stats.input_copy_nanos.count() << " input copies (total "
+                     << micros(stats.input_copy_nanos.total()) << " us), " << stats.invalidations.load()
+                     << " invalidations, " << stats.cancelled_computes.load() << " cancelled\n";
+    }
+    return stats_stream.str();
+}
+
+std::uint64_t ServerTree::GraphView::version() const {
+    return version_;
+}
+
+std::shared_ptr<const google::protobuf::Message>
+ServerTree::GraphView::value(const google::protobuf::Descriptor* desc) const {
+    const NodeState* node = find_node(desc);
+    if (not node or not node->snapshot) {
+        return nullptr;
+    }
+    node->snapshot->restore();
+    // Shares ownership of the snapshot
+    return std::shared_ptr<const gp::Message>(node->snapshot, node->snapshot->message);
+}
+
+std::shared_ptr<const google::protobuf::Message> ServerTree::GraphView::value(const google::protobuf::Descriptor* desc,
+                                                                              const std::string& element) const {
+    const ElementState* state = find_element(desc, element);
+    if (not state or not state->snapshot) {
+        return nullptr;
+    }
+    state->snapshot->restore();
+    return std::shared_ptr<const gp::Message>(state->snapshot, state->snapshot->message);
+}
+
+bool ServerTree::GraphView::valid(const google::protobuf::Descriptor* desc) const {
+    const NodeState* node = find_node(desc);
+    return node and node->valid;
+}
+
+bool ServerTree::GraphView::valid(const google::protobuf::Descriptor* desc, const std::string& element) const {
+    const ElementState* state = find_element(desc, element);
+    return state and state->valid;
+}
+
+std::uint64_t ServerTree::GraphView::value_version(const google::protobuf::Descriptor* desc) const {
+    const NodeState* node = find_node(desc);
+    return (node and node->snapshot ? node->snapshot->version : 0u);
+}
+
+std::uint64_t ServerTree::GraphView::value_version(const google::protobuf::Descriptor* desc,
+                                                   const std::string& element) const {
+    const ElementState* state = find_element(desc, element);
+    return (state and state->snapshot ? state->snapshot->version : 0u);
+}
+
+std::vector<std::string> ServerTree::GraphView::element_keys(const google::protobuf::Descriptor* desc) const {
+    std::vector<std::string> keys;
+    const NodeState* node = find_node(desc);
+    if (node) {
+        node->elements.for_each([&keys](const std::string& key, const ElementState&) { keys.emplace_back(key); });
+    }
+    return keys;
+}
+
+const ServerTree::GraphView::NodeState*
+ServerTree::GraphView::find_node(const google::protobuf::Descriptor* desc) const {
+    if (not layout_) {
+        return nullptr;
+    }
+    auto iter = layout_->indices.find(get_key(desc));
+    return (iter == layout_->indices.end() ? nullptr : &nodes_[iter->second]);
+}
+
+const ServerTree::GraphView::ElementState*
+ServerTree::GraphView::find_element(const google::protobuf::Descriptor* desc, const std::string& element) const {
+    const NodeState* node = find_node(desc);
+    return (node ? node->elements.find(element) : nullptr);
+}
+
+std::string ServerTree::GraphView::graphvis_string() const {
+    std::stringstream ss;
+    ss << "digraph {\n";
+
+    for (auto i = 0u; layout_ and i < layout_->nodes.size(); ++i) {
+        const GraphLayout::NodeLayout& node = layout_->nodes[i];
+        const NodeState& state = nodes_[i];
+        const std::string& node_name = node.debug_name;
+
+        std::string color;
+        std::string shape;
+
+        if (node.outputs.empty()) {
+            color = "azure";
+            shape = "trapezium";
+
+        } else if (node.inputs.empty()) {
+            color = "darkolivegreen";
+            shape = "invtrapezium";
+
+        } else if (node.type == proj::proto::Node::SYNC) {
+            color = "burlywood";
+            shape = "box";
+
+        } else {
+            assert(node.type == proj::proto::Node::ASYNC);
+            color = "lightsalmon";
+            shape = "octagon";
+        }
+
+        color += (state.valid ? "1" : "4");
+
+        ss << "\t" << node_name << " [shape=" << shape << ", style=filled, fillcolor=" << color;
+        ss << ", label=<" << node_name << "<font point-size=\"10\">";
+
+        int num_fields = 0;
+
+        if (state.snapshot) {
+            state.snapshot->restore();
+        }
+        const gp::Message& message = (state.snapshot ? *state.snapshot->message : *node.prototype);
+
+        util::iterate_msg_fields(message, [&](const gp::FieldDescriptor* field, int /*index*/) {
+            if (state.keyed) {
+                return; // Too many values to show
+            }
+            if (field->cpp_type() != gp::FieldDescriptor::CPPTYPE_MESSAGE) {
+                ss << "<br/>" << field->name() << ": ";
+                util::print_field(ss, message, field, message.GetReflection());
+                ++num_fields;
+
+            } else {
+                // Messages
+                // TODO: print names of non-input messages
+            }
+        });
+        if (state.keyed) {
+            ss << "<br/>(" << state.elements.size() << " elements)";
+        } else if (num_fields == 0) {
+            ss << "<br/>(no data)";
+        }
+        ss << "</font>>]\n";
+
+        for (NodeKey output_key : node.outputs) {
+            const std::string& output_name = layout_->nodes[layout_->indices.at(output_key)].debug_name;
+            ss << "\t" << node_name << " -> {" << output_name << "} "
+               << "[color=blue4, label=output]"
+               << "\n";
+        }
+
+        for (NodeKey input_key : node.inputs) {
+            const std::string& input_name = layout_->nodes[layout_->indices.at(input_key)].debug_name;
+            ss << "\t" << input_name << " -> {" << node_name << "} "
+               << "[color=green4, label=input]"
+               << "\n";
+        }
+    }
+
+    ss << "}\n";
+
+    return ss.str();
+}
+
+ServerTree::NodeKey ServerTree::get_key(const google::protobuf::Descriptor* desc) {
+    return desc;
+}
+
+ServerTree::NodeKey ServerTree::get_key(const google::protobuf::Message& message) {
+    return get_key(message.GetDescriptor());
+}
+
+ServerTree::NodeKey ServerTree::get_key(google::protobuf::Message* message) {
+    return get_key(*message);
+}
+
+ServerTree::NodeKey ServerTree::build_node(google::protobuf::Message* message) {
+    NodeKey key = get_key(message);
+    util::MsgPkg msg_pkg(message);
+
+    auto iter = nodes_.find(key);
+    if (iter == nodes_.end()) {
+
+        proj::proto::Node node_type = msg_pkg.desc->options().GetExtension(proj::proto::node);
+
+        if (node_type == proj::proto::Node::NONE) {
+            return nullptr;
+        }
+
+        auto node = std::make_unique<ServerNode>(msg_pkg.refl->GetMessageFactory()->GetPrototype(msg_pkg.desc));
+        node->type = node_type;
+        std::tie(iter, std::ignore) = nodes_.emplace(key, std::move(node));
+    } else {
+        return key;
+    }
+
+    auto& node = *iter->second;
+
+    // Only used to walk the message structure
+    std::unique_ptr<gp::Message> scratch = util::clone_msg(*message);
+    msg_pkg = util::MsgPkg(scratch.get());
+
+    util::iterate_msg_fields(*scratch, [&](const gp::FieldDescriptor* field, int field_index) {
+        msg_pkg.set_field_index(field_index);
+
+        if (field->cpp_type() == gp::FieldDescriptor::CPPTYPE_MESSAGE) {
+
+            if (field->containing_oneof()) {
+                util::MsgPkg child_pkg(msg_pkg.refl->MutableMessage(msg_pkg.msg, field));
+                if (child_pkg.desc->options().GetExtension(proj::proto::node) != proj::proto::Node::NONE) {
+                    throw std::runtime_error(child_pkg.desc->name() + " node cannot be part of a 'oneof'");
+                }
+
+            } else if (auto input = build_node(field->is_repeated() ? msg_pkg.refl->AddMessage(msg_pkg.msg, field)
+                                                                    : msg_pkg.refl->MutableMessage(msg_pkg.msg, field))) {
+                // Repeated fields gather every element of a keyed collection
+                node.inputs.emplace(field_index, input);
+                auto& input_node = *nodes_.at(input);
+                input_node.outputs.emplace(key, field_index);
+
+                if (field->options().GetExtension(proj::proto::initialize_on_startup)) {
+                    startup_nodes_.emplace(input);
+                }
+            }
+
+            msg_pkg.refl->ClearField(msg_pkg.msg, msg_pkg.field);
+        }
+    });
+
+    assign_scope(key);
+
+    if (node.inputs.empty()) {
+        sources_.emplace(key);
+        std::cout << "SOURCE: " << msg_pkg.desc->name() << std::endl;
+    } else {
+        std::cout << node.inputs.size() << " input(s) for " << msg_pkg.desc->name() << std::endl;
+    }
+
+    return key;
+}
+
+void ServerTree::assign_scope(NodeKey key) {
+    ServerNode& node = *nodes_.at(key);
+    const gp::Descriptor* desc = node.prototype->GetDescriptor();
+    const std::string& key_field_name = desc->options().GetExtension(proj::proto::collection_key);
+
+    if (not key_field_name.empty()) {
+        if (not node.inputs.empty()) {
+            throw std::runtime_error(desc->name() + " has node inputs so it can't be a keyed collection");
+        }
+
+        node.key_field = desc->FindFieldByName(key_field_name);
+        bool valid_key = (node.key_field and not node.key_field->is_repeated());
+
+        if (valid_key) {
+            switch (node.key_field->cpp_type()) {
+            case gp::FieldDescriptor::CPPTYPE_STRING:
+            case gp::FieldDescriptor::CPPTYPE_INT32:
+            case gp::FieldDescriptor::CPPTYPE_INT64:
+            case gp::FieldDescriptor::CPPTYPE_UINT32:
+            case gp::FieldDescriptor::CPPTYPE_UINT64:
+                break;
+            default:
+                valid_key = false;
+            }
+        }
+
+        if (not valid_key) {
+            throw std::runtime_error(desc->name() + " collection_key '" + key_field_name
+                                     + "' must name a singular string or integer field");
+        }
+        node.scope = key;
+        return;
+    }
+
+    // Nodes with an input derived from a keyed collection have one element per key
+    for (const auto& input_key_pair : node.inputs) {
+        const gp::FieldDescriptor* field = desc->field(input_key_pair.first);
+        const ServerNode& input = *nodes_.at(input_key_pair.second);
+
+        if (field->is_repeated()) {
+            if (not input.scope) {
+                throw std::runtime_error(desc->name() + "." + field->name()
+                                         + " can only repeat a node derived from a keyed collection");
+            }
+
+        } else if (input.scope) {
+            if (node.scope and node.scope != input.scope) {
+                throw std::runtime_error(desc->name() + " has inputs from more than one keyed collection");
+            }
+            node.scope = input.scope;
+        }
+    }
+}
+
+void ServerTree::compile_plans() {
+    plans_.clear();
+    for (const auto& node_pair : nodes_) {
+        // Async nodes act as roots when their results land
+        if (sources_.find(node_pair.first) != sources_.end() or node_pair.second->type == proj::proto::Node::ASYNC) {
+            plans_.emplace(node_pair.first, compile_plan({node_pair.first}));
+        }
+    }
+}
+
+ServerTree::PropagationPlan ServerTree::compile_plan(const std::vector<NodeKey>& roots) const {
+    std::unordered_set<NodeKey> root_set(roots.begin(), roots.end());
+
+    // Depth first post-order traversal of the outputs. Reversing it gives a topological ordering.
+    std::vector<NodeKey> post_order;
+    std::unordered_set<NodeKey> visited;
+
+    std::vector<std::pair<NodeKey, bool>> stack;
+    for (NodeKey root : roots) {
+        stack.emplace_back(root, false);
+    }
+    while (not stack.empty()) {
+        auto [key, children_visited] = stack.back();
+        stack.pop_back();
+
+        if (children_visited) {
+            post_order.emplace_back(key);
+            continue;
+        }
+
+        if (not visited.emplace(key).second) {
+            continue;
+        }
+
+        stack.emplace_back(key, true);
+        for (const auto& output_key_pair : nodes_.at(key)->outputs) {
+            if (visited.find(output_key_pair.first) == visited.end()) {
+                stack.emplace_back(output_key_pair.first, false);
+            }
+        }
+    }
+
+    PropagationPlan plan;
+    std::unordered_map<NodeKey, std::size_t> step_indices;
+
+    for (auto iter = post_order.rbegin(); iter != post_order.rend(); ++iter) {
+        NodeKey key = *iter;
+        const ServerNode& node = *nodes_.at(key);
+        bool is_root = (root_set.find(key) != root_set.end());
+
+        // Nothing a demanded node depends on can be undemanded, so deferred nodes never feed a step
+        if (not is_demanded(key)) {
+            if (not is_root) {
+                plan.deferred.emplace_back(key);
+            }
+            continue;
+        }
+
+        if (not is_root) {
+            std::size_t step_index = plan.steps.size();
+            PropagationStep step{key, {}};
+
+            // Every affected node is visited, so all inputs in the visited set change
+            for (const auto& input_key_pair : node.inputs) {
+                if (visited.find(input_key_pair.second) == visited.end()) {
+                    continue;
+                }
+                step.changed_inputs.emplace_back(input_key_pair.first);
+
+                // Roots are updated before any of the steps run
+                if (root_set.find(input_key_pair.second) == root_set.end()) {
+                    ++step.num_step_inputs;
+                    plan.steps[step_indices.at(input_key_pair.second)].dependents.emplace_back(step_index);
+                }
+            }
+            step_indices.emplace(key, step_index);
+            plan.steps.emplace_back(std::move(step));
+        }
+
+        if (node.outputs.empty()) {
+            // Must be a sink
+            assert(sinks_.find(key) != sinks_.end());
+            plan.sinks.emplace_back(key);
+        }
+    }
+
+    return plan;
+}
+
+bool ServerTree::is_demanded(NodeKey key) const {
+    return not lazy_ or demanded_.find(key) != demanded_.end();
+}
+
+void ServerTree::update_demand() {
+    demanded_.clear();
+
+    std::vector<NodeKey> stack;
+    for (const auto& subscriber_pair : subscribers_) {
+        stack.emplace_back(subscriber_pair.first);
+    }
+    for (const auto& watched_pair : watched_nodes_) {
+        stack.emplace_back(watched_pair.first);
+    }
+    while (not stack.empty()) {
+        NodeKey key = stack.back();
+        stack.pop_back();
+
+        if (not demanded_.emplace(key).second) {
+            continue;
+        }
+        for (const auto& input_key_pair : nodes_.at(key)->inputs) {
+            stack.emplace_back(input_key_pair.second);
+        }
+    }
+
+    compile_plans();
+}
+
+void ServerTree::defer_node(ServerNode* node) {
+    if (node->deferred) {
+        return;
+    }
+    node->deferred = true;
+    ++node->stats.invalidations;
+
+    // The stale values are kept (and never read) until the node is pulled
+    node->valid = false;
+    supersede_async(node);
+    for (auto& element_pair : node->elements) {
+        element_pair.second.valid = false;
+        supersede_async(&element_pair.second);
+    }
+    node->invalid_elements = node->elements.size();
+    node->dirty_elements.clear();
+    node->all_elements_dirty = true;
+}
+
+bool ServerTree::pull(const std::vector<NodeKey>& targets) {
+    // Depth first post-order traversal of the deferred inputs gives a topological ordering
+    std::vector<NodeKey> post_order;
+    std::unordered_set<NodeKey> visited;
+
+    std::vector<std::pair<NodeKey, bool>> stack;
+    for (NodeKey target : targets) {
+        stack.emplace_back(target, false);
+    }
+    while (not stack.empty()) {
+        auto [key, inputs_visited] = stack.back();
+        stack.pop_back();
+
+        if (inputs_visited) {
+            post_order.emplace_back(key);
+            continue;
+        }
+
+        // Nodes that aren't deferred only depend on nodes that aren't deferred
+        if (not nodes_.at(key)->deferred or not visited.emplace(key).second) {
+            continue;
+        }
+
+        stack.emplace_back(key, true);
+        for (const auto& input_key_pair : nodes_.at(key)->inputs) {
+            stack.emplace_back(input_key_pair.second, false);
+        }
+    }
+
+    if (post_order.empty()) {
+        return false;
+    }
+
+    begin_epoch();
+    for (NodeKey key : post_order) {
+        ServerNode& node = *nodes_.at(key);
+        node.deferred = false;
+
+        PropagationStep step{key, {}};
+        for (const auto& input_key_pair : node.inputs) {
+            step.changed_inputs.emplace_back(input_key_pair.first);
+        }
+        step.pulled = true;
+        update_node(step);
+    }
+    publish_view();
+
+    for (NodeKey key : post_order) {
+        auto iter = sinks_.find(key);
+        if (iter != sinks_.end() and is_demanded(key)) {
+            send_sink(*nodes_.at(key), iter->second.get());
+        }
+        send_to_watchers(key);
+    }
+    end_epoch();
+    return true;
+}
+
+void ServerTree::build_layout() {
+    auto layout = std::make_shared<GraphLayout>();
+
+    for (const auto& node_pair : nodes_) {
+        const ServerNode& node = *node_pair.second;
+        GraphLayout::NodeLayout node_layout{node_pair.first, node.prototype, node.type, node.debug_name, {}, {}};
+
+        for (const auto& input_key_pair : node.inputs) {
+            node_layout.inputs.emplace_back(input_key_pair.second);
+        }
+        for (const auto& output_key_pair : node.outputs) {
+            node_layout.outputs.emplace_back(output_key_pair.first);
+        }
+
+        layout->indices.emplace(node_pair.first, layout->nodes.size());
+        layout->nodes.emplace_back(std::move(node_layout));
+    }
+
+    layout_ = std::move(layout);
+}
+
+void ServerTree::publish_view() {
+    std::shared_ptr<GraphView> view = std::move(spare_view_);
+    if (not view) {
+        view = std::make_shared<GraphView>();
+    }
+    view->layout_ = layout_;
+    view->version_ = ++view_version_;
+
+    view->nodes_.reserve(layout_->nodes.size());
+    for (const GraphLayout::NodeLayout& node_layout : layout_->nodes) {
+        ServerNode& node = *nodes_.at(node_layout.key);
+
+        if (not node.scope) {
+            view->nodes_.push_back({node.snapshot, node.valid, false, {}});
+            continue;
+        }
+
+        // Only the changed elements are copied, the rest are shared with earlier views
+        if (node.all_elements_dirty) {
+            GraphView::ElementStates elements;
+            for (const auto& element_pair : node.elements) {
+                elements = elements.insert_or_assign(
+                    element_pair.first,
+                    GraphView::ElementState{element_pair.second.snapshot, element_pair.second.valid});
+            }
+            node.published_elements = std::move(elements);
+        } else {
+            for (const std::string& element : node.dirty_elements) {
+                auto iter = node.elements.find(element);
+                if (iter == node.elements.end()) {
+                    node.published_elements = node.published_elements.erase(element);
+                } else {
+                    node.published_elements = node.published_elements.insert_or_assign(
+                        element,
+                        GraphView::ElementState{iter->second.snapshot, iter->second.valid});
+                }
+            }
+        }
+        node.dirty_elements.clear();
+        node.all_elements_dirty = false;
+
+        view->nodes_.push_back({nullptr, node.invalid_elements == 0u, true, node.published_elements});
+    }
+
+    std::shared_ptr<const GraphView> published(std::move(view));
+    std::shared_ptr<const GraphView> replaced = std::atomic_exchange(&view_, published);
+
+    if (debug_exporter_) {
+        debug_exporter_->export_file("nodes.dot.ps", [published] { return published->graphvis_string(); });
+    }
+
+    // Readers can only get the replaced view from `view_`, so nobody else can start using it now
+    if (replaced and replaced.use_count() == 1) {
+        spare_view_ = std::const_pointer_cast<GraphView>(std::move(replaced));
+        spare_view_->nodes_.clear(); // doesn't keep the old values (and their arenas) alive
+    }
+}
+
+void ServerTree::begin_epoch() {
+    ++epoch_;
+    if (arena_pool_) {
+        copy_long_lived_values();
+        epoch_arena_ = arena_pool_->acquire();
+        epoch_snapshots_ = gp::Arena::Create<std::atomic<std::size_t>>(epoch_arena_.get(), 0u);
+        epoch_arenas_.push_back({epoch_, epoch_ + max_epoch_arena_age, epoch_arena_, epoch_snapshots_});
+    }
+}
+
+void ServerTree::end_epoch() {
+    // Values created during the epoch keep the arena alive until they are replaced
+    epoch_arena_ = nullptr;
+    epoch_snapshots_ = nullptr;
+}
+
+void ServerTree::copy_long_lived_values() {
+    std::vector<std::shared_ptr<gp::Arena>> arenas;
+
+    for (EpochArena& epoch_arena : epoch_arenas_) {
+        if (epoch_ < epoch_arena.check_epoch) {
+            continue;
+        }
+        // Arenas only kept alive by sink data hold no snapshots. Snapshots held outside the graph (by
+        // views or in-flight async computations) are released soon, so those arenas are checked less often.
+        std::shared_ptr<gp::Arena> arena = epoch_arena.arena.lock();
+        if (arena and epoch_arena.num_snapshots->load() > 0u) {
+            arenas.emplace_back(std::move(arena));
+            epoch_arena.check_epoch = epoch_ + (epoch_ - epoch_arena.epoch);
+        } else {
+            epoch_arena.arena.reset();
+        }
+    }
+    epoch_arenas_.erase(std::remove_if(epoch_arenas_.begin(),
+                                       epoch_arenas_.end(),
+                                       [](const EpochArena& epoch_arena) { return epoch_arena.arena.expired(); }),
+                        epoch_arenas_.end());
+    if (arenas.empty()) {
+        return;
+    }
+
+    // Each value is copied once and the values pointing at it are copied to point at the copy
+    std::unordered_map<const Snapshot*, std::shared_ptr<const Snapshot>> copies;
+
+    for (auto& node_pair : nodes_) {
+        ServerNode& node = *node_pair.second;
+        if (node.snapshot) {
+            node.snapshot = copy_to_heap(node.snapshot, arenas, &copies);
+        }
+        for (auto& element_pair : node.elements) {
+            if (element_pair.second.snapshot) {
+                std::shared_ptr<const Snapshot> copy = copy_to_heap(element_pair.second.snapshot, arenas, &copies);
+                if (copy != element_pair.second.snapshot) {
+                    element_pair.second.snapshot = std::move(copy);
+                    node.mark_element_dirty(element_pair.first);
+                }
+            }
+        }
+    }
+
+    // Watchers compare by identity so they shouldn't resend values that were only copied
+    for (auto& watcher_pair : watchers_) {
+        for (auto& sent_pair : watcher_pair.second.sent) {
+            auto iter = copies.find(sent_pair.second.get());
+            if (iter != copies.end()) {
+                sent_pair.second = iter->second;
+            }
+        }
+    }
+}
+
+std::shared_ptr<const ServerTree::Snapshot>
+ServerTree::copy_to_heap(const std::shared_ptr<const Snapshot>& snapshot,
+                         const std::vector<std::shared_ptr<gp::Arena>>& arenas,
+                         std::unordered_map<const Snapshot*, std::shared_ptr<const Snapshot>>* copies) const {
+    auto iter = copies->find(snapshot.get());
+    if (iter != copies->end()) {
+        return iter->second;
+    }
+
+    // Checkpointed values are on the heap and only point at other checkpointed values
+    bool copy_needed = (std::find(arenas.begin(), arenas.end(), snapshot->arena) != arenas.end());
+
+    SnapshotInputs snapshot_inputs;
+    snapshot_inputs.reserve(snapshot->inputs.size());
+    for (const auto& input_pair : snapshot->inputs) {
+        snapshot_inputs.emplace_back(input_pair.first, copy_to_heap(input_pair.second, arenas, copies));
+        copy_needed |= (snapshot_inputs.back().second != input_pair.second);
+    }
+
+    std::shared_ptr<const Snapshot> result = snapshot;
+    if (copy_needed) {
+        auto copy = std::make_shared<Snapshot>(nullptr, nullptr, *snapshot->message);
+        copy->version = snapshot->version;
+
+        // Everything but the aliased inputs belongs to this value
+        util::iterate_msg_fields(*snapshot->message, [&](const gp::FieldDescriptor* field, int field_index) {
+            auto is_input = [field](const SnapshotInput& input_pair) { return input_pair.first == field; };
+            if (std::none_of(snapshot_inputs.begin(), snapshot_inputs.end(), is_input)) {
+                util::copy_field(copy->message, *snapshot->message, field_index);
+            }
+        });
+        copy->alias_inputs(std::move(snapshot_inputs));
+        result = std::move(copy);
+    }
+    copies->emplace(snapshot.get(), result);
+    return result;
+}
+
+void ServerTree::run_epoch(const std::vector<NodeKey>& roots, const PropagationPlan& plan) {
+    for (NodeKey key : plan.deferred) {
+        defer_node(nodes_.at(key).get());
+    }
+    for (const PropagationStep& step : plan.steps) {
+        invalidate_node(step);
+    }
+    publish_view();
+
+    MAYBE_SLEEP_MS();
+
+    bool validity_changed = false;
+    for (NodeKey key : roots) {
+        // Sources always re-run their compute function (if any) and compare against the previous value
+        ServerNode& node = *nodes_.at(key);
+        if (node.key_field) {
+            for (const std::string& element : node.epoch_elements) {
+                node.elements.at(element).outputs_current = false;
+            }
+        } else {
+            node.outputs_current = false;
+        }
+        validity_changed |= update_node({key, {}});
+    }
+    validity_changed |= update_nodes(plan);
+    publish_view();
+
+    if (validity_changed) {
+        MAYBE_SLEEP_MS();
+    }
+
+    send_sinks(plan);
+    send_watched(roots, plan);
+}
+
+std::vector<std::string> ServerTree::step_elements(const PropagationStep& step, const ServerNode& node) const {
+    const gp::Descriptor* desc = node.prototype->GetDescriptor();
+    std::vector<std::string> elements;
+
+    // Any element may have changed since a deferred node was last updated
+    if (step.pulled) {
+        for (const auto& element_pair : nodes_.at(node.scope)->elements) {
+            elements.emplace_back(element_pair.first);
+        }
+        return elements;
+    }
+
+    // Elements already added. The views point into the inputs' `epoch_elements`, which outlive the call.
+    std::unordered_set<std::string_view> added;
+
+    for (int input_index : step.changed_inputs) {
+        const ServerNode& input = *nodes_.at(node.inputs.at(input_index));
+
+        // Every element depends on inputs that aren't per element so they all need updating
+        if (desc->field(input_index)->is_repeated() or not input.scope) {
+            elements.clear();
+            for (const auto& element_pair : nodes_.at(node.scope)->elements) {
+                elements.emplace_back(element_pair.first);
+            }
+            return elements;
+        }
+
+        // Otherwise only the elements the inputs updated earlier in this epoch
+        for (const std::string& element : input.epoch_elements) {
+            if (added.insert(element).second) {
+                elements.emplace_back(element);
+            }
+        }
+    }
+
+    // Roots update the elements they were given
+    return (step.changed_inputs.empty() ? node.epoch_elements : elements);
+}
+
+ServerTree::NodeState* ServerTree::find_state(ServerNode* node, const std::string* element) {
+    if (not node->scope) {
+        return node;
+    }
+    assert(element);
+    auto iter = node->elements.find(*element);
+    return (iter == node->elements.end() ? nullptr : &iter->second);
+}
+
+void ServerTree::supersede_async(NodeState* state) {
+    ++state->generation;
+    if (state->cancel_async) {
+        state->cancel_async->store(true);
+        state->cancel_async = nullptr;
+    }
+}
+
+const ServerTree::NodeState* ServerTree::find_state(const ServerNode& node, const std::string* element) {
+    if (not node.scope) {
+        return &node;
+    }
+    assert(element);
+    auto iter = node.elements.find(*element);
+    return (iter == node.elements.end() ? nullptr : &iter->second);
+}
+
+bool ServerTree::input_valid(const ServerNode& node, int field_index, const std::string* element) const {
+    const ServerNode& input = *nodes_.at(node.inputs.at(field_index));
+
+    if (node.prototype->GetDescriptor()->field(field_index)->is_repeated()) {
+        return input.invalid_elements == 0u;
+    }
+
+    const NodeState* state = find_state(input, element);
+    return state and state->valid;
+}
+
+bool ServerTree::input_changed(const ServerNode& node, int field_index, const std::string* element) const {
+    const ServerNode& input = *nodes_.at(node.inputs.at(field_index));
+
+    if (node.prototype->GetDescriptor()->field(field_index)->is_repeated()) {
+        return input.elements_changed_epoch == epoch_;
+    }
+
+    const NodeState* state = find_state(input, element);
+    return not state or state->changed_epoch == epoch_;
+}
+
+bool ServerTree::any_input_changed(const PropagationStep& step,
+                                   const ServerNode& node,
+                                   const std::string* element) const {
+    if (step.pulled) {
+        return true;
+    }
+    for (int input_index : step.changed_inputs) {
+        if (input_changed(node, input_index, element)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<ServerTree::Snapshot> ServerTree::allocate_snapshot(const google::protobuf::Message& prototype) const {
+    if (not epoch_arena_) {
+        return std::make_shared<Snapshot>(nullptr, nullptr, prototype);
+    }
+    // The control block is on the arena as well. Its copy of the allocator keeps the arena alive.
+    return std::allocate_shared<Snapshot>(util::ArenaAllocator<Snapshot>(epoch_arena_),
+                                          epoch_arena_,
+                                          epoch_snapshots_,
+                                          prototype);
+}
+
+ServerTree::SnapshotInputs ServerTree::input_snapshots(const ServerNode& node, const std::string* element) const {
+    SnapshotInputs snapshot_inputs{util::ArenaAllocator<SnapshotInput>(epoch_arena_)};
+    const gp::Descriptor* desc = node.prototype->GetDescriptor();
+
+    std::size_t num_inputs = 0u;
+    for (const auto& input_key_pair : node.inputs) {
+        const ServerNode& input = *nodes_.at(input_key_pair.second);
+        num_inputs += (desc->field(input_key_pair.first)->is_repeated() ? input.elements.size() : 1u);
+    }
+    snapshot_inputs.reserve(num_inputs);
+
+    for (const auto& input_key_pair : node.inputs) {
+        const ServerNode& input = *nodes_.at(input_key_pair.second);
+        const gp::FieldDescriptor* field = desc->field(input_key_pair.first);
+
+        if (field->is_repeated()) {
+            // Collections are gathered in key order
+            for (const auto& element_pair : input.elements) {
+                if (element_pair.second.snapshot) {
+                    snapshot_inputs.emplace_back(field, element_pair.second.snapshot);
+                }
+            }
+            continue;
+        }
+
+        const NodeState* input_state = find_state(input, element);
+
+        if (input_state and input_state->snapshot) {
+            snapshot_inputs.emplace_back(field, input_state->snapshot);
+        }
+    }
+    return snapshot_inputs;
+}
+
+std::shared_ptr<ServerTree::Snapshot>
+ServerTree::new_snapshot(const ServerNode& node, const NodeState& state, const std::string* element) const {
+    auto snapshot = allocate_snapshot(*node.prototype);
+
+    // Sources have no inputs and keep their own data
+    if (node.inputs.empty() and state.snapshot) {
+        state.snapshot->restore();
+        snapshot->message->CopyFrom(*state.snapshot->message);
+        snapshot->version = state.snapshot->version;
+        return snapshot;
+    }
+
+    // Share the current input values instead of copying them
+    SnapshotInputs snapshot_inputs = input_snapshots(node, element);
+    for (const auto& input_pair : snapshot_inputs) {
+        snapshot->version = std::max(snapshot->version, input_pair.second->version);
+    }
+    // Removing an element changes a gathered collection without adding a newer value to it
+    for (const auto& input_key_pair : node.inputs) {
+        if (node.prototype->GetDescriptor()->field(input_key_pair.first)->is_repeated()) {
+            snapshot->version = std::max(snapshot->version, nodes_.at(input_key_pair.second)->elements_changed_epoch);
+        }
+    }
+    snapshot->alias_inputs(std::move(snapshot_inputs));
+    return snapshot;
+}
+
+void ServerTree::invalidate_node(const PropagationStep& step) {
+    ServerNode& node = *nodes_.at(step.key);
+
+    auto invalidate = [&](NodeState* state, const std::string* element) {
+        // No computed fields, just the invalidated parent inputs
+        auto copy_start = std::chrono::steady_clock::now();
+        state->snapshot = new_snapshot(node, *state, element);
+        node.stats.input_copy_nanos.record(nanos_since(copy_start));
+        ++node.stats.invalidations;
+
+        // Mark as invalid and abandon any result still being computed from older inputs
+        if (element) {
+            node.set_element_valid(*element, state, false);
+        } else {
+            state->valid = false;
+        }
+        supersede_async(state);
+    };
+
+    if (not node.scope) {
+        invalidate(&node, nullptr);
+        return;
+    }
+
+    node.epoch_elements = step_elements(step, node);
+    for (const std::string& element : node.epoch_elements) {
+        auto [iter, inserted] = node.add_element(element);
+        if (inserted) {
+            node.elements_changed_epoch = epoch_;
+        }
+        invalidate(&iter->second, &element);
+    }
+}
+
+bool ServerTree::update_node(const PropagationStep& step) {
+    ServerNode& node = *nodes_.at(step.key);
+
+    if (not node.scope) {
+        send_notices(step, /*updated=*/false);
+        bool validity_changed = update_state(step, &node, &node, nullptr);
+        send_notices(step, /*updated=*/true);
+        return validity_changed;
+    }
+
+    // Each element is computed independently of the others
+    bool validity_changed = false;
+    node.epoch_elements = step_elements(step, node);
+    send_notices(step, /*updated=*/false);
+
+    for (const std::string& element : node.epoch_elements) {
+        auto [iter, inserted] = node.add_element(element);
+        NodeState& state = iter->second;
+
+        bool was_valid = state.valid;
+        bool element_validity_changed = update_state(step, &node, &state, &element);
+        node.element_validity_changed(element, was_valid, state.valid);
+
+        // Gathering nodes check the validity of every element themselves, so only new values count as changes
+        if (inserted or state.changed_epoch == epoch_) {
+            node.elements_changed_epoch = epoch_;
+        }
+        validity_changed |= element_validity_changed;
+    }
+    send_notices(step, /*updated=*/true);
+
+    return validity_changed;
+}
+
+bool ServerTree::update_state(const PropagationStep& step,
+                              ServerNode* node,
+                              NodeState* state,
+                              const std::string* element) {
+    auto copy_start = std::chrono::steady_clock::now();
+    std::shared_ptr<Snapshot> next = new_snapshot(*node, *state, element);
+    gp::Message* message = next->message;
+    node->stats.input_copy_nanos.record(nanos_since(copy_start));
+
+    bool valid_before = state->valid;
+
+    // Check if all inputs are valid
+    state->valid = true;
+    for (const auto& input_key_pair : node->inputs) {
+        state->valid &= input_valid(*node, input_key_pair.first, element);
+    }
+
+    bool inputs_changed = any_input_changed(step, *node, element);
+
+    if (inputs_changed) {
+        state->outputs_current = false;
+    }
+
+    if (state->valid) {
+        auto iter = compute_functions_.find(step.key);
+        bool has_compute_function = (iter != compute_functions_.end());
+
+        // Look for a memoized result when these inputs have been computed before
+        std::string cache_key;
+        const std::string* cached_result = nullptr;
+        if (not state->outputs_current and has_compute_function and node->cache) {
+            cache_key = serialize_inputs(*node, *message);
+            cached_result = find_cached_result(node, cache_key);
+        }
+
+        if (state->outputs_current) {
+            // Early cutoff: none of the inputs produced new values so the last result still holds
+            apply_computed_fields(state, message, state->computed_fields.bytes());
+
+        } else if (cached_result) {
+            apply_computed_fields(state, message, *cached_result);
+
+        } else if (has_compute_function and node->type == proj::proto::Node::ASYNC) {
+            // The node stays invalid (with the latest inputs) until the background computation lands
+            state->valid = false;
+            state->snapshot = new_snapshot(*node, *state, element);
+            launch_async_compute(step.key, element, *iter->second, std::move(next), std::move(cache_key));
+            return valid_before != state->valid;
+
+        } else {
+            // Run the registered compute function if it exists
+            if (has_compute_function) {
+                // TODO: make COMPUTE_FUNC macro
+                auto compute_start = std::chrono::steady_clock::now();
+                iter->second->compute(message);
+                node->stats.compute_nanos.record(nanos_since(compute_start));
+            }
+            // Nodes without a compute function pass their inputs straight through
+            record_computed_fields(*node, state, message, inputs_changed and not has_compute_function);
+
+            if (node->cache and has_compute_function) {
+                cache_result(node, *state, std::move(cache_key));
+            }
+        }
+    }
+
+    state->snapshot = std::move(next);
+
+    return valid_before != state->valid;
+}
+
+bool ServerTree::update_nodes(const PropagationPlan& plan) {
+    if (not compute_pool_) {
+        bool validity_changed = false;
+        for (const PropagationStep& step : plan.steps) {
+            validity_changed |= update_node(step);
+        }
+        return validity_changed;
+    }
+
+    // Each step is released once all of its inputs from earlier steps have finished
+    if (remaining_inputs_capacity_ < plan.steps.size()) {
+        remaining_inputs_ = std::make_unique<std::atomic<std::size_t>[]>(plan.steps.size());
+        remaining_inputs_capacity_ = plan.steps.size();
+    }
+    for (auto i = 0u; i < plan.steps.size(); ++i) {
+        remaining_inputs_[i].store(plan.steps[i].num_step_inputs);
+    }
+
+    ParallelUpdate update(this, plan);
+
+    for (auto i = 0u; i < plan.steps.size(); ++i) {
+        if (plan.steps[i].num_step_inputs == 0) {
+            // Small enough for std::function to store without allocating
+            compute_pool_->submit([update = &update, i] { update->tree->run_parallel_step(update, i); });
+        }
+    }
+
+    update.steps_left.wait_to_use_safely([](std::size_t count) { return count == 0; }, [](std::size_t) {});
+
+    return update.validity_changed.load();
+}
+
+void ServerTree::run_parallel_step(ParallelUpdate* update, std::size_t step_index) {
+    const PropagationStep& step = update->plan.steps[step_index];
+
+    if (update_node(step)) {
+        update->validity_changed.store(true);
+    }
+
+    for (std::size_t dependent : step.dependents) {
+        if (--remaining_inputs_[dependent] == 0) {
+            compute_pool_->submit([update, dependent] { update->tree->run_parallel_step(update, dependent); });
+        }
+    }
+
+    // Notify while locked so the waiting thread can't destroy `steps_left` before this returns
+    update->steps_left.use_safely([update](std::size_t& count) {
+        if (--count == 0) {
+            update->steps_left.notify_all();
+        }
+    });
+}
+
+void ServerTree::launch_async_compute(NodeKey key,
+                                      const std::string* element,
+                                      const Computer& computer,
+                                      std::shared_ptr<Snapshot> working,
+                                      std::string cache_key) {
+    ServerNode* node = nodes_.at(key).get();
+    NodeState* state = find_state(node, element);
+
+    supersede_async(state);
+    std::uint64_t generation = state->generation;
+    auto cancelled = std::make_shared<std::atomic_bool>(false);
+    state->cancel_async = cancelled;
+    std::optional<std::string> element_key = (element ? std::optional<std::string>(*element) : std::nullopt);
+
+    async_pending_.use_safely([](std::size_t& pending) { ++pending; });
+
+    // The working snapshot isn't published so the graph can keep updating while this runs
+    async_pool_->submit([this,
+                         key,
+                         element_key = std::move(element_key),
+                         generation,
+                         working,
+                         &computer,
+                         &stats = node->stats,
+                         cancelled = std::move(cancelled),
+                         cache_key = std::move(cache_key)] {
+        // Newer inputs arrived while this was waiting for a thread
+        if (cancelled->load()) {
+            ++stats.cancelled_computes;
+        } else {
+            auto compute_start = std::chrono::steady_clock::now();
+            computer.compute(working->message);
+            stats.compute_nanos.record(nanos_since(compute_start));
+            finish_async_compute(key, element_key, generation, working, cache_key);
+        }
+
+        // Any computations launched by this result were counted before it finished
+        async_pending_.use_safely([this](std::size_t& pending) {
+            if (--pending == 0) {
+                async_pending_.notify_all();
+            }
+        });
+    });
+}
+
+void ServerTree::finish_async_compute(NodeKey key,
+                                      std::optional<std::string> element,
+                                      std::uint64_t generation,
+                                      std::shared_ptr<Snapshot> result,
+                                      std::string cache_key) {
+    if (shutting_down_.load()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+
+    ServerNode& node = *nodes_.at(key);
+    NodeState* state = find_state(&node, element ? &*element : nullptr);
+
+    // The node was invalidated, recomputed, or removed while this result was being computed
+    if (not state or state->generation != generation) {
+        return;
+    }
+
+    begin_epoch();
+
+    record_computed_fields(node, state, result->message, /*force_changed=*/false);
+    state->snapshot = std::move(result);
+    if (element) {
+        node.set_element_valid(*element, state, true);
+    } else {
+        state->valid = true;
+    }
+    state->cancel_async = nullptr;
+
+    if (node.cache) {
+        cache_result(&node, *state, std::move(cache_key));
+    }
+
+    // Only the finished element propagates
+    if (element) {
+        node.epoch_elements = {*element};
+        node.elements_changed_epoch = epoch_;
+    }
+
+    // Every descendant was left invalid while this node was computing so there is nothing to invalidate
+    const PropagationPlan& plan = plans_.at(key);
+    for (NodeKey deferred_key : plan.deferred) {
+        defer_node(nodes_.at(deferred_key).get());
+    }
+    update_nodes(plan);
+    publish_view();
+    MAYBE_SLEEP_MS();
+
+    send_sinks(plan);
+    send_watched({key}, plan);
+    end_epoch();
+}
+
+void ServerTree::serialize_computed_fields(const ServerNode& node,
+                                           google::protobuf::Message* message,
+                                           std::string* bytes) {
+    util::MsgPkg msg_pkg(message);
+
+    // Detach the inputs so only the fields set by this node are serialized. Reused by every update on this thread.
+    thread_local std::vector<std::pair<const gp::FieldDescriptor*, gp::Message*>> detached_inputs;
+    detached_inputs.clear();
+    for (const auto& input_key_pair : node.inputs) {
+        msg_pkg.set_field_index(input_key_pair.first);
+
+        if (msg_pkg.field->is_repeated()) {
+            for (auto i = msg_pkg.refl->FieldSize(*msg_pkg.msg, msg_pkg.field); i > 0; --i) {
+                detached_inputs.emplace_back(msg_pkg.field,
+                                             msg_pkg.refl->UnsafeArenaReleaseLast(msg_pkg.msg, msg_pkg.field));
+            }
+        } else if (msg_pkg.refl->HasField(*msg_pkg.msg, msg_pkg.field)) {
+            detached_inputs.emplace_back(msg_pkg.field,
+                                         msg_pkg.refl->UnsafeArenaReleaseMessage(msg_pkg.msg, msg_pkg.field));
+        }
+    }
+
+    util::serialize_deterministic(*msg_pkg.msg, bytes);
+
+    // Reattached in reverse so collections keep their order
+    for (auto iter = detached_inputs.rbegin(); iter != detached_inputs.rend(); ++iter) {
+        if (iter->first->is_repeated()) {
+            msg_pkg.refl->UnsafeArenaAddAllocatedMessage(msg_pkg.msg, iter->first, iter->second);
+        } else {
+            msg_pkg.refl->UnsafeArenaSetAllocatedMessage(msg_pkg.msg, iter->second, iter->first);
+        }
+    }
+}
+
+void ServerTree::record_computed_fields(const ServerNode& node,
+                                        NodeState* state,
+                                        google::protobuf::Message* message,
+                                        bool force_changed) const {
+    // Copied (rather than moved) into the state so both buffers keep their capacity between updates
+    thread_local std::string bytes;
+    serialize_computed_fields(node, message, &bytes);
+
+    if (force_changed or bytes != state->computed_fields.bytes()) {
+        state->changed_epoch = epoch_;
+        state->computed_fields.assign(bytes);
+    }
+    state->outputs_current = true;
+}
+
+void ServerTree::apply_computed_fields(NodeState* state,
+                                       google::protobuf::Message* message,
+                                       std::string_view computed_fields) const {
+    // `message` is a new value so only the inputs are set
+    gp::io::CodedInputStream stream(reinterpret_cast<const std::uint8_t*>(computed_fields.data()),
+                                    static_cast<int>(computed_fields.size()));
+    message->MergeFromCodedStream(&stream);
+
+    if (computed_fields != state->computed_fields.bytes()) {
+        state->changed_epoch = epoch_;
+        state->computed_fields.assign(computed_fields);
+    }
+    state->outputs_current = true;
+}
+
+std::string ServerTree::serialize_inputs(const ServerNode& node, const google::protobuf::Message& message) {
+    std::string bytes;
+    const gp::Reflection* refl = message.GetReflection();
+
+    auto append = [&bytes](const gp::Message& input) {
+        std::string input_bytes = util::serialize_deterministic(input);
+        bytes += std::to_string(input_bytes.size()) + ':' + input_bytes;
+    };
+
+    // Length prefixed and in field order so different input combinations can't collide
+    util::iterate_msg_fields(message, [&](const gp::FieldDescriptor* field, int field_index) {
+        if (node.inputs.find(field_index) == node.inputs.end()) {
+            return;
+        }
+
+        if (field->is_repeated()) {
+            int size = refl->FieldSize(message, field);
+            bytes += std::to_string(size) + '#';
+            for (auto i = 0; i < size; ++i) {
+                append(refl->GetRepeatedMessage(message, field, i));
+            }
+        } else {
+            append(refl->GetMessage(message, field));
+        }
+    });
+    return bytes;
+}
+
+const std::string* ServerTree::find_cached_result(ServerNode* node, const std::string& cache_key) {
+    std::lock_guard<std::mutex> scoped_lock(node->cache->lock);
+    const std::string* result = node->cache->results.find(cache_key);
+    ++(result ? node->cache->hits : node->cache->misses);
+    return result;
+}
+
+void ServerTree::cache_result(ServerNode* node, const NodeState& state, std::string cache_key) {
+    std::lock_guard<std::mutex> scoped_lock(node->cache->lock);
+    std::string_view computed_fields = state.computed_fields.bytes();
+    std::size_t cost = cache_key.size() + computed_fields.size();
+    node->cache->results.insert(std::move(cache_key), std::string(computed_fields), cost);
+}
+
+const ServerTree::ServerNode& ServerTree::get_node(const google::protobuf::Descriptor* desc) const {
+    return *nodes_.at(get_key(desc));
+}
+
+ServerTree::ServerNode& ServerTree::get_node(const google::protobuf::Descriptor* desc) {
+    return *nodes_.at(get_key(desc));
+}
+
+void ServerTree::send_notices(const PropagationStep& step, bool updated) {
+    auto sink_iter = sinks_.find(step.key);
+    if (sink_iter == sinks_.end() or not is_demanded(step.key)) {
+        return;
+    }
+
+    // Notices go out before a sink is recomputed, except for roots which only know they changed once updated
+    bool is_root = (step.changed_inputs.empty() and not step.pulled);
+    if (updated != is_root) {
+        return;
+    }
+
+    const ServerNode& node = *nodes_.at(step.key);
+    Sink* sink = sink_iter->second.get();
+
+    auto changed = [&](const std::string* element) {
+        if (is_root) {
+            const NodeState* state = find_state(node, element);
+            return state and state->changed_epoch == epoch_;
+        }
+        return any_input_changed(step, node, element);
+    };
+
+    std::vector<std::string> elements;
+    if (node.scope) {
+        for (const std::string& element : node.epoch_elements) {
+            if (changed(&element)) {
+                elements.emplace_back(element);
+            }
+        }
+        if (elements.empty()) {
+            return;
+        }
+    } else if (not changed(nullptr)) {
+        return;
+    }
+
+    for (const auto& queue : invalidation_queues_) {
+        queue->push_back({step.key, epoch_, elements});
+    }
+
+    if (sink->emission == SinkEmission::INVALIDATED_AND_FINAL) {
+        if (not node.scope and node.snapshot) {
+            send_if_newer(*node.snapshot, sink, &sink->sent_version, /*invalidated=*/true);
+        }
+        for (const std::string& element : elements) {
+            const NodeState* state = find_state(node, &element);
+            if (state and state->snapshot) {
+                send_if_newer(*state->snapshot, sink, &sink->sent_element_versions[element], /*invalidated=*/true);
+            }
+        }
+    } else if (sink->emission == SinkEmission::NOTICE_AND_FINAL) {
+        sink->send_notice(epoch_);
+    }
+
+    // Every notice is followed by a final value
+    if (not node.scope) {
+        sink->awaiting_final.emplace();
+    }
+    sink->awaiting_final.insert(elements.begin(), elements.end());
+}
+
+void ServerTree::send_sinks(const PropagationPlan& plan) {
+    for (NodeKey sink_key : plan.sinks) {
+        send_sink(*nodes_.at(sink_key), sinks_.at(sink_key).get());
+    }
+}
+
+void ServerTree::send_sink(const ServerNode& node, Sink* sink) {
+    // Unchanged values are only sent to follow a notice. Invalid ones wait until they are valid again.
+    auto send_final = [&](const NodeState& state, const std::string& element, std::uint64_t* sent_version) {
+        if (not state.valid or not state.snapshot) {
+            return;
+        }
+        bool noticed = (sink->awaiting_final.erase(element) > 0);
+        if (noticed or state.changed_epoch == epoch_) {
+            send_if_newer(*state.snapshot, sink, sent_version, /*invalidated=*/false);
+        }
+    };
+
+    if (not node.scope) {
+        send_final(node, "", &sink->sent_version);
+        return;
+    }
+
+    // Only the elements updated in this epoch can have changed
+    for (const std::string& element : node.epoch_elements) {
+        auto iter = node.elements.find(element);
+        if (iter != node.elements.end()) {
+            send_final(iter->second, element, &sink->sent_element_versions[element]);
+        }
+    }
+}
+
+void ServerTree::send_if_newer(const Snapshot& snapshot,
+                               Sink* sink,
+                               std::uint64_t* sent_version,
+                               bool invalidated) const {
+    // Values derived from older source updates than the last one sent are dropped
+    if (snapshot.version < *sent_version) {
+        return;
+    }
+    *sent_version = snapshot.version;
+    snapshot.restore();
+    sink->send_data(*snapshot.message, snapshot.version, invalidated, epoch_arena_);
+}
+
+void ServerTree::send_watched(const std::vector<NodeKey>& roots, const PropagationPlan& plan) {
+    if (watched_nodes_.empty()) {
+        return;
+    }
+    // Only the nodes the propagation reached can have new values
+    for (NodeKey key : roots) {
+        send_to_watchers(key);
+    }
+    for (const PropagationStep& step : plan.steps) {
+        send_to_watchers(step.key);
+    }
+}
+
+void ServerTree::send_to_watchers(NodeKey key) {
+    auto iter = watched_nodes_.find(key);
+    if (iter == watched_nodes_.end()) {
+        return;
+    }
+    for (Watcher* watcher : iter->second) {
+        send_watched(watcher, /*all_elements=*/false);
+    }
+}
+
+void ServerTree::send_watched(Watcher* watcher, bool all_elements) {
+    const ServerNode& node = *nodes_.at(watcher->key);
+
+    // Every update replaces the snapshot, so a different one is a value the watcher hasn't seen
+    auto send_if_new = [&](const NodeState& state, const std::string& element) {
+        std::shared_ptr<const Snapshot>& sent = watcher->sent[element];
+        if (not state.valid or not state.snapshot or state.snapshot == sent) {
+            return;
+        }
+        sent = state.snapshot;
+        sent->restore();
+        watcher->push({watcher->key, element, sent->version, std::shared_ptr<const gp::Message>(sent, sent->message)});
+    };
+
+    if (not node.scope) {
+        send_if_new(node, "");
+        return;
+    }
+
+    // Forget removed elements
+    if (node.elements_changed_epoch == epoch_) {
+        for (auto iter = watcher->sent.begin(); iter != watcher->sent.end();) {
+            iter = (node.elements.find(iter->first) == node.elements.end() ? watcher->sent.erase(iter) : ++iter);
+        }
+    }
+
+    if (all_elements) {
+        for (const auto& element_pair : node.elements) {
+            send_if_new(element_pair.second, element_pair.first);
+        }
+        return;
+    }
+
+    // Only elements updated by the latest epoch that reached the node can have new values
+    for (const std::string& element : node.epoch_elements) {
+        auto iter = node.elements.find(element);
+        if (iter != node.elements.end()) {
+            send_if_new(iter->second, element);
+        }
     }
-    return msgs_to_return;
 }
 
 } // namespace svr
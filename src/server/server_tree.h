@@ -1,130 +1,792 @@
 #pragma once
 
 #include "util/message_util.h"
+#include "util/arena_pool.h"
+#include "util/atomic_data.h"
 #include "util/blocking_deque.h"
+#include "util/latency_histogram.h"
+#include "util/lru_cache.h"
+#include "util/persistent_map.h"
+
+#include <google/protobuf/arena.h>
 
 #include <google/protobuf/dynamic_message.h>
 
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <proj/annotations.pb.h>
 #include <fstream>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+namespace util {
+class MappedFile;
+class WorkStealingPool;
+} // namespace util
 
 namespace svr {
 
+class DebugExporter;
+
 using ComputeFunc = void (*)(google::protobuf::Message*);
 
+/**
+ * @brief When a sink's value is sent during a propagation
+ */
+enum class SinkEmission {
+    FINAL_ONLY, // once the propagation has recomputed every node the sink depends on, if the value changed
+    INVALIDATED_AND_FINAL, // also as soon as an input of the sink changes, with stale and cleared fields
+    NOTICE_AND_FINAL, // also a SinkValue without a value as soon as an input of the sink changes
+};
+
+/**
+ * @brief A sink value and the version it was derived from, sent in order with the sink's invalidations
+ */
+template <typename T>
+struct SinkValue {
+    std::uint64_t version; // epoch of the newest source update the value is derived from, or the invalidating epoch
+    bool invalidated; // sent as soon as a propagation invalidated the sink. The next value is its result.
+    std::shared_ptr<const T> value; // null for a SinkEmission::NOTICE_AND_FINAL notice
+};
+
+/**
+ * @brief Sent for every sink whose inputs changed, before the sink is recomputed, and for
+ * every element removed from a keyed sink
+ */
+struct SinkInvalidation {
+    const google::protobuf::Descriptor* sink;
+    std::uint64_t version; // the propagation epoch. The sink's next value is the result of this epoch.
+    std::vector<std::string> elements; // the invalidated elements of a keyed sink, empty otherwise
+    bool removed = false; // `elements` were removed and have no next value
+};
+
+/**
+ * @brief A new value of a watched node (see ServerTree::watch)
+ */
+struct NodeUpdate {
+    const google::protobuf::Descriptor* node;
+    std::string element; // the element of a node derived from a keyed source, empty otherwise
+    std::uint64_t version; // epoch of the newest source update the value is derived from
+    std::shared_ptr<const google::protobuf::Message> value; // shares the node's immutable value
+};
+
 class ServerTree {
+    struct Snapshot;
+    struct GraphLayout;
+
 public:
     /**
+     * @param num_compute_threads is the number of threads used to run independent compute
+     *        functions in parallel. Values less than 2 run every compute function on the
+     *        thread that calls `update_source`.
+     * @param num_async_threads is the number of threads used to run the compute functions
+     *        of nodes annotated as `ASYNC`.
+     * @param use_epoch_arenas allocates the node values and sink messages of each propagation
+     *        epoch on a pooled arena that is recycled once every value from that epoch has been
+     *        replaced and every sink message from it has been released. Values that outlive their
+     *        epoch by a few epochs are copied to the heap so they don't hold on to the rest of the
+     *        arena. When false every value is allocated on the heap.
+     */
+    explicit ServerTree(unsigned num_compute_threads = std::thread::hardware_concurrency(),
+                        unsigned num_async_threads = 1,
+                        bool use_epoch_arenas = true);
+    ~ServerTree();
+
+    /**
+     * Sink values are immutable and may live on an epoch arena, which stays alive for as long
+     * as any of its values are held.
+     *
      * @tparam T is the message type
      * @return true if output successfully added, false if output already exists
      */
     template <typename T, typename = std::enable_if_t<std::is_base_of<google::protobuf::Message, T>::value>>
-    bool add_output(std::shared_ptr<util::BlockingQueue<T>> queue);
+    bool add_output(std::shared_ptr<util::BlockingQueue<std::shared_ptr<const T>>> queue,
+                    SinkEmission emission = SinkEmission::FINAL_ONLY);
+
+    /**
+     * @brief Also sends the version of each value. Only these outputs receive SinkEmission::NOTICE_AND_FINAL
+     * notices, which for keyed sinks don't say which elements were invalidated (see add_invalidation_output).
+     */
+    template <typename T, typename = std::enable_if_t<std::is_base_of<google::protobuf::Message, T>::value>>
+    bool add_output(std::shared_ptr<util::BlockingQueue<SinkValue<T>>> queue,
+                    SinkEmission emission = SinkEmission::FINAL_ONLY);
+
+    /**
+     * @brief Receives a small notice in place of the invalidated value of each sink
+     */
+    void add_invalidation_output(std::shared_ptr<util::BlockingQueue<SinkInvalidation>> queue);
 
+    /**
+     * Compute functions of independent nodes may run concurrently so they should only
+     * modify the message they are given. Input fields are shared with every other consumer
+     * of those inputs and must not be modified. Functions registered for `ASYNC` nodes run
+     * in the background and their results propagate once they finish.
+     */
     template <typename T, typename Func, typename... Args>
     void register_function(Func func, Args... args);
 
+    /**
+     * Sources annotated with `(collection_key)` hold a keyed collection of elements. Updating
+     * one of them adds or replaces the element with the same key and only recomputes (and
+     * sends) that element of the nodes derived from it. Repeated fields of those node types
+     * gather every element of the collection, ordered by key (integer keys compare as strings).
+     */
     bool update_source(const google::protobuf::Message& message);
 
+    /**
+     * @brief Updates several sources in a single propagation epoch
+     *
+     * Every affected node is recomputed once and every affected sink is sent once, no matter
+     * how many of the updated sources it depends on. If a source (or collection element)
+     * appears more than once the last message wins.
+     *
+     * @return false (without updating anything) if any message is not a source
+     */
+    bool update_sources(const std::vector<const google::protobuf::Message*>& messages);
+
+    /**
+     * @brief Removes the element with the same key as `message` from a keyed source collection
+     *
+     * The element is removed from every node derived from the collection and the nodes that
+     * gather the collection are recomputed. Invalidation outputs receive a `removed` notice for
+     * the element of each sink derived from the collection.
+     *
+     * @return false if `message` is not a keyed source or no element has its key
+     */
+    bool remove_source_element(const google::protobuf::Message& message);
+
+    /**
+     * @brief Computes the graph from the sources that fields marked `(initialize_on_startup)` depend on
+     *
+     * Marked node fields seed every source their node is derived from, so outputs are valid
+     * before the first update arrives. Seeded sources take their value from `initial_values`
+     * if it has one and their default value otherwise (keyed collections are only seeded from
+     * `initial_values`). Everything is computed in a single epoch and this blocks until the
+     * results of `ASYNC` nodes have propagated as well.
+     *
+     * @return false (without updating anything) if any message in `initial_values` is not a source
+     */
+    bool initialize_startup_sources(const std::vector<const google::protobuf::Message*>& initial_values = {});
+
+    /**
+     * @brief Writes the value, validity and version of every node to `filename`
+     *
+     * Updates are only blocked while the node states are collected, not while they are written.
+     * The checkpoint is written to a temporary file that is synced and renamed over `filename`
+     * once it is complete, so a crash never leaves a partial checkpoint behind.
+     *
+     * @return false if the file couldn't be written
+     */
+    bool save_checkpoint(const std::string& filename);
+
+    /**
+     * @brief Replaces the node values with the ones saved by `save_checkpoint`
+     *
+     * The file is memory mapped and a value is only parsed the first time it is read, so
+     * restoring doesn't depend on the size of the graph's values. Saved nodes that are no longer
+     * part of the graph are skipped. Async computations that were running when the checkpoint
+     * was saved are started again. Values keep their versions and later updates are newer.
+     *
+     * @return false (without changing anything) if the file doesn't exist or isn't a compatible checkpoint
+     */
+    bool restore_checkpoint(const std::string& filename);
+
+    bool is_source(const google::protobuf::Message& message) const;
+
+    /**
+     * @return the collection key of a keyed source message, or an empty string for other messages
+     */
+    std::string element_key(const google::protobuf::Message& message) const;
+
+    struct CacheStats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+        std::size_t max_bytes = 0;
+    };
+
+    /**
+     * @brief Memoizes the results of T's compute function keyed by the values of its inputs
+     *
+     * When a node recomputes with inputs it has seen before the cached result is restored
+     * instead of calling the compute function. Least recently used results are evicted once
+     * the cached inputs and results take up more than `max_bytes`.
+     */
+    template <typename T>
+    void enable_cache(std::size_t max_bytes);
+
+    template <typename T>
+    CacheStats cache_stats() const;
+
+    /**
+     * @brief An immutable, consistent copy of every node value and validity flag
+     *
+     * Views are published at the end of each propagation epoch (and at the points within an
+     * epoch where sinks are sent) so a view never contains a partially updated graph. Node
+     * values are shared with the graph, not copied.
+     */
+    class GraphView {
+    public:
+        /**
+         * @brief Incremented every time a new view is published
+         */
+        std::uint64_t version() const;
+
+        /**
+         * @return the value of the node for `desc`, or null if it has never been updated
+         */
+        std::shared_ptr<const google::protobuf::Message> value(const google::protobuf::Descriptor* desc) const;
+
+        /**
+         * @return the value of one element of a node derived from a keyed source, or null if there is no such element
+         */
+        std::shared_ptr<const google::protobuf::Message> value(const google::protobuf::Descriptor* desc,
+                                                               const std::string& element) const;
+
+        bool valid(const google::protobuf::Descriptor* desc) const;
+        bool valid(const google::protobuf::Descriptor* desc, const std::string& element) const;
+
+        /**
+         * @return the epoch of the newest source update the value is derived from, 0 if there is no value
+         */
+        std::uint64_t value_version(const google::protobuf::Descriptor* desc) const;
+        std::uint64_t value_version(const google::protobuf::Descriptor* desc, const std::string& element) const;
+
+        /**
+         * @return the keys of every element of a node derived from a keyed source, in order
+         */
+        std::vector<std::string> element_keys(const google::protobuf::Descriptor* desc) const;
+
+        std::string graphvis_string() const;
+
+    private:
+        friend class ServerTree;
+
+        struct ElementState {
+            std::shared_ptr<const Snapshot> snapshot;
+            bool valid;
+        };
+        // Shares every untouched element with the views published before it
+        using ElementStates = util::PersistentMap<std::string, ElementState>;
+
+        struct NodeState {
+            std::shared_ptr<const Snapshot> snapshot;
+            bool valid;
+            bool keyed; // derived from a keyed source
+            ElementStates elements; // empty unless keyed
+        };
+
+        std::shared_ptr<const GraphLayout> layout_;
+        std::vector<NodeState> nodes_;
+        std::uint64_t version_ = 0;
+
+        const NodeState* find_node(const google::protobuf::Descriptor* desc) const;
+        const ElementState* find_element(const google::protobuf::Descriptor* desc, const std::string& element) const;
+    };
+
+    /**
+     * @brief The most recently published view. Never blocks on (or blocks) a propagation epoch.
+     */
+    std::shared_ptr<const GraphView> view() const;
+
     std::string graphvis_string() const;
 
+    /**
+     * @brief Every published view is exported to `nodes.dot.ps` by `exporter` (null disables the export).
+     * Must be set before the tree is updated.
+     */
+    void set_debug_exporter(std::shared_ptr<DebugExporter> exporter);
+
+    /**
+     * @brief Only recomputes the nodes a subscribed sink depends on when sources change
+     *
+     * Every other affected node is marked stale (and shows up as invalid in published views)
+     * without being recomputed until a sink that depends on it gains a subscriber or it is read
+     * with `evaluate`. Turning lazy evaluation off brings every stale node up to date.
+     */
+    void set_lazy_evaluation(bool lazy);
+
+    /**
+     * @brief Counts a subscriber of the sink `desc`. A sink's first subscriber brings it up to date,
+     * sending it if anything had to be recomputed.
+     *
+     * @return false if `desc` is not a sink
+     */
+    bool add_subscriber(const google::protobuf::Descriptor* desc);
+
+    /**
+     * @return false if `desc` is not a sink with subscribers
+     */
+    bool remove_subscriber(const google::protobuf::Descriptor* desc);
+
+    /**
+     * @brief Recomputes `desc` and everything it depends on if lazy evaluation left them stale
+     *
+     * Results of stale `ASYNC` nodes are still computing when this returns.
+     *
+     * @return the view published once the synchronous computes have finished
+     * @throws std::out_of_range if `desc` is not a node in the graph
+     */
+    std::shared_ptr<const GraphView> evaluate(const google::protobuf::Descriptor* desc);
+
+    /**
+     * @brief Calls `push` with the value of any node (sink or not) now and after every propagation that
+     * leaves it valid with a new value. Elements of keyed nodes are pushed individually.
+     *
+     * `push` is called while propagation is paused so it should only hand the update off, and it must
+     * not call back into the tree. Watched nodes count as subscribed sinks for lazy evaluation.
+     *
+     * @return an id for `unwatch`, or 0 if `desc` is not a node in the graph
+     */
+    std::uint64_t watch(const google::protobuf::Descriptor* desc, std::function<void(NodeUpdate)> push);
+
+    /**
+     * @return false if no watcher has the id `watcher_id`
+     */
+    bool unwatch(std::uint64_t watcher_id);
+
+    /**
+     * @brief Counters for one node (every element of a collection node counts towards the same stats)
+     *
+     * Updated without locks by whichever thread does the work, so they can be read at any time.
+     */
+    struct NodeStats {
+        util::LatencyHistogram compute_nanos; // one sample per call of the registered compute function
+        util::LatencyHistogram input_copy_nanos; // building each new value from the node's inputs
+        std::atomic<std::uint64_t> invalidations = 0;
+        std::atomic<std::uint64_t> cancelled_computes = 0; // async computes skipped because they were superseded
+    };
+
+    /**
+     * @throws std::out_of_range if `desc` is not a node in the graph
+     */
+    const NodeStats& stats(const google::protobuf::Descriptor* desc) const;
+
+    /**
+     * @brief One line of stats per node, slowest total compute time first
+     */
+    std::string stats_string() const;
+
 private:
     struct Computer {
         virtual ~Computer() = 0;
-        virtual void compute(google::protobuf::Message*) = 0;
+        virtual void compute(google::protobuf::Message*) const = 0;
     };
 
     template <typename T, typename Func, typename... Args>
     struct TypedComputer : public Computer {
         explicit TypedComputer(Func func, Args... args)
-            : func_(func), arguments_(std::make_tuple(std::forward<Args>(args)..., static_cast<T*>(nullptr))) {}
+            : func_(func), arguments_(std::make_tuple(std::forward<Args>(args)...)) {}
         ~TypedComputer() override = default;
 
-        void compute(google::protobuf::Message* message) override {
-            std::get<sizeof...(Args)>(arguments_) = dynamic_cast<T*>(message);
-            std::apply(func_, arguments_);
+        // Nothing is modified here so the same computer can run on several threads at once
+        void compute(google::protobuf::Message* message) const override {
+            std::apply([&](const auto&... args) { func_(args..., dynamic_cast<T*>(message)); }, arguments_);
         }
 
     private:
-        Func func_;
-        std::tuple<typename std::decay<Args>::type..., T*> arguments_;
+        const Func func_;
+        const std::tuple<typename std::decay<Args>::type...> arguments_;
     };
 
     using NodeKey = const google::protobuf::Descriptor*;
 
-    struct ServerNode {
-        std::unique_ptr<google::protobuf::Message> message; // stored data
-        std::unordered_map<int, NodeKey> inputs = {};
-        std::unordered_map<NodeKey, int> outputs = {};
+    struct NodeCache {
+        mutable std::mutex lock; // guards reads of the stats from outside the update
+        util::LruCache<std::string, std::string> results; // serialized inputs -> computed fields
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+
+        explicit NodeCache(std::size_t max_bytes) : results(max_bytes) {}
+    };
+
+    // Allocated on the epoch arena along with the snapshot that holds them
+    using SnapshotInput = std::pair<const google::protobuf::FieldDescriptor*, std::shared_ptr<const Snapshot>>;
+    using SnapshotInputs = std::vector<SnapshotInput, util::ArenaAllocator<SnapshotInput>>;
+
+    /**
+     * An immutable node value. Input fields point at the input nodes' snapshots instead of
+     * holding copies so a value is shared by every node and sink that consumes it.
+     */
+    struct Snapshot {
+        std::shared_ptr<google::protobuf::Arena> arena; // owns `message` unless null
+        std::atomic<std::size_t>* arena_snapshots; // live snapshots on `arena`, which owns the count
+        google::protobuf::Message* message; // `restore` must be called before reading it
+        mutable SnapshotInputs inputs;
+        std::uint64_t version = 0; // epoch of the newest source update the value is derived from
+
+        // Set on values restored from a checkpoint until they are first read
+        struct Checkpointed {
+            std::shared_ptr<const util::MappedFile> file;
+            const char* computed_fields; // null if the value wasn't valid
+            std::size_t computed_fields_size;
+            SnapshotInputs inputs;
+        };
+        mutable std::unique_ptr<Checkpointed> checkpointed;
+        mutable std::once_flag restore_flag;
+
+        Snapshot(std::shared_ptr<google::protobuf::Arena> msg_arena,
+                 std::atomic<std::size_t>* msg_arena_snapshots,
+                 const google::protobuf::Message& prototype);
+        ~Snapshot();
+
+        /**
+         * @brief Parses a checkpointed value (and the inputs it points at) the first time it is read
+         */
+        void restore() const;
+
+        /**
+         * @brief Points the input fields at `snapshot_inputs` (restoring them first) and keeps them alive
+         */
+        void alias_inputs(SnapshotInputs snapshot_inputs) const;
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot(Snapshot&&) noexcept = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot& operator=(Snapshot&&) noexcept = delete;
+    };
+
+    /**
+     * The serialized non-input fields of a computed value. Copies share the bytes, and values restored
+     * from a checkpoint view its mapping until they are next computed.
+     */
+    class ComputedFields {
+    public:
+        ComputedFields() = default;
+        ComputedFields(std::shared_ptr<const util::MappedFile> file, std::string_view bytes);
+
+        std::string_view bytes() const { return bytes_; }
+
+        /**
+         * @brief Reuses the buffer of the last assigned bytes if no copy shares it
+         */
+        void assign(std::string_view bytes);
+
+    private:
+        std::shared_ptr<std::string> owned_ = nullptr;
+        std::shared_ptr<const util::MappedFile> file_ = nullptr;
+        std::string_view bytes_ = {};
+    };
 
+    /**
+     * The value of a node, or of one element of a node derived from a keyed source
+     */
+    struct NodeState {
+        std::shared_ptr<const Snapshot> snapshot = nullptr; // current value, null until first updated
         bool valid = false;
+        std::uint64_t generation = 0; // incremented whenever in-flight async results become stale
+        std::shared_ptr<std::atomic_bool> cancel_async = nullptr; // set while an async compute is in flight
+
+        // Early cutoff state. `computed_fields` holds the non-input fields of the last computed result,
+        // `outputs_current` is true while no input has produced a new value since it was computed, and
+        // `changed_epoch` is the last epoch in which an update of this state produced a new value.
+        ComputedFields computed_fields = {};
+        bool outputs_current = false;
+        std::uint64_t changed_epoch = 0;
+    };
+
+    struct ServerNode : NodeState {
+        const google::protobuf::Message* prototype; // default instance used to create new values
+        std::unordered_map<int, NodeKey> inputs = {}; // repeated fields gather a whole collection
+        std::unordered_map<NodeKey, int> outputs = {};
+
+        proj::proto::Node type = proj::proto::Node::NONE;
+
+        // Keyed collections. `scope` is the keyed source this node has one element per key of (null if
+        // the node has a single value), `key_field` identifies elements and is only set on keyed sources.
+        NodeKey scope = nullptr;
+        const google::protobuf::FieldDescriptor* key_field = nullptr;
+        std::map<std::string, NodeState> elements = {};
+        std::vector<std::string> epoch_elements = {}; // elements updated by the latest epoch that reached this node
+        std::uint64_t elements_changed_epoch = 0; // last epoch an element changed or was removed
+        std::size_t invalid_elements = 0; // kept in step with `elements` by the element functions below
+
+        // Elements changed since `published_elements` was last patched. The whole collection is
+        // republished when `all_elements_dirty` is set.
+        GraphView::ElementStates published_elements = {};
+        std::vector<std::string> dirty_elements = {};
+        bool all_elements_dirty = false;
+
+        std::unique_ptr<NodeCache> cache = nullptr;
         std::string debug_name = {};
+        NodeStats stats;
+        bool deferred = false; // lazy evaluation skipped the node since its inputs last changed
+
+        explicit ServerNode(const google::protobuf::Message* default_instance);
+
+        // New elements start out invalid
+        std::pair<std::map<std::string, NodeState>::iterator, bool> add_element(const std::string& element);
+        void remove_element(std::map<std::string, NodeState>::iterator iter);
+        void clear_elements();
 
-        explicit ServerNode(std::unique_ptr<google::protobuf::Message> msg);
+        // Counts the change in validity of an element and marks it for publishing
+        void set_element_valid(const std::string& element, NodeState* state, bool now_valid);
+        void element_validity_changed(const std::string& element, bool was_valid, bool now_valid);
+        void mark_element_dirty(const std::string& element);
+    };
+
+    /**
+     * The structure of the graph shared by every published view. Rebuilt whenever an output is added.
+     */
+    struct GraphLayout {
+        struct NodeLayout {
+            NodeKey key;
+            const google::protobuf::Message* prototype;
+            proj::proto::Node type;
+            std::string debug_name;
+            std::vector<NodeKey> inputs;
+            std::vector<NodeKey> outputs;
+        };
+
+        std::vector<NodeLayout> nodes;
+        std::unordered_map<NodeKey, std::size_t> indices;
+    };
+
+    /**
+     * A single node to revisit when a root node changes
+     */
+    struct PropagationStep {
+        NodeKey key;
+        std::vector<int> changed_inputs; // field indices of inputs that are updated earlier in the plan
+        std::size_t num_step_inputs = 0; // number of earlier (non-root) steps that must finish before this one
+        std::vector<std::size_t> dependents = {}; // indices of the steps that take this one as an input
+        bool pulled = false; // catching up on deferred updates: every input and element is treated as changed
+    };
+
+    /**
+     * Every node affected by a change to a set of root nodes. Single root plans are compiled
+     * once per graph layout.
+     */
+    struct PropagationPlan {
+        std::vector<PropagationStep> steps = {}; // topologically ordered, excludes the roots
+        std::vector<NodeKey> sinks = {};
+        std::vector<NodeKey> deferred = {}; // affected nodes no subscribed sink depends on (lazy evaluation only)
     };
 
     struct Sink {
+        SinkEmission emission = SinkEmission::FINAL_ONLY;
+
+        // Versions of the last values sent, so a value is never followed by an older one
+        std::uint64_t sent_version = 0;
+        std::map<std::string, std::uint64_t> sent_element_versions = {};
+        std::set<std::string> awaiting_final = {}; // notified elements ("" if not keyed) with no final value sent
+
         virtual ~Sink() = 0;
         virtual google::protobuf::Message* get_data() = 0;
-        virtual void send_data() const = 0;
+        virtual void send_data(const google::protobuf::Message& value,
+                               std::uint64_t version,
+                               bool invalidated,
+                               const std::shared_ptr<google::protobuf::Arena>& arena) const = 0;
+        virtual void send_notice(std::uint64_t version) const = 0;
     };
 
     template <typename D>
     struct SinkData : Sink {
         D data;
-        std::shared_ptr<util::BlockingQueue<D>> queue;
+        // Only one of these is set
+        std::shared_ptr<util::BlockingQueue<std::shared_ptr<const D>>> queue;
+        std::shared_ptr<util::BlockingQueue<SinkValue<D>>> versioned_queue;
 
-        explicit SinkData(std::shared_ptr<util::BlockingQueue<D>> q) : queue(std::move(q)) {}
+        explicit SinkData(std::shared_ptr<util::BlockingQueue<std::shared_ptr<const D>>> q) : queue(std::move(q)) {}
+        explicit SinkData(std::shared_ptr<util::BlockingQueue<SinkValue<D>>> q) : versioned_queue(std::move(q)) {}
         ~SinkData() override = default;
 
         google::protobuf::Message* get_data() override { return &data; }
 
-        void send_data() const override {
+        // The only place a node value is deep copied
+        void send_data(const google::protobuf::Message& value,
+                       std::uint64_t version,
+                       bool invalidated,
+                       const std::shared_ptr<google::protobuf::Arena>& arena) const override {
             std::cout << "Sending data" << std::endl;
-            queue->push_back(data);
+            std::shared_ptr<const D> wire_value;
+            if (arena) {
+                // Shares ownership of the arena so it is only recycled once every consumer is done
+                D* wire_data = google::protobuf::Arena::CreateMessage<D>(arena.get());
+                wire_data->CopyFrom(value);
+                wire_value = std::shared_ptr<const D>(arena, wire_data);
+            } else {
+                auto wire_data = std::make_shared<D>();
+                wire_data->CopyFrom(value);
+                wire_value = std::move(wire_data);
+            }
+
+            if (versioned_queue) {
+                versioned_queue->push_back({version, invalidated, std::move(wire_value)});
+            } else {
+                queue->push_back(std::move(wire_value));
+            }
+        }
+
+        void send_notice(std::uint64_t version) const override {
+            if (versioned_queue) {
+                versioned_queue->push_back({version, true, nullptr});
+            }
         }
     };
 
     std::unordered_map<NodeKey, std::unique_ptr<ServerNode>> nodes_;
     std::unordered_set<NodeKey> sources_;
     std::unordered_map<NodeKey, std::unique_ptr<Sink>> sinks_;
+
+    struct Watcher {
+        NodeKey key;
+        std::function<void(NodeUpdate)> push;
+        std::map<std::string, std::shared_ptr<const Snapshot>> sent = {}; // last value pushed per element
+    };
+    std::map<std::uint64_t, Watcher> watchers_;
+    std::unordered_map<NodeKey, std::vector<Watcher*>> watched_nodes_; // the watchers of every watched node
+    std::uint64_t last_watcher_id_ = 0;
+    std::vector<std::shared_ptr<util::BlockingQueue<SinkInvalidation>>> invalidation_queues_;
     std::unordered_map<NodeKey, std::unique_ptr<Computer>> compute_functions_;
+    std::unordered_map<NodeKey, PropagationPlan> plans_;
 
-    NodeKey get_key(const google::protobuf::Descriptor* desc);
-    NodeKey get_key(const google::protobuf::Message& message);
-    NodeKey get_key(google::protobuf::Message* message);
+    std::mutex update_lock_; // serializes source updates and async results
+    std::atomic_bool shutting_down_ = false;
+    util::AtomicData<std::size_t> async_pending_; // async computations that haven't finished propagating
 
-    NodeKey build_node(google::protobuf::Message* message);
+    std::unordered_set<NodeKey> startup_nodes_; // inputs of fields marked `initialize_on_startup`
 
-    std::unordered_set<NodeKey> invalidate_node(NodeKey key, int input_index);
-    std::unordered_set<NodeKey> update_node(NodeKey key, int input_index);
+    bool lazy_ = false;
+    std::unordered_map<NodeKey, unsigned> subscribers_; // sinks with at least one subscriber
+    std::unordered_set<NodeKey> demanded_; // subscribed sinks, watched nodes and every node they depend on
 
-    std::unordered_set<google::protobuf::Message*> copy_node_to_messages(
-        const ServerNode& node, int field_index, const std::unordered_set<google::protobuf::Message*>& parent_msgs);
-};
+    std::unique_ptr<util::WorkStealingPool> compute_pool_;
+    std::unique_ptr<util::WorkStealingPool> async_pool_;
 
-template <typename T, typename>
-bool ServerTree::add_output(std::shared_ptr<util::BlockingQueue<T>> queue) {
-    auto data = std::make_unique<SinkData<T>>(std::move(queue));
+    /**
+     * An epoch arena that may still hold node values. Values that outlive their epoch for a while
+     * are copied to the heap so they don't keep the rest of the arena from being recycled.
+     */
+    struct EpochArena {
+        std::uint64_t epoch;
+        std::uint64_t check_epoch; // when the arena is next checked for node values
+        std::weak_ptr<google::protobuf::Arena> arena;
+        const std::atomic<std::size_t>* num_snapshots; // allocated on the arena
+    };
 
-    auto key = get_key(data->get_data());
-    if (sinks_.find(key) != sinks_.end()) {
-        return false;
-    }
+    std::shared_ptr<util::ArenaPool> arena_pool_; // null when values are heap allocated
+    std::shared_ptr<google::protobuf::Arena> epoch_arena_; // set for the duration of each epoch
+    std::atomic<std::size_t>* epoch_snapshots_ = nullptr; // live snapshots on `epoch_arena_`
+    std::vector<EpochArena> epoch_arenas_;
+    std::uint64_t epoch_ = 0; // incremented at the start of every epoch
 
-    auto sink_key = build_node(data->get_data());
-    assert(key == sink_key);
-    sinks_.emplace(sink_key, std::move(data));
+    // Reused by every parallel update
+    struct ParallelUpdate;
+    std::unique_ptr<std::atomic<std::size_t>[]> remaining_inputs_;
+    std::size_t remaining_inputs_capacity_ = 0;
 
-    {
-        std::ofstream graphvis_file("nodes.dot.ps");
-        graphvis_file << graphvis_string();
-    }
+    std::shared_ptr<const GraphLayout> layout_;
+    std::shared_ptr<const GraphView> view_; // only accessed with the std::atomic_* shared_ptr functions
+    std::shared_ptr<GraphView> spare_view_; // a replaced view no reader held, kept for its storage
+    std::shared_ptr<DebugExporter> debug_exporter_; // null when exports are disabled
+    std::uint64_t view_version_ = 0;
+
+    static NodeKey get_key(const google::protobuf::Descriptor* desc);
+    static NodeKey get_key(const google::protobuf::Message& message);
+    static NodeKey get_key(google::protobuf::Message* message);
 
-    return true;
+    NodeKey build_node(google::protobuf::Message* message);
+    void assign_scope(NodeKey key);
+
+    void compile_plans();
+    PropagationPlan compile_plan(const std::vector<NodeKey>& roots) const;
+
+    bool is_demanded(NodeKey key) const;
+    void update_demand();
+    void defer_node(ServerNode* node);
+    bool pull(const std::vector<NodeKey>& targets);
+
+    void begin_epoch();
+    void end_epoch();
+    void copy_long_lived_values();
+    std::shared_ptr<const Snapshot>
+    copy_to_heap(const std::shared_ptr<const Snapshot>& snapshot,
+                 const std::vector<std::shared_ptr<google::protobuf::Arena>>& arenas,
+                 std::unordered_map<const Snapshot*, std::shared_ptr<const Snapshot>>* copies) const;
+    void run_epoch(const std::vector<NodeKey>& roots, const PropagationPlan& plan);
+
+    void build_layout();
+    void publish_view();
+
+    std::vector<std::string> step_elements(const PropagationStep& step, const ServerNode& node) const;
+    static NodeState* find_state(ServerNode* node, const std::string* element);
+    static void supersede_async(NodeState* state);
+    static const NodeState* find_state(const ServerNode& node, const std::string* element);
+    bool input_valid(const ServerNode& node, int field_index, const std::string* element) const;
+    bool input_changed(const ServerNode& node, int field_index, const std::string* element) const;
+    bool any_input_changed(const PropagationStep& step, const ServerNode& node, const std::string* element) const;
+
+    void invalidate_node(const PropagationStep& step);
+    std::shared_ptr<Snapshot> allocate_snapshot(const google::protobuf::Message& prototype) const;
+    SnapshotInputs input_snapshots(const ServerNode& node, const std::string* element) const;
+    std::shared_ptr<Snapshot> new_snapshot(const ServerNode& node,
+                                           const NodeState& state,
+                                           const std::string* element) const;
+    void resume_interrupted_nodes();
+
+    bool update_node(const PropagationStep& step);
+    bool update_state(const PropagationStep& step, ServerNode* node, NodeState* state, const std::string* element);
+    bool update_nodes(const PropagationPlan& plan);
+    void run_parallel_step(ParallelUpdate* update, std::size_t step_index);
+
+    void launch_async_compute(NodeKey key,
+                              const std::string* element,
+                              const Computer& computer,
+                              std::shared_ptr<Snapshot> working,
+                              std::string cache_key);
+    void finish_async_compute(NodeKey key,
+                              std::optional<std::string> element,
+                              std::uint64_t generation,
+                              std::shared_ptr<Snapshot> result,
+                              std::string cache_key);
+
+    static void
+    serialize_computed_fields(const ServerNode& node, google::protobuf::Message* message, std::string* bytes);
+    void record_computed_fields(const ServerNode& node,
+                                NodeState* state,
+                                google::protobuf::Message* message,
+                                bool force_changed) const;
+    void apply_computed_fields(NodeState* state,
+                               google::protobuf::Message* message,
+                               std::string_view computed_fields) const;
+
+    static std::string serialize_inputs(const ServerNode& node, const google::protobuf::Message& message);
+    static const std::string* find_cached_result(ServerNode* node, const std::string& cache_key);
+    static void cache_result(ServerNode* node, const NodeState& state, std::string cache_key);
+
+    const ServerNode& get_node(const google::protobuf::Descriptor* desc) const;
+    ServerNode& get_node(const google::protobuf::Descriptor* desc);
+
+    void send_notices(const PropagationStep& step, bool updated);
+    void send_sinks(const PropagationPlan& plan);
+    void send_sink(const ServerNode& node, Sink* sink);
+    void send_if_newer(const Snapshot& snapshot, Sink* sink, std::uint64_t* sent_version, bool invalidated) const;
+
+    bool add_sink(std::unique_ptr<Sink> data, SinkEmission emission);
+    void send_watched(const std::vector<NodeKey>& roots, const PropagationPlan& plan);
+    void send_to_watchers(NodeKey key);
+    void send_watched(Watcher* watcher, bool all_elements);
+};
+
+template <typename T, typename>
+bool ServerTree::add_output(std::shared_ptr<util::BlockingQueue<std::shared_ptr<const T>>> queue,
+                            SinkEmission emission) {
+    return add_sink(std::make_unique<SinkData<T>>(std::move(queue)), emission);
+}
+
+template <typename T, typename>
+bool ServerTree::add_output(std::shared_ptr<util::BlockingQueue<SinkValue<T>>> queue, SinkEmission emission) {
+    return add_sink(std::make_unique<SinkData<T>>(std::move(queue)), emission);
 }
 
 template <typename T, typename Func, typename... Args>
@@ -138,4 +800,28 @@ void ServerTree::register_function(Func func, Args... args) {
                                                                                           std::forward<Args>(args)...));
 }
 
+template <typename T>
+void ServerTree::enable_cache(std::size_t max_bytes) {
+    static_assert(std::is_base_of<google::protobuf::Message, T>::value);
+    std::lock_guard<std::mutex> scoped_lock(update_lock_);
+    get_node(T::descriptor()).cache = std::make_unique<NodeCache>(max_bytes);
+}
+
+template <typename T>
+ServerTree::CacheStats ServerTree::cache_stats() const {
+    static_assert(std::is_base_of<google::protobuf::Message, T>::value);
+    const ServerNode& node = get_node(T::descriptor());
+
+    CacheStats stats;
+    if (node.cache) {
+        std::lock_guard<std::mutex> scoped_lock(node.cache->lock);
+        stats.hits = node.cache->hits;
+        stats.misses = node.cache->misses;
+        stats.entries = node.cache->results.size();
+        stats.bytes = node.cache->results.total_cost();
+        stats.max_bytes = node.cache->results.max_cost();
+    }
+    return stats;
+}
+
 } // namespace svr
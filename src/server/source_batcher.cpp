@@ -0,0 +1,149 @@
+#include "server/source_batcher.h"
+#include "server/server_tree.h"
+#include "util/message_util.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace gp = google::protobuf;
+
+namespace svr {
+
+SourceBatcher::SourceBatcher(ServerTree* server_tree,
+                             std::chrono::milliseconds window,
+                             std::size_t max_batch_size,
+                             std::size_t queue_size)
+    : server_tree_(server_tree)
+    , window_(window)
+    , max_batch_size_(std::max(max_batch_size, std::size_t(1)))
+    , queue_(queue_size)
+    , stop_(false)
+    , applied_sequence_(0) {
+    propagation_thread_ = std::thread([this] { run_propagation_loop(); });
+}
+
+SourceBatcher::~SourceBatcher() {
+    // Anything still queued is propagated before the thread exits
+    stopping_.store(true);
+    stop_.use_safely([](bool& stop) { stop = true; });
+    stop_.notify_one();
+    propagation_thread_.join();
+}
+
+bool SourceBatcher::push(const google::protobuf::Message& source, std::uint64_t* sequence) {
+    if (not server_tree_->is_source(source)) {
+        return false;
+    }
+
+    std::unique_ptr<gp::Message> message = util::clone_msg(source);
+
+    std::size_t position = 0;
+    while (not queue_.try_push(std::move(message), &position)) {
+        std::this_thread::yield();
+    }
+
+    // Updates are numbered in the order they are popped, which is the order they were pushed
+    if (sequence) {
+        *sequence = position + 1u;
+    }
+
+    // Sequentially consistent with the propagation thread's store to `propagation_waiting_` and
+    // load of `num_pushed_`, so either this thread sees it waiting or it sees this update
+    num_pushed_.fetch_add(1);
+
+    if (propagation_waiting_.load()) {
+        stop_.use_safely([](bool&) {});
+        stop_.notify_one();
+    }
+
+    return true;
+}
+
+std::uint64_t SourceBatcher::applied_sequence() const {
+    std::uint64_t applied = 0;
+    applied_sequence_.use_safely([&applied](std::uint64_t sequence) { applied = sequence; });
+    return applied;
+}
+
+std::uint64_t SourceBatcher::wait_for_applied_sequence(std::uint64_t sequence, unsigned max_wait_time_millis) const {
+    std::uint64_t applied = 0;
+    if (not applied_sequence_.wait_to_use_safely(
+            max_wait_time_millis,
+            [sequence](std::uint64_t applied_sequence) { return applied_sequence > sequence; },
+            [&applied](std::uint64_t applied_sequence) { applied = applied_sequence; })) {
+        return applied_sequence();
+    }
+    return applied;
+}
+
+void SourceBatcher::run_propagation_loop() {
+    using Clock = std::chrono::steady_clock;
+
+    while (true) {
+        Batch batch;
+        std::size_t num_received = drain_queue(&batch);
+
+        if (batch.empty()) {
+            if (stopping_.load()) {
+                break;
+            }
+            wait_for_updates(Clock::time_point::max());
+            continue;
+        }
+
+        // Give later updates a chance to supersede the pending ones
+        auto deadline = Clock::now() + window_;
+        while (num_received < max_batch_size_ and not stopping_.load() and Clock::now() < deadline) {
+            wait_for_updates(deadline);
+            num_received += drain_queue(&batch);
+        }
+
+        std::vector<const gp::Message*> messages;
+        messages.reserve(batch.size());
+
+        std::uint64_t last_sequence = 0;
+        for (const auto& source_pair : batch) {
+            messages.emplace_back(source_pair.second.message.get());
+            last_sequence = std::max(last_sequence, source_pair.second.sequence);
+        }
+
+        server_tree_->update_sources(messages);
+        applied_sequence_.use_safely([last_sequence](std::uint64_t& sequence) { sequence = last_sequence; });
+        applied_sequence_.notify_all();
+    }
+}
+
+std::size_t SourceBatcher::drain_queue(Batch* batch) {
+    std::size_t num_drained = 0;
+    std::unique_ptr<gp::Message> message;
+
+    while (queue_.try_pop(&message)) {
+        ++num_drained;
+        ++num_popped_;
+        auto key = std::make_pair(message->GetDescriptor(), server_tree_->element_key(*message));
+
+        // Supersedes any earlier update for this source
+        batch->insert_or_assign(std::move(key), SequencedSource{++next_sequence_, std::move(message)});
+    }
+    return num_drained;
+}
+
+void SourceBatcher::wait_for_updates(std::chrono::steady_clock::time_point deadline) {
+    propagation_waiting_.store(true);
+
+    // An update can be popped before its producer counts it so the counts may briefly go the other way
+    auto ready = [this](bool stop) { return stop or num_pushed_.load() > num_popped_; };
+
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        stop_.wait_to_use_safely(ready, [](bool) {});
+    } else {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() > 0) {
+            stop_.wait_to_use_safely(static_cast<unsigned>(remaining.count()), ready, [](bool) {});
+        }
+    }
+
+    propagation_waiting_.store(false);
+}
+
+} // namespace svr
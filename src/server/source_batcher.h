@@ -0,0 +1,90 @@
+#pragma once
+
+#include "util/atomic_data.h"
+#include "util/mpsc_ring.h"
+
+#include <google/protobuf/message.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace svr {
+
+class ServerTree;
+
+/**
+ * @brief Sequences source updates from any number of threads into ServerTree propagation epochs
+ *
+ * Producers push into a lock-free ring and return immediately. A single propagation thread
+ * drains the ring, numbers every update in the order it was received, and is the only thread
+ * that updates the ServerTree. Only the latest value of each source (or keyed collection
+ * element) is kept. Once an update is pending the thread waits up to `window` (or until
+ * `max_batch_size` updates have arrived) before propagating, and anything that arrives while
+ * a propagation runs is folded into the next epoch, so batch sizes grow with the incoming
+ * update rate.
+ */
+class SourceBatcher {
+public:
+    explicit SourceBatcher(ServerTree* server_tree,
+                           std::chrono::milliseconds window,
+                           std::size_t max_batch_size,
+                           std::size_t queue_size = 1024);
+    ~SourceBatcher();
+
+    /**
+     * @brief Never takes a lock. Spins (yielding) only if the propagation thread has fallen a full queue behind.
+     *
+     * `sequence` (if given) is set to the sequence number the update is applied with.
+     *
+     * @return false if the message does not correspond to a source
+     */
+    bool push(const google::protobuf::Message& source, std::uint64_t* sequence = nullptr);
+
+    /**
+     * @return the sequence number of the last update applied to the ServerTree (0 before the first)
+     */
+    std::uint64_t applied_sequence() const;
+
+    /**
+     * @brief Blocks until an update after `sequence` has been applied or `max_wait_time_millis` has passed
+     * @return the sequence number of the last update applied to the ServerTree
+     */
+    std::uint64_t wait_for_applied_sequence(std::uint64_t sequence, unsigned max_wait_time_millis) const;
+
+private:
+    ServerTree* server_tree_;
+    std::chrono::milliseconds window_;
+    std::size_t max_batch_size_;
+
+    util::MpscRing<std::unique_ptr<google::protobuf::Message>> queue_;
+
+    // Producers only take the lock to wake the propagation thread when it is waiting
+    std::atomic_bool propagation_waiting_ = false;
+    std::atomic<std::uint64_t> num_pushed_ = 0;
+    std::uint64_t num_popped_ = 0; // only used by the propagation thread
+    util::AtomicData<bool> stop_;
+    std::atomic_bool stopping_ = false;
+
+    struct SequencedSource {
+        std::uint64_t sequence;
+        std::unique_ptr<google::protobuf::Message> message;
+    };
+    // Keyed by source type and collection element key (empty for sources that aren't collections)
+    using Batch = std::map<std::pair<const google::protobuf::Descriptor*, std::string>, SequencedSource>;
+
+    // Only used by the propagation thread
+    std::uint64_t next_sequence_ = 0;
+    util::AtomicData<std::uint64_t> applied_sequence_;
+
+    std::thread propagation_thread_;
+
+    void run_propagation_loop();
+    std::size_t drain_queue(Batch* batch);
+    void wait_for_updates(std::chrono::steady_clock::time_point deadline);
+};
+
+} // namespace svr
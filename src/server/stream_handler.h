@@ -1,89 +1,352 @@
 #pragma once
 
 #include <util/atomic_data.h>
-#include <util/blocking_deque.h>
-#include <util/semaphore.h>
 
-#include <grpcpp/server_context.h>
-
-#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace svr {
 
+/**
+ * @brief What happens to a client that falls more than a buffer behind the newest value
+ */
+enum class SlowClientPolicy {
+    SKIP_TO_LATEST, // for streams where each value supersedes the ones before it
+    DISCONNECT, // for streams where every value matters
+};
+
+/**
+ * @brief The result of StreamHandler::try_read
+ */
+enum class StreamRead {
+    VALUE,
+    NOTHING_NEW, // wait with `wake_when_readable`
+    TOO_FAR_BEHIND, // only with SlowClientPolicy::DISCONNECT
+    SHUT_DOWN,
+};
+
+/**
+ * Broadcasts values to every connected client through a shared ring buffer. Each client reads
+ * from its own position in the ring so `send_data` never waits for a client and a slow client
+ * only holds up itself. Reads never block, so one thread can serve any number of clients.
+ */
 template <typename T>
 class StreamHandler {
 public:
-    void handle_client(grpc::ServerContext* context, grpc::ServerWriter<T>* writer);
+    /**
+     * @param buffer_size is the number of recent values kept for clients that fall behind
+     */
+    explicit StreamHandler(std::size_t buffer_size = 64, SlowClientPolicy policy = SlowClientPolicy::SKIP_TO_LATEST);
+
+    /**
+     * @brief The position of the next value to be sent. Clients that connect now start reading here.
+     */
+    std::uint64_t end() const;
 
-    void send_data(T data);
+    /**
+     * @brief Takes the value at `*cursor` and advances the cursor
+     */
+    StreamRead try_read(std::uint64_t* cursor, std::shared_ptr<const T>* data);
+
+    /**
+     * @brief Calls `wake` once `try_read(cursor)` has something other than NOTHING_NEW to return
+     *
+     * `wake` is called right away if that is already the case, and otherwise from the thread that
+     * sends the value (or shuts the handler down), so it should only hand the work off.
+     *
+     * @return an id for `cancel_wake`
+     */
+    std::uint64_t wake_when_readable(std::uint64_t cursor, std::function<void()> wake);
+
+    /**
+     * @return false if the wake has already been called (or is being called)
+     */
+    bool cancel_wake(std::uint64_t wake_id);
+
+    /**
+     * @brief Never blocks on the clients. Clients share the value instead of copying it.
+     */
+    void send_data(std::shared_ptr<const T> data);
 
     void attempt_shutdown();
 
 private:
-    util::AtomicData<unsigned> num_streaming_clients_;
-    util::BlockingQueue<T> queue_;
+    struct Ring {
+        std::vector<std::shared_ptr<const T>> slots; // value `n` is in slot `n % slots.size()`
+        std::uint64_t next = 0; // number of values ever sent
+        bool shutdown = false;
 
-    util::Semaphore pop_block_;
-    util::Semaphore loop_block_;
+        // Clients waiting for the next value
+        std::map<std::uint64_t, std::function<void()>> wakes = {};
+        std::uint64_t last_wake_id = 0;
+    };
+    util::AtomicData<Ring> ring_;
+    const SlowClientPolicy policy_;
 
-    std::atomic_bool attempt_shutdown_ = false;
+    void wake_all(Ring* ring, std::vector<std::function<void()>>* wakes);
 };
 
+/**
+ * The stream of a single client that only keeps the latest unread value with each key, so a client
+ * that falls behind skips to the newest value of every key instead of being disconnected. Memory is
+ * bounded by the number of keys rather than by how far behind the client is.
+ *
+ * Values are read in the order their keys became unread. Has the same interface as StreamHandler
+ * except that the cursor only counts the values read.
+ */
 template <typename T>
-void StreamHandler<T>::handle_client(grpc::ServerContext* context, grpc::ServerWriter<T>* writer) {
-    num_streaming_clients_.use_safely([](unsigned& clients) { ++clients; });
+class LatestPerKeyStream {
+public:
+    explicit LatestPerKeyStream(std::function<std::string(const T&)> key_of);
 
-    bool broken_stream = false;
+    std::uint64_t end() const;
 
-    T data_to_send;
+    StreamRead try_read(std::uint64_t* cursor, std::shared_ptr<const T>* data);
 
-    while (not broken_stream and not attempt_shutdown_.load() and not context->IsCancelled()) {
-        // wait for a max of 5 seconds before checking that the stream is still valid
-        if (queue_.wait_for(5000u)) {
-            data_to_send = queue_.front_copy();
+    std::uint64_t wake_when_readable(std::uint64_t cursor, std::function<void()> wake);
 
-            pop_block_.notify();
-            broken_stream = not writer->Write(data_to_send);
-            loop_block_.wait();
-        }
-    }
+    bool cancel_wake(std::uint64_t wake_id);
 
-    num_streaming_clients_.use_safely([](unsigned& clients) { --clients; });
+    /**
+     * @brief Replaces the unread value with the same key, if there is one
+     */
+    void send_data(std::shared_ptr<const T> data);
+
+    void attempt_shutdown();
+
+private:
+    struct Unread {
+        std::deque<std::string> keys; // in the order they became unread
+        std::unordered_map<std::string, std::shared_ptr<const T>> values; // by key
+        std::uint64_t num_read = 0;
+        bool shutdown = false;
+
+        std::function<void()> wake = nullptr; // the reader waiting for the next value
+        std::uint64_t wake_id = 0;
+    };
+    util::AtomicData<Unread> unread_;
+    const std::function<std::string(const T&)> key_of_;
+
+    static std::function<void()> take_wake(Unread* unread);
+};
+
+template <typename T>
+StreamHandler<T>::StreamHandler(std::size_t buffer_size, SlowClientPolicy policy)
+    : ring_(Ring{std::vector<std::shared_ptr<const T>>(std::max(buffer_size, std::size_t(1))), 0, false})
+    , policy_(policy) {}
+
+template <typename T>
+std::uint64_t StreamHandler<T>::end() const {
+    std::uint64_t next = 0;
+    ring_.use_safely([&next](const Ring& ring) { next = ring.next; });
+    return next;
 }
 
 template <typename T>
-void StreamHandler<T>::send_data(T data) {
-    num_streaming_clients_.use_safely([&](unsigned clients) {
-        queue_.push_back(std::move(data));
+StreamRead StreamHandler<T>::try_read(std::uint64_t* cursor, std::shared_ptr<const T>* data) {
+    StreamRead result = StreamRead::NOTHING_NEW;
 
-        for (auto i = 0u; i < clients; ++i) {
-            pop_block_.wait();
+    ring_.use_safely([&](const Ring& ring) {
+        if (ring.shutdown) {
+            result = StreamRead::SHUT_DOWN;
+            return;
         }
+        if (ring.next == *cursor) {
+            return;
+        }
+
+        // The values after `cursor` have been overwritten
+        if (ring.next - *cursor > ring.slots.size()) {
+            if (policy_ == SlowClientPolicy::DISCONNECT) {
+                result = StreamRead::TOO_FAR_BEHIND;
+                return;
+            }
+            *cursor = ring.next - 1u;
+        }
+        *data = ring.slots[*cursor % ring.slots.size()];
+        ++*cursor;
+        result = StreamRead::VALUE;
+    });
 
-        queue_.pop_front();
+    return result;
+}
 
-        for (auto i = 0u; i < clients; ++i) {
-            loop_block_.notify();
+template <typename T>
+std::uint64_t StreamHandler<T>::wake_when_readable(std::uint64_t cursor, std::function<void()> wake) {
+    std::uint64_t wake_id = 0;
+
+    ring_.use_safely([&](Ring& ring) {
+        if (ring.shutdown or ring.next != cursor) {
+            return;
         }
+        wake_id = ++ring.last_wake_id;
+        ring.wakes.emplace(wake_id, std::move(wake));
+    });
+
+    if (wake_id == 0u) {
+        wake();
+    }
+    return wake_id;
+}
+
+template <typename T>
+bool StreamHandler<T>::cancel_wake(std::uint64_t wake_id) {
+    bool cancelled = false;
+    ring_.use_safely([&](Ring& ring) { cancelled = (ring.wakes.erase(wake_id) > 0u); });
+    return cancelled;
+}
+
+template <typename T>
+void StreamHandler<T>::send_data(std::shared_ptr<const T> data) {
+    std::vector<std::function<void()>> wakes;
+
+    ring_.use_safely([&](Ring& ring) {
+        ring.slots[ring.next % ring.slots.size()] = std::move(data);
+        ++ring.next;
+        wake_all(&ring, &wakes);
     });
+
+    // Called without holding the ring so woken clients can read right away
+    for (const auto& wake : wakes) {
+        wake();
+    }
 }
 
 template <typename T>
 void StreamHandler<T>::attempt_shutdown() {
-    num_streaming_clients_.use_safely([this](unsigned clients) {
-        queue_.push_back(T());
+    std::vector<std::function<void()>> wakes;
+
+    ring_.use_safely([&](Ring& ring) {
+        ring.shutdown = true;
+        wake_all(&ring, &wakes);
+    });
+
+    for (const auto& wake : wakes) {
+        wake();
+    }
+}
+
+template <typename T>
+void StreamHandler<T>::wake_all(Ring* ring, std::vector<std::function<void()>>* wakes) {
+    wakes->reserve(ring->wakes.size());
+    for (auto& wake_pair : ring->wakes) {
+        wakes->emplace_back(std::move(wake_pair.second));
+    }
+    ring->wakes.clear();
+}
 
-        for (auto i = 0u; i < clients; ++i) {
-            pop_block_.wait();
+template <typename T>
+LatestPerKeyStream<T>::LatestPerKeyStream(std::function<std::string(const T&)> key_of)
+    : unread_(Unread{}), key_of_(std::move(key_of)) {}
+
+template <typename T>
+std::uint64_t LatestPerKeyStream<T>::end() const {
+    std::uint64_t num_read = 0;
+    unread_.use_safely([&num_read](const Unread& unread) { num_read = unread.num_read; });
+    return num_read;
+}
+
+template <typename T>
+StreamRead LatestPerKeyStream<T>::try_read(std::uint64_t* cursor, std::shared_ptr<const T>* data) {
+    StreamRead result = StreamRead::NOTHING_NEW;
+
+    unread_.use_safely([&](Unread& unread) {
+        if (unread.shutdown) {
+            result = StreamRead::SHUT_DOWN;
+            return;
+        }
+        if (unread.keys.empty()) {
+            return;
         }
 
-        queue_.pop_front();
-        attempt_shutdown_.store(true);
+        auto iter = unread.values.find(unread.keys.front());
+        *data = std::move(iter->second);
+        unread.values.erase(iter);
+        unread.keys.pop_front();
+
+        *cursor = ++unread.num_read;
+        result = StreamRead::VALUE;
+    });
+
+    return result;
+}
 
-        for (auto i = 0u; i < clients; ++i) {
-            loop_block_.notify();
+template <typename T>
+std::uint64_t LatestPerKeyStream<T>::wake_when_readable(std::uint64_t /*cursor*/, std::function<void()> wake) {
+    std::uint64_t wake_id = 0;
+
+    unread_.use_safely([&](Unread& unread) {
+        if (unread.shutdown or not unread.keys.empty()) {
+            return;
         }
+        wake_id = ++unread.wake_id;
+        unread.wake = std::move(wake);
     });
+
+    if (wake_id == 0u) {
+        wake();
+    }
+    return wake_id;
+}
+
+template <typename T>
+bool LatestPerKeyStream<T>::cancel_wake(std::uint64_t wake_id) {
+    bool cancelled = false;
+    unread_.use_safely([&](Unread& unread) {
+        if (unread.wake and unread.wake_id == wake_id) {
+            unread.wake = nullptr;
+            cancelled = true;
+        }
+    });
+    return cancelled;
+}
+
+template <typename T>
+void LatestPerKeyStream<T>::send_data(std::shared_ptr<const T> data) {
+    std::string key = key_of_(*data);
+    std::function<void()> wake;
+
+    unread_.use_safely([&](Unread& unread) {
+        auto iter = unread.values.find(key);
+        if (iter != unread.values.end()) {
+            iter->second = std::move(data);
+            return;
+        }
+        unread.values.emplace(key, std::move(data));
+        unread.keys.emplace_back(std::move(key));
+        wake = take_wake(&unread);
+    });
+
+    if (wake) {
+        wake();
+    }
+}
+
+template <typename T>
+void LatestPerKeyStream<T>::attempt_shutdown() {
+    std::function<void()> wake;
+
+    unread_.use_safely([&](Unread& unread) {
+        unread.shutdown = true;
+        wake = take_wake(&unread);
+    });
+
+    if (wake) {
+        wake();
+    }
+}
+
+template <typename T>
+std::function<void()> LatestPerKeyStream<T>::take_wake(Unread* unread) {
+    std::function<void()> wake = std::move(unread->wake);
+    unread->wake = nullptr;
+    return wake;
 }
 
 } // namespace svr
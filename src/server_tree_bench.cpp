@@ -0,0 +1,103 @@
+// project
+#include "allocation_counter.h"
+#include <server/compute_functions.h>
+#include <server/server_tree.h>
+#include <proj/state.pb.h>
+// standard
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+namespace {
+
+struct BenchResult {
+    double allocations_per_update;
+    double bytes_per_update;
+    double micros_per_update;
+};
+
+BenchResult run_updates(unsigned num_compute_threads, bool use_epoch_arenas, unsigned num_updates) {
+    auto queue = std::make_shared<util::BlockingQueue<std::shared_ptr<const proj::proto::Sink2>>>();
+
+    svr::ServerTree server_tree(num_compute_threads, 1, use_epoch_arenas);
+    server_tree.add_output(queue);
+
+    svr::Compute compute;
+    compute.register_compute_functions(&server_tree);
+
+    proj::proto::Source1 source1;
+    proj::proto::Source2 source2;
+    proj::proto::Source3 source3;
+    source3.set_state("source3");
+
+    auto update = [&](unsigned i) {
+        // Alternate between sources so every update recomputes most of the graph
+        if (i % 2u == 0u) {
+            source1.set_state("source1_" + std::to_string(i % 10u));
+            server_tree.update_source(source1);
+        } else {
+            source2.set_state("source2_" + std::to_string(i % 10u));
+            server_tree.update_source(source2);
+        }
+        // Consumers drop sink values once they are done with them
+        while (not queue->non_blocking_empty()) {
+            queue->pop_front();
+        }
+    };
+
+    server_tree.update_source(source3);
+
+    // Warm up so the arena sizes and containers settle before measuring
+    for (auto i = 0u; i < 20u; ++i) {
+        update(i);
+    }
+
+    std::size_t allocations_before = bench::num_allocations();
+    std::size_t bytes_before = bench::num_allocated_bytes();
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto i = 0u; i < num_updates; ++i) {
+        update(i);
+    }
+
+    auto duration = std::chrono::steady_clock::now() - start;
+    std::size_t allocations = bench::num_allocations() - allocations_before;
+    std::size_t bytes = bench::num_allocated_bytes() - bytes_before;
+
+    return {static_cast<double>(allocations) / num_updates,
+            static_cast<double>(bytes) / num_updates,
+            std::chrono::duration<double, std::micro>(duration).count() / num_updates};
+}
+
+void print_result(const std::string& name, const BenchResult& result) {
+    std::cout << name << ": " << result.allocations_per_update << " allocations/update, "
+              << result.bytes_per_update << " bytes/update, " << result.micros_per_update << " us/update"
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    unsigned num_updates = 1000;
+
+    if (argc > 1) {
+        num_updates = static_cast<unsigned>(std::stoul(argv[1]));
+    }
+
+    // Steps of the parallel configuration run on the work stealing pool
+    unsigned num_threads = std::max(2u, std::thread::hardware_concurrency());
+
+    BenchResult heap = run_updates(1, false, num_updates);
+    BenchResult arena = run_updates(1, true, num_updates);
+    BenchResult parallel_heap = run_updates(num_threads, false, num_updates);
+    BenchResult parallel_arena = run_updates(num_threads, true, num_updates);
+
+    std::cout << std::endl;
+    print_result("heap           ", heap);
+    print_result("arena          ", arena);
+    print_result("parallel heap  ", parallel_heap);
+    print_result("parallel arena ", parallel_arena);
+
+    return 0;
+}
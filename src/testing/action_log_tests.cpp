@@ -0,0 +1,240 @@
+#include "server/action_log.h"
+#include "server/server_tree.h"
+#include <gtest/gtest.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+#include <proj/testing/collections.pb.h>
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace proj {
+namespace test {
+
+namespace {
+
+namespace gp = google::protobuf;
+namespace tp = proj::testing_proto;
+
+tp::Item item(const std::string& id, int value) {
+    tp::Item item;
+    item.set_id(id);
+    item.set_value(value);
+    return item;
+}
+
+tp::Settings settings(int scale) {
+    tp::Settings settings;
+    settings.set_scale(scale);
+    return settings;
+}
+
+// Removes the log (and a compaction left behind) when the test ends
+struct TempLog {
+    std::string filename;
+
+    explicit TempLog(std::string name) : filename(std::move(name)) { remove_files(); }
+    ~TempLog() { remove_files(); }
+
+    void remove_files() const {
+        std::remove(filename.c_str());
+        std::remove((filename + ".tmp").c_str());
+    }
+
+    std::vector<std::string> read_all() const {
+        std::vector<std::string> messages;
+        svr::ActionLog::read(filename, [&messages](std::unique_ptr<gp::Message> message) {
+            messages.emplace_back(message->GetDescriptor()->name() + " " + message->ShortDebugString());
+        });
+        return messages;
+    }
+};
+
+// The collections graph, so Item is a keyed source. Scaled computes are counted.
+struct CollectionTree {
+    std::atomic_int scaled_computes = 0;
+    std::shared_ptr<util::BlockingQueue<std::shared_ptr<const tp::Total>>> totals
+        = std::make_shared<util::BlockingQueue<std::shared_ptr<const tp::Total>>>();
+
+    // Destroyed first so no compute function outlives the members it uses
+    svr::ServerTree server_tree{1, 1};
+
+    CollectionTree() {
+        server_tree.add_output(totals);
+        server_tree.register_function<tp::Scaled>([this](tp::Scaled* scaled) {
+            ++scaled_computes;
+            scaled->set_scaled(scaled->item().value() * scaled->settings().scale());
+        });
+        server_tree.register_function<tp::Total>([](tp::Total* total) {
+            int sum = 0;
+            for (const tp::Scaled& scaled : total->scaled()) {
+                sum += scaled.scaled();
+            }
+            total->set_total(sum);
+        });
+    }
+};
+
+// Messages of a type this binary doesn't have, like records written by a newer build
+class UnknownMessages {
+public:
+    UnknownMessages() {
+        gp::FileDescriptorProto file;
+        file.set_name("unknown.proto");
+        file.set_package("proj.unknown");
+        file.set_syntax("proto3");
+        gp::DescriptorProto* message = file.add_message_type();
+        message->set_name("Unknown");
+        gp::FieldDescriptorProto* field = message->add_field();
+        field->set_name("state");
+        field->set_number(1);
+        field->set_type(gp::FieldDescriptorProto::TYPE_STRING);
+        field->set_label(gp::FieldDescriptorProto::LABEL_OPTIONAL);
+
+        desc_ = pool_.BuildFile(file)->message_type(0);
+    }
+
+    std::unique_ptr<gp::Message> create(const std::string& state) {
+        std::unique_ptr<gp::Message> message(factory_.GetPrototype(desc_)->New());
+        message->GetReflection()->SetString(message.get(), desc_->field(0), state);
+        return message;
+    }
+
+private:
+    gp::DescriptorPool pool_;
+    gp::DynamicMessageFactory factory_;
+    const gp::Descriptor* desc_ = nullptr;
+};
+
+} // namespace
+
+TEST(ActionLogTests, a_torn_record_is_removed_when_the_log_is_opened) {
+    TempLog log_file("action_log_torn_test.log");
+    {
+        svr::ActionLog log(log_file.filename);
+        log.append(item("a", 1));
+        EXPECT_TRUE(log.wait_until_durable(log.append(item("b", 2))));
+    }
+    auto valid_size = std::filesystem::file_size(log_file.filename);
+
+    // The start of a record header, as if the process died while writing it
+    {
+        std::ofstream torn(log_file.filename, std::ios::binary | std::ios::app);
+        torn.write("\x10\x00\x00", 3);
+    }
+    EXPECT_EQ(svr::ActionLog::read(log_file.filename, [](std::unique_ptr<gp::Message>) {}), 2u);
+
+    {
+        svr::ActionLog log(log_file.filename);
+        EXPECT_EQ(std::filesystem::file_size(log_file.filename), valid_size);
+        EXPECT_TRUE(log.wait_until_durable(log.append(item("c", 3))));
+    }
+
+    // New records follow the last complete one
+    EXPECT_EQ(log_file.read_all(),
+              (std::vector<std::string>{"Item id: \"a\" value: 1", "Item id: \"b\" value: 2", "Item id: \"c\" value: 3"}));
+}
+
+TEST(ActionLogTests, durability_callbacks_run_in_sequence_order_for_concurrent_appends) {
+    TempLog log_file("action_log_group_test.log");
+    constexpr int num_threads = 4;
+    constexpr int appends_per_thread = 50;
+
+    std::mutex lock;
+    std::vector<std::vector<int>> durable_values(num_threads);
+    std::atomic_bool all_durable = true;
+    std::atomic<std::uint64_t> last_sequence = 0;
+
+    {
+        svr::ActionLog log(log_file.filename);
+
+        std::vector<std::thread> threads;
+        for (auto t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&, t] {
+                for (auto i = 0; i < appends_per_thread; ++i) {
+                    std::uint64_t sequence = log.append(item(std::to_string(t), i), [&, t, i](bool durable) {
+                        all_durable = all_durable and durable;
+                        std::lock_guard<std::mutex> scoped_lock(lock);
+                        durable_values[static_cast<std::size_t>(t)].emplace_back(i);
+                    });
+
+                    std::uint64_t last = last_sequence.load();
+                    while (last < sequence and not last_sequence.compare_exchange_weak(last, sequence)) {
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        // Durable once every record up to it is synced, however the appends were grouped
+        EXPECT_TRUE(log.wait_until_durable(last_sequence.load()));
+    }
+    EXPECT_EQ(last_sequence.load(), std::uint64_t(num_threads * appends_per_thread));
+    EXPECT_TRUE(all_durable);
+
+    // Each thread's records were appended (and made durable) in order
+    for (const std::vector<int>& values : durable_values) {
+        ASSERT_EQ(values.size(), std::size_t(appends_per_thread));
+        for (auto i = 0; i < appends_per_thread; ++i) {
+            EXPECT_EQ(values[static_cast<std::size_t>(i)], i);
+        }
+    }
+    EXPECT_EQ(log_file.read_all().size(), std::size_t(num_threads * appends_per_thread));
+}
+
+TEST(ActionLogTests, replay_applies_only_the_latest_update_in_each_batch) {
+    TempLog log_file("action_log_replay_test.log");
+    {
+        svr::ActionLog log(log_file.filename);
+        log.append(settings(10));
+        for (auto i = 1; i <= 20; ++i) {
+            log.append(item("a", i));
+        }
+        EXPECT_TRUE(log.wait_until_durable(log.append(item("b", 5))));
+    }
+
+    CollectionTree tree;
+    EXPECT_EQ(svr::ActionLog::replay(log_file.filename, &tree.server_tree, 4u), 22u);
+
+    // Batches of 4 records: element "a" is computed once in each of the 6 batches, "b" once in the last
+    EXPECT_EQ(tree.scaled_computes.load(), 7);
+
+    auto total = std::dynamic_pointer_cast<const tp::Total>(tree.server_tree.view()->value(tp::Total::descriptor()));
+    ASSERT_NE(total, nullptr);
+    EXPECT_EQ(total->total(), 250);
+}
+
+TEST(ActionLogTests, compacting_keeps_the_latest_update_of_each_source_and_element) {
+    TempLog log_file("action_log_compact_test.log");
+    UnknownMessages unknown;
+    {
+        svr::ActionLog log(log_file.filename);
+        log.append(item("a", 1));
+        log.append(item("b", 2));
+        log.append(*unknown.create("x"));
+        log.append(settings(1));
+        log.append(item("a", 3));
+        log.append(*unknown.create("y"));
+        EXPECT_TRUE(log.wait_until_durable(log.append(settings(2))));
+    }
+
+    CollectionTree tree;
+    ASSERT_TRUE(svr::ActionLog::compact(log_file.filename, tree.server_tree));
+
+    // Records that can't be parsed are all kept in place
+    EXPECT_EQ(svr::ActionLog::read(log_file.filename, [](std::unique_ptr<gp::Message>) {}), 5u);
+    EXPECT_EQ(log_file.read_all(),
+              (std::vector<std::string>{"Item id: \"b\" value: 2", "Item id: \"a\" value: 3", "Settings scale: 2"}));
+}
+
+} // namespace test
+} // namespace proj
@@ -0,0 +1,294 @@
+#include "server/server.h"
+#include "server/stream_handler.h"
+#include "util/message_util.h"
+#include <gtest/gtest.h>
+#include <grpcpp/create_channel.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace proj {
+namespace test {
+
+namespace {
+
+// A server on its own port with a client connected to it
+struct TestServer {
+    explicit TestServer(const std::string& address, svr::ServerOptions options = {})
+        : server(std::make_unique<svr::Server>(address, with_test_defaults(options)))
+        , stub(proto::Server::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))) {}
+
+    std::unique_ptr<svr::Server> server;
+    std::unique_ptr<proto::Server::Stub> stub;
+
+    // Returns the sequence number of the update once it has been propagated
+    std::uint64_t set_source1(const std::string& state) {
+        proto::Actions actions;
+        actions.mutable_source1()->set_state(state);
+
+        grpc::ClientContext context;
+        proto::Response response;
+        EXPECT_TRUE(stub->dispatch_action(&context, actions, &response).ok());
+        EXPECT_EQ(response.error_msg(), "");
+
+        while (server->applied_sequence() < response.sequence()) {
+            server->wait_for_applied_sequence(server->applied_sequence(), 100);
+        }
+        return response.sequence();
+    }
+
+    static svr::ServerOptions with_test_defaults(svr::ServerOptions options) {
+        options.debug_exports = false;
+        options.pin_completion_threads = false;
+        return options;
+    }
+};
+
+// Streams fail instead of hanging a broken test
+void set_deadline(grpc::ClientContext* context) {
+    context->set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(10));
+}
+
+// The Sink2 state is derived from Source1 through Inner1
+bool derived_from(const proto::Sink2& sink, const std::string& source1_state) {
+    return sink.final_update().find("_" + source1_state + "_") != std::string::npos;
+}
+
+} // namespace
+
+TEST(ServerCallTests, streams_start_from_the_latest_state_and_follow_updates) {
+    TestServer test("127.0.0.1:50161");
+    test.set_source1("before");
+
+    grpc::ClientContext context;
+    set_deadline(&context);
+    auto stream = test.stub->stream_state2_updates(&context, google::protobuf::Empty());
+
+    proto::Sink2Update update;
+    ASSERT_TRUE(stream->Read(&update));
+    EXPECT_FALSE(update.invalidated());
+    EXPECT_TRUE(derived_from(update.value(), "before"));
+
+    test.set_source1("after");
+
+    bool notified = false;
+    do {
+        ASSERT_TRUE(stream->Read(&update));
+        notified |= update.invalidated();
+    } while (update.invalidated() or not derived_from(update.value(), "after"));
+
+    // The notice came first
+    EXPECT_TRUE(notified);
+
+    context.TryCancel();
+    EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::CANCELLED);
+}
+
+TEST(ServerCallTests, state_streams_only_send_sink2_values) {
+    TestServer test("127.0.0.1:50166");
+    test.set_source1("before");
+
+    grpc::ClientContext context;
+    set_deadline(&context);
+    auto stream = test.stub->stream_state2(&context, google::protobuf::Empty());
+
+    proto::Sink2 state;
+    ASSERT_TRUE(stream->Read(&state));
+    EXPECT_TRUE(derived_from(state, "before"));
+
+    // Notices without a value are left out, so every message is a complete state
+    test.set_source1("after");
+    do {
+        ASSERT_TRUE(stream->Read(&state));
+        ASSERT_TRUE(derived_from(state, "before") or derived_from(state, "after"));
+    } while (not derived_from(state, "after"));
+
+    context.TryCancel();
+    EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::CANCELLED);
+}
+
+TEST(ServerCallTests, delta_streams_rebuild_the_same_state_for_every_client) {
+    TestServer test("127.0.0.1:50162");
+
+    grpc::ClientContext contexts[2];
+    std::unique_ptr<grpc::ClientReader<proto::Sink2Delta>> streams[2];
+    proto::Sink2 states[2];
+
+    for (auto i = 0u; i < 2u; ++i) {
+        set_deadline(&contexts[i]);
+        streams[i] = test.stub->stream_state2_deltas(&contexts[i], google::protobuf::Empty());
+
+        proto::Sink2Delta delta;
+        ASSERT_TRUE(streams[i]->Read(&delta));
+        EXPECT_TRUE(delta.snapshot());
+        states[i] = delta.values();
+    }
+
+    for (const char* state : {"one", "two", "three"}) {
+        test.set_source1(state);
+    }
+
+    for (auto i = 0u; i < 2u; ++i) {
+        proto::Sink2Delta delta;
+        while (not derived_from(states[i], "three")) {
+            ASSERT_TRUE(streams[i]->Read(&delta));
+            EXPECT_FALSE(delta.snapshot());
+            util::apply_field_delta(delta.changed(), delta.values(), &states[i]);
+        }
+        contexts[i].TryCancel();
+        streams[i]->Finish();
+    }
+
+    EXPECT_EQ(states[0].SerializeAsString(), states[1].SerializeAsString());
+}
+
+TEST(ServerCallTests, subscribers_that_fall_behind_skip_to_the_latest_value) {
+    svr::ServerOptions options;
+    options.stream_buffer_size = 1;
+    TestServer test("127.0.0.1:50163", options);
+
+    grpc::ClientContext context;
+    set_deadline(&context);
+    proto::Subscription subscription;
+    subscription.set_node(proto::Inner1::descriptor()->full_name());
+    auto stream = test.stub->subscribe(&context, subscription);
+
+    proto::NodeValue node_value;
+    ASSERT_TRUE(stream->Read(&node_value));
+
+    // Many more updates than the buffer holds, none of them read yet
+    for (auto i = 0; i < 50; ++i) {
+        test.set_source1(std::to_string(i));
+    }
+
+    proto::Inner1 inner;
+    do {
+        ASSERT_TRUE(stream->Read(&node_value));
+        ASSERT_TRUE(node_value.value().UnpackTo(&inner));
+    } while (inner.state() != "_49_");
+
+    context.TryCancel();
+    EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::CANCELLED);
+}
+
+TEST(ServerCallTests, subscribing_to_an_unknown_node_fails) {
+    TestServer test("127.0.0.1:50164");
+
+    grpc::ClientContext context;
+    set_deadline(&context);
+    proto::Subscription subscription;
+    subscription.set_node("proj.proto.NotANode");
+    auto stream = test.stub->subscribe(&context, subscription);
+
+    proto::NodeValue node_value;
+    EXPECT_FALSE(stream->Read(&node_value));
+    EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::NOT_FOUND);
+}
+
+TEST(ServerCallTests, shutting_down_ends_every_stream) {
+    TestServer test("127.0.0.1:50165");
+
+    grpc::ClientContext cancelled_context;
+    auto cancelled = test.stub->stream_state2(&cancelled_context, google::protobuf::Empty());
+    proto::Sink2 state_value;
+    ASSERT_TRUE(cancelled->Read(&state_value));
+    cancelled_context.TryCancel();
+    cancelled->Finish();
+
+    grpc::ClientContext state_context;
+    grpc::ClientContext update_context;
+    grpc::ClientContext delta_context;
+    grpc::ClientContext invalidation_context;
+    grpc::ClientContext subscribe_context;
+    for (grpc::ClientContext* context :
+         {&state_context, &update_context, &delta_context, &invalidation_context, &subscribe_context}) {
+        set_deadline(context);
+    }
+    proto::Subscription subscription;
+    subscription.set_node(proto::Inner4::descriptor()->full_name());
+
+    auto state = test.stub->stream_state2(&state_context, google::protobuf::Empty());
+    auto updates = test.stub->stream_state2_updates(&update_context, google::protobuf::Empty());
+    auto deltas = test.stub->stream_state2_deltas(&delta_context, google::protobuf::Empty());
+    auto invalidations = test.stub->stream_invalidations(&invalidation_context, google::protobuf::Empty());
+    auto subscribed = test.stub->subscribe(&subscribe_context, subscription);
+
+    proto::Sink2Update update;
+    proto::Sink2Delta delta;
+    proto::NodeValue node_value;
+    ASSERT_TRUE(state->Read(&state_value));
+    ASSERT_TRUE(updates->Read(&update));
+    ASSERT_TRUE(deltas->Read(&delta));
+    ASSERT_TRUE(subscribed->Read(&node_value));
+
+    // Only returns once every call has been cleaned up
+    test.server = nullptr;
+
+    proto::Invalidation invalidation;
+    while (state->Read(&state_value)) {
+    }
+    while (updates->Read(&update)) {
+    }
+    while (deltas->Read(&delta)) {
+    }
+    while (invalidations->Read(&invalidation)) {
+    }
+    while (subscribed->Read(&node_value)) {
+    }
+    for (grpc::Status status :
+         {state->Finish(), updates->Finish(), deltas->Finish(), invalidations->Finish(), subscribed->Finish()}) {
+        EXPECT_NE(status.error_code(), grpc::StatusCode::DEADLINE_EXCEEDED);
+    }
+}
+
+TEST(StreamHandlerTests, slow_readers_skip_to_the_latest_value) {
+    svr::StreamHandler<int> stream(4, svr::SlowClientPolicy::SKIP_TO_LATEST);
+    std::uint64_t fast = stream.end();
+    std::uint64_t slow = stream.end();
+    std::shared_ptr<const int> value;
+
+    // Sending never waits for the slow reader
+    for (auto i = 0; i < 10; ++i) {
+        stream.send_data(std::make_shared<const int>(i));
+        ASSERT_EQ(stream.try_read(&fast, &value), svr::StreamRead::VALUE);
+        EXPECT_EQ(*value, i);
+    }
+
+    ASSERT_EQ(stream.try_read(&slow, &value), svr::StreamRead::VALUE);
+    EXPECT_EQ(*value, 9);
+    EXPECT_EQ(stream.try_read(&slow, &value), svr::StreamRead::NOTHING_NEW);
+    EXPECT_EQ(slow, fast);
+}
+
+TEST(StreamHandlerTests, slow_readers_are_disconnected_when_every_value_matters) {
+    svr::StreamHandler<int> stream(4, svr::SlowClientPolicy::DISCONNECT);
+    std::uint64_t fast = stream.end();
+    std::uint64_t behind = stream.end();
+    std::uint64_t slow = stream.end();
+    std::shared_ptr<const int> value;
+
+    for (auto i = 0; i < 4; ++i) {
+        stream.send_data(std::make_shared<const int>(i));
+    }
+
+    // A full buffer behind still gets every value
+    for (auto i = 0; i < 4; ++i) {
+        ASSERT_EQ(stream.try_read(&behind, &value), svr::StreamRead::VALUE);
+        EXPECT_EQ(*value, i);
+        ASSERT_EQ(stream.try_read(&fast, &value), svr::StreamRead::VALUE);
+    }
+
+    stream.send_data(std::make_shared<const int>(4));
+    EXPECT_EQ(stream.try_read(&slow, &value), svr::StreamRead::TOO_FAR_BEHIND);
+
+    // Only the slow reader is affected
+    ASSERT_EQ(stream.try_read(&fast, &value), svr::StreamRead::VALUE);
+    EXPECT_EQ(*value, 4);
+
+    stream.attempt_shutdown();
+    EXPECT_EQ(stream.try_read(&fast, &value), svr::StreamRead::SHUT_DOWN);
+}
+
+} // namespace test
+} // namespace proj
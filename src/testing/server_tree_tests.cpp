@@ -0,0 +1,680 @@
+#include "server/compute_functions.h"
+#include "server/server_tree.h"
+#include "server/source_batcher.h"
+#include <gtest/gtest.h>
+#include <proj/testing/collections.pb.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace proj {
+namespace test {
+
+namespace {
+
+namespace tp = proj::testing_proto;
+
+template <typename T>
+using OutputQueue = util::BlockingQueue<std::shared_ptr<const T>>;
+
+template <typename T>
+std::vector<std::shared_ptr<const T>> pop_all(OutputQueue<T>* queue) {
+    std::vector<std::shared_ptr<const T>> values;
+    while (not queue->non_blocking_empty()) {
+        values.emplace_back(queue->pop_front());
+    }
+    return values;
+}
+
+tp::Item item(const std::string& id, int value) {
+    tp::Item item;
+    item.set_id(id);
+    item.set_value(value);
+    return item;
+}
+
+// The test graph with counting compute functions. Slow computes wait until `release_slow` is called.
+struct CollectionGraph {
+    std::atomic_int scaled_computes = 0;
+    std::atomic_int slow_computes = 0;
+    std::atomic_int total_computes = 0;
+
+    std::shared_ptr<OutputQueue<tp::ScaledSink>> scaled_sinks = std::make_shared<OutputQueue<tp::ScaledSink>>();
+    std::shared_ptr<OutputQueue<tp::SlowSink>> slow_sinks = std::make_shared<OutputQueue<tp::SlowSink>>();
+    std::shared_ptr<OutputQueue<tp::TotalSink>> total_sinks = std::make_shared<OutputQueue<tp::TotalSink>>();
+    std::shared_ptr<util::BlockingQueue<svr::SinkInvalidation>> invalidations
+        = std::make_shared<util::BlockingQueue<svr::SinkInvalidation>>();
+
+    std::promise<void> slow_release;
+    std::shared_future<void> slow_released = slow_release.get_future().share();
+    bool released = false;
+
+    // The latest Slow value of each element that `wait_for_slow` hasn't returned yet
+    std::map<std::string, std::shared_ptr<const tp::SlowSink>> unclaimed_slow;
+
+    // Destroyed first so no compute function outlives the members it uses
+    svr::ServerTree server_tree{1, 1};
+
+    explicit CollectionGraph(bool block_slow = false) {
+        if (not block_slow) {
+            release_slow();
+        }
+        server_tree.add_output(scaled_sinks);
+        server_tree.add_output(slow_sinks);
+        server_tree.add_output(total_sinks);
+        server_tree.add_invalidation_output(invalidations);
+
+        server_tree.register_function<tp::Scaled>([this](tp::Scaled* scaled) {
+            ++scaled_computes;
+            scaled->set_scaled(scaled->item().value() * scaled->settings().scale());
+        });
+        server_tree.register_function<tp::Slow>([this](tp::Slow* slow) {
+            ++slow_computes;
+            slow_released.wait();
+            slow->set_doubled(slow->scaled().scaled() * 2);
+        });
+        server_tree.register_function<tp::Total>([this](tp::Total* total) {
+            ++total_computes;
+            int sum = 0;
+            for (const tp::Scaled& scaled : total->scaled()) {
+                sum += scaled.scaled();
+            }
+            total->set_total(sum);
+        });
+    }
+
+    ~CollectionGraph() { release_slow(); }
+
+    void release_slow() {
+        if (not released) {
+            slow_release.set_value();
+            released = true;
+        }
+    }
+
+    std::shared_ptr<const tp::Total> total() const {
+        return std::dynamic_pointer_cast<const tp::Total>(server_tree.view()->value(tp::Total::descriptor()));
+    }
+
+    std::shared_ptr<const tp::Scaled> scaled(const std::string& element) const {
+        return std::dynamic_pointer_cast<const tp::Scaled>(
+            server_tree.view()->value(tp::Scaled::descriptor(), element));
+    }
+
+    // Blocks until the Slow element of `id` is sent with a value. Elements can finish in any order, so
+    // values of other elements are kept for later calls.
+    std::shared_ptr<const tp::SlowSink> wait_for_slow(const std::string& id) {
+        while (true) {
+            auto iter = unclaimed_slow.find(id);
+            if (iter != unclaimed_slow.end()) {
+                std::shared_ptr<const tp::SlowSink> sent = std::move(iter->second);
+                unclaimed_slow.erase(iter);
+                return sent;
+            }
+
+            std::shared_ptr<const tp::SlowSink> sent = slow_sinks->pop_front();
+            if (sent->slow().doubled() != 0) {
+                unclaimed_slow[sent->slow().scaled().item().id()] = std::move(sent);
+            }
+        }
+    }
+};
+
+// The state.proto graph running the svr::Compute functions, counting how often each node is computed
+struct CountingStateGraph {
+    std::mutex computes_lock;
+    std::map<std::string, int> computes; // by node name
+
+    std::shared_ptr<OutputQueue<proto::Sink2>> sinks = std::make_shared<OutputQueue<proto::Sink2>>();
+
+    // Destroyed first so no compute function outlives the members it uses
+    svr::ServerTree server_tree;
+
+    explicit CountingStateGraph(unsigned num_compute_threads = 1) : server_tree(num_compute_threads, 1) {
+        server_tree.add_output(sinks);
+        count_computes<proto::Inner1>();
+        count_computes<proto::Inner2>();
+        count_computes<proto::Inner3>();
+        count_computes<proto::Inner4>();
+        count_computes<proto::Inner5>();
+        count_computes<proto::Inner6>();
+        count_computes<proto::Inner7>();
+        count_computes<proto::Sink2>();
+    }
+
+    template <typename T>
+    void count_computes() {
+        server_tree.register_function<T>([this](T* node) {
+            {
+                std::lock_guard<std::mutex> scoped_lock(computes_lock);
+                ++computes[T::descriptor()->name()];
+            }
+            svr::Compute::compute(node);
+        });
+    }
+
+    // Returns the counts since the last call
+    std::map<std::string, int> take_computes() {
+        std::lock_guard<std::mutex> scoped_lock(computes_lock);
+        return std::exchange(computes, {});
+    }
+
+    // Every node is valid afterwards
+    void update_every_source(const std::string& state) {
+        proto::Source1 source1;
+        proto::Source2 source2;
+        proto::Source3 source3;
+        source1.set_state(state);
+        source2.set_state(state);
+        source3.set_state(state);
+        server_tree.update_sources({&source1, &source2, &source3});
+    }
+};
+
+class ServerTreeCollectionTests : public ::testing::Test {
+protected:
+    CollectionGraph graph_;
+};
+
+} // namespace
+
+TEST_F(ServerTreeCollectionTests, adding_an_element_only_computes_that_element) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 1));
+    graph_.server_tree.update_source(item("b", 2));
+    pop_all(graph_.scaled_sinks.get());
+
+    int computes_before = graph_.scaled_computes.load();
+    graph_.server_tree.update_source(item("c", 3));
+    EXPECT_EQ(graph_.scaled_computes.load(), computes_before + 1);
+
+    std::vector<std::shared_ptr<const tp::ScaledSink>> sent = pop_all(graph_.scaled_sinks.get());
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent.front()->scaled().item().id(), "c");
+    EXPECT_EQ(sent.front()->scaled().scaled(), 30);
+
+    auto view = graph_.server_tree.view();
+    EXPECT_EQ(view->element_keys(tp::Scaled::descriptor()), (std::vector<std::string>{"a", "b", "c"}));
+    EXPECT_TRUE(view->valid(tp::Scaled::descriptor(), "c"));
+    EXPECT_TRUE(view->valid(tp::Scaled::descriptor()));
+    EXPECT_EQ(graph_.total()->total(), 60);
+}
+
+TEST_F(ServerTreeCollectionTests, updating_an_element_keeps_the_others) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 1));
+    graph_.server_tree.update_source(item("b", 2));
+
+    auto view_before = graph_.server_tree.view();
+    auto a_before = view_before->value(tp::Scaled::descriptor(), "a");
+    pop_all(graph_.scaled_sinks.get());
+
+    int computes_before = graph_.scaled_computes.load();
+    graph_.server_tree.update_source(item("b", 5));
+    EXPECT_EQ(graph_.scaled_computes.load(), computes_before + 1);
+
+    std::vector<std::shared_ptr<const tp::ScaledSink>> sent = pop_all(graph_.scaled_sinks.get());
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent.front()->scaled().scaled(), 50);
+
+    // Untouched elements are shared with earlier views and earlier views don't change
+    auto view = graph_.server_tree.view();
+    EXPECT_EQ(view->value(tp::Scaled::descriptor(), "a"), a_before);
+    EXPECT_EQ(std::dynamic_pointer_cast<const tp::Scaled>(view_before->value(tp::Scaled::descriptor(), "b"))->scaled(),
+              20);
+    EXPECT_EQ(graph_.total()->total(), 60);
+
+    // Changing an input shared by every element recomputes all of them
+    settings.set_scale(1);
+    graph_.server_tree.update_source(settings);
+    EXPECT_EQ(graph_.scaled_computes.load(), computes_before + 3);
+    EXPECT_EQ(pop_all(graph_.scaled_sinks.get()).size(), 2u);
+    EXPECT_EQ(graph_.total()->total(), 6);
+}
+
+TEST_F(ServerTreeCollectionTests, removing_an_element_notifies_keyed_sinks) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 1));
+    graph_.server_tree.update_source(item("b", 2));
+    pop_all(graph_.scaled_sinks.get());
+    while (not graph_.invalidations->non_blocking_empty()) {
+        graph_.invalidations->pop_front();
+    }
+
+    EXPECT_TRUE(graph_.server_tree.remove_source_element(item("b", 0)));
+    EXPECT_FALSE(graph_.server_tree.remove_source_element(item("b", 0)));
+
+    // Removed elements are never sent again so a removal notice takes their place
+    EXPECT_TRUE(pop_all(graph_.scaled_sinks.get()).empty());
+
+    std::vector<svr::SinkInvalidation> removals;
+    while (not graph_.invalidations->non_blocking_empty()) {
+        svr::SinkInvalidation invalidation = graph_.invalidations->pop_front();
+        if (invalidation.removed) {
+            removals.emplace_back(std::move(invalidation));
+        }
+    }
+    std::set<const google::protobuf::Descriptor*> removed_from;
+    for (const svr::SinkInvalidation& removal : removals) {
+        removed_from.emplace(removal.sink);
+        EXPECT_EQ(removal.elements, std::vector<std::string>{"b"});
+    }
+    EXPECT_EQ(removals.size(), 2u);
+    EXPECT_EQ(removed_from,
+              (std::set<const google::protobuf::Descriptor*>{tp::ScaledSink::descriptor(), tp::SlowSink::descriptor()}));
+
+    auto view = graph_.server_tree.view();
+    EXPECT_EQ(view->element_keys(tp::Scaled::descriptor()), std::vector<std::string>{"a"});
+    EXPECT_EQ(view->value(tp::Scaled::descriptor(), "b"), nullptr);
+    EXPECT_EQ(graph_.total()->total(), 10);
+
+    std::vector<std::shared_ptr<const tp::TotalSink>> totals = pop_all(graph_.total_sinks.get());
+    ASSERT_FALSE(totals.empty());
+    EXPECT_EQ(totals.back()->total().total(), 10);
+}
+
+TEST_F(ServerTreeCollectionTests, unchanged_results_stop_the_propagation) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 2));
+    graph_.wait_for_slow("a");
+    pop_all(graph_.scaled_sinks.get());
+    pop_all(graph_.total_sinks.get());
+    while (not graph_.invalidations->non_blocking_empty()) {
+        graph_.invalidations->pop_front();
+    }
+
+    int scaled_before = graph_.scaled_computes.load();
+    int slow_before = graph_.slow_computes.load();
+    int total_before = graph_.total_computes.load();
+
+    // Both inputs change but Scaled doesn't
+    tp::Item same_product = item("a", 4);
+    settings.set_scale(5);
+    graph_.server_tree.update_sources({&same_product, &settings});
+
+    EXPECT_EQ(graph_.scaled_computes.load(), scaled_before + 1);
+    EXPECT_EQ(graph_.slow_computes.load(), slow_before);
+    EXPECT_EQ(graph_.total_computes.load(), total_before);
+    EXPECT_EQ(graph_.total()->total(), 20);
+
+    // None of the sinks changed so none of them are notified or sent
+    EXPECT_TRUE(pop_all(graph_.scaled_sinks.get()).empty());
+    EXPECT_TRUE(pop_all(graph_.slow_sinks.get()).empty());
+    EXPECT_TRUE(pop_all(graph_.total_sinks.get()).empty());
+    EXPECT_TRUE(graph_.invalidations->non_blocking_empty());
+}
+
+TEST_F(ServerTreeCollectionTests, bursts_of_updates_are_coalesced_into_one_epoch) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 1));
+    pop_all(graph_.scaled_sinks.get());
+    int computes_before = graph_.scaled_computes.load();
+
+    {
+        // The whole burst arrives well within the window
+        svr::SourceBatcher batcher(&graph_.server_tree, std::chrono::milliseconds(500), 1000u);
+        std::uint64_t sequence = 0;
+        for (auto i = 2; i <= 50; ++i) {
+            EXPECT_TRUE(batcher.push(item("a", i), &sequence));
+        }
+        while (batcher.applied_sequence() < sequence) {
+            batcher.wait_for_applied_sequence(batcher.applied_sequence(), 100);
+        }
+    }
+
+    EXPECT_EQ(graph_.scaled_computes.load(), computes_before + 1);
+    std::vector<std::shared_ptr<const tp::ScaledSink>> sent = pop_all(graph_.scaled_sinks.get());
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent.front()->scaled().scaled(), 500);
+}
+
+TEST_F(ServerTreeCollectionTests, views_stay_consistent_while_a_propagation_runs) {
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+    graph_.server_tree.update_source(item("a", 1));
+    graph_.server_tree.update_source(item("b", 2));
+    auto before = graph_.server_tree.view();
+
+    // Scaled computes wait until the views have been checked
+    std::promise<void> computing;
+    std::atomic_bool computing_set = false;
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    graph_.server_tree.register_function<tp::Scaled>([&](tp::Scaled* scaled) {
+        if (not computing_set.exchange(true)) {
+            computing.set_value();
+        }
+        released.wait();
+        scaled->set_scaled(scaled->item().value() * scaled->settings().scale());
+    });
+
+    settings.set_scale(2);
+    auto update = std::async(std::launch::async, [&] { graph_.server_tree.update_source(settings); });
+    computing.get_future().wait();
+
+    // Readers don't wait for the propagation and see every affected node invalidated at once
+    auto during = graph_.server_tree.view();
+    EXPECT_GT(during->version(), before->version());
+    EXPECT_FALSE(during->valid(tp::Scaled::descriptor(), "a"));
+    EXPECT_FALSE(during->valid(tp::Scaled::descriptor(), "b"));
+    EXPECT_FALSE(during->valid(tp::Total::descriptor()));
+    EXPECT_FALSE(during->graphvis_string().empty());
+
+    release.set_value();
+    update.get();
+
+    auto after = graph_.server_tree.view();
+    EXPECT_TRUE(after->valid(tp::Total::descriptor()));
+    EXPECT_EQ(graph_.total()->total(), 6);
+
+    // Earlier views never change
+    EXPECT_TRUE(before->valid(tp::Total::descriptor()));
+    EXPECT_EQ(std::dynamic_pointer_cast<const tp::Total>(before->value(tp::Total::descriptor()))->total(), 30);
+    EXPECT_FALSE(during->valid(tp::Total::descriptor()));
+}
+
+TEST_F(ServerTreeCollectionTests, gathers_are_ordered_by_key_and_valid_once_every_element_is) {
+    graph_.server_tree.update_source(item("b", 2));
+    graph_.server_tree.update_source(item("a", 1));
+
+    // The elements need the settings to be valid
+    auto view = graph_.server_tree.view();
+    EXPECT_FALSE(view->valid(tp::Scaled::descriptor(), "a"));
+    EXPECT_FALSE(view->valid(tp::Scaled::descriptor()));
+    EXPECT_FALSE(view->valid(tp::Total::descriptor()));
+
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph_.server_tree.update_source(settings);
+
+    view = graph_.server_tree.view();
+    EXPECT_TRUE(view->valid(tp::Scaled::descriptor()));
+    EXPECT_TRUE(view->valid(tp::Total::descriptor()));
+
+    auto gathered = graph_.total();
+    ASSERT_EQ(gathered->scaled_size(), 2);
+    EXPECT_EQ(gathered->scaled(0).item().id(), "a");
+    EXPECT_EQ(gathered->scaled(1).item().id(), "b");
+    EXPECT_EQ(gathered->total(), 30);
+
+    graph_.server_tree.update_source(item("c", 3));
+    gathered = graph_.total();
+    ASSERT_EQ(gathered->scaled_size(), 3);
+    EXPECT_EQ(gathered->scaled(2).item().id(), "c");
+    EXPECT_EQ(gathered->total(), 60);
+}
+
+TEST(ServerTreePlanTests, nodes_reached_by_several_paths_are_computed_once) {
+    CountingStateGraph graph;
+    graph.update_every_source("a");
+    graph.take_computes();
+    pop_all(graph.sinks.get());
+
+    // Inner3 is reached from Source2 directly and through Inner2, Inner5 through Inner3 and Inner4,
+    // and Sink2 through Inner5, Inner6 and Inner7
+    proto::Source2 source2;
+    source2.set_state("b");
+    graph.server_tree.update_source(source2);
+
+    std::map<std::string, int> expected = {
+        {"Inner2", 1},
+        {"Inner3", 1},
+        {"Inner4", 1},
+        {"Inner5", 1},
+        {"Inner6", 1},
+        {"Inner7", 1},
+        {"Sink2", 1},
+    };
+    EXPECT_EQ(graph.take_computes(), expected);
+    EXPECT_EQ(pop_all(graph.sinks.get()).size(), 1u);
+}
+
+TEST(ServerTreeParallelTests, independent_siblings_run_together_and_dependents_wait_for_their_inputs) {
+    CountingStateGraph graph(/*num_compute_threads=*/4);
+
+    // Inner5, Inner6 and Inner7 each wait for the other two to start
+    std::mutex lock;
+    std::condition_variable started_changed;
+    int started = 0;
+    std::atomic_bool ran_together = true;
+    std::atomic_bool inputs_ready = true;
+
+    auto wait_for_siblings = [&] {
+        std::unique_lock<std::mutex> scoped_lock(lock);
+        ++started;
+        started_changed.notify_all();
+        if (not started_changed.wait_for(scoped_lock, std::chrono::seconds(10), [&] { return started % 3 == 0; })) {
+            ran_together = false;
+        }
+    };
+
+    graph.server_tree.register_function<proto::Inner5>([&](proto::Inner5* inner) {
+        inputs_ready = inputs_ready and not inner->inner3().state().empty() and not inner->inner4().state().empty();
+        wait_for_siblings();
+        svr::Compute::compute(inner);
+    });
+    graph.server_tree.register_function<proto::Inner6>([&](proto::Inner6* inner) {
+        inputs_ready = inputs_ready and not inner->inner4().state().empty();
+        wait_for_siblings();
+        svr::Compute::compute(inner);
+    });
+    graph.server_tree.register_function<proto::Inner7>([&](proto::Inner7* inner) {
+        inputs_ready = inputs_ready and not inner->inner4().state().empty();
+        wait_for_siblings();
+        svr::Compute::compute(inner);
+    });
+    graph.server_tree.register_function<proto::Sink2>([&](proto::Sink2* sink) {
+        inputs_ready = inputs_ready and not sink->inner5().state().empty() and not sink->inner6().state().empty()
+            and not sink->inner7().state().empty();
+        svr::Compute::compute(sink);
+    });
+
+    graph.update_every_source("a");
+    EXPECT_TRUE(ran_together);
+    EXPECT_TRUE(inputs_ready);
+
+    // Same result as computing one node at a time
+    CountingStateGraph serial_graph;
+    serial_graph.update_every_source("a");
+
+    std::vector<std::shared_ptr<const proto::Sink2>> sent = pop_all(graph.sinks.get());
+    std::vector<std::shared_ptr<const proto::Sink2>> serial_sent = pop_all(serial_graph.sinks.get());
+    ASSERT_EQ(sent.size(), 1u);
+    ASSERT_EQ(serial_sent.size(), 1u);
+    EXPECT_EQ(sent.front()->SerializeAsString(), serial_sent.front()->SerializeAsString());
+}
+
+TEST(ServerTreeAsyncTests, async_results_land_after_the_update_returns) {
+    CollectionGraph graph(/*block_slow=*/true);
+
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph.server_tree.update_source(settings);
+    graph.server_tree.update_source(item("a", 1));
+
+    // Slow is still computing but everything else is up to date
+    auto view = graph.server_tree.view();
+    EXPECT_TRUE(view->valid(tp::Scaled::descriptor(), "a"));
+    EXPECT_EQ(graph.scaled("a")->scaled(), 10);
+    EXPECT_FALSE(view->valid(tp::Slow::descriptor(), "a"));
+    EXPECT_TRUE(graph.slow_sinks->non_blocking_empty());
+
+    graph.release_slow();
+    EXPECT_EQ(graph.wait_for_slow("a")->slow().doubled(), 20);
+    EXPECT_TRUE(graph.server_tree.view()->valid(tp::Slow::descriptor(), "a"));
+}
+
+TEST(ServerTreeAsyncTests, superseded_async_computes_are_dropped) {
+    CollectionGraph graph(/*block_slow=*/true);
+
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph.server_tree.update_source(settings);
+    graph.server_tree.update_source(item("a", 1));
+    while (graph.slow_computes.load() == 0) {
+        std::this_thread::yield();
+    }
+
+    // The running compute finishes but its result is dropped, the queued one never starts
+    graph.server_tree.update_source(item("a", 2));
+    graph.server_tree.update_source(item("a", 3));
+    graph.release_slow();
+
+    std::shared_ptr<const tp::SlowSink> sent;
+    do {
+        sent = graph.slow_sinks->pop_front();
+        EXPECT_EQ(sent->slow().doubled(), 60);
+    } while (sent->slow().doubled() != 60);
+
+    EXPECT_EQ(graph.slow_computes.load(), 2);
+    EXPECT_EQ(graph.server_tree.stats(tp::Slow::descriptor()).cancelled_computes.load(), 1u);
+    EXPECT_TRUE(graph.slow_sinks->non_blocking_empty());
+}
+
+TEST(ServerTreeWatchTests, lazy_nodes_are_computed_until_their_last_watcher_leaves) {
+    CollectionGraph graph;
+    graph.server_tree.set_lazy_evaluation(true);
+
+    tp::Settings settings;
+    settings.set_scale(10);
+    graph.server_tree.update_source(settings);
+    graph.server_tree.update_source(item("a", 1));
+    EXPECT_EQ(graph.scaled_computes.load(), 0);
+
+    auto first_updates = std::make_shared<util::BlockingQueue<svr::NodeUpdate>>();
+    auto second_updates = std::make_shared<util::BlockingQueue<svr::NodeUpdate>>();
+    auto push_to = [](const std::shared_ptr<util::BlockingQueue<svr::NodeUpdate>>& queue) {
+        return [queue](svr::NodeUpdate update) { queue->push_back(std::move(update)); };
+    };
+
+    std::uint64_t first = graph.server_tree.watch(tp::Scaled::descriptor(), push_to(first_updates));
+    std::uint64_t second = graph.server_tree.watch(tp::Scaled::descriptor(), push_to(second_updates));
+    EXPECT_EQ(graph.scaled_computes.load(), 1);
+    EXPECT_EQ(first_updates->pop_front().version, second_updates->pop_front().version);
+
+    EXPECT_TRUE(graph.server_tree.unwatch(first));
+    EXPECT_FALSE(graph.server_tree.unwatch(first));
+    graph.server_tree.update_source(item("a", 2));
+    EXPECT_EQ(graph.scaled_computes.load(), 2);
+    EXPECT_TRUE(first_updates->non_blocking_empty());
+    EXPECT_EQ(second_updates->pop_front().element, "a");
+
+    EXPECT_TRUE(graph.server_tree.unwatch(second));
+    graph.server_tree.update_source(item("a", 3));
+    EXPECT_EQ(graph.scaled_computes.load(), 2);
+    EXPECT_TRUE(second_updates->non_blocking_empty());
+}
+
+TEST(ServerTreeSinkTests, notices_are_sent_in_order_before_the_value_that_resolves_them) {
+    svr::ServerTree server_tree{1, 1};
+
+    auto totals = std::make_shared<util::BlockingQueue<svr::SinkValue<tp::TotalSink>>>();
+    ASSERT_TRUE(server_tree.add_output(totals, svr::SinkEmission::NOTICE_AND_FINAL));
+
+    server_tree.register_function<tp::Scaled>(
+        [](tp::Scaled* scaled) { scaled->set_scaled(scaled->item().value() * scaled->settings().scale()); });
+    server_tree.register_function<tp::Slow>([](tp::Slow* slow) { slow->set_doubled(slow->scaled().scaled() * 2); });
+    server_tree.register_function<tp::Total>([](tp::Total* total) {
+        int sum = 0;
+        for (const tp::Scaled& scaled : total->scaled()) {
+            sum += scaled.scaled();
+        }
+        total->set_total(sum);
+    });
+
+    tp::Settings settings;
+    settings.set_scale(10);
+    server_tree.update_source(settings);
+    server_tree.update_source(item("a", 1));
+    while (not totals->non_blocking_empty()) {
+        totals->pop_front();
+    }
+
+    server_tree.update_source(item("a", 2));
+
+    svr::SinkValue<tp::TotalSink> notice = totals->pop_front();
+    EXPECT_TRUE(notice.invalidated);
+    EXPECT_EQ(notice.value, nullptr);
+
+    svr::SinkValue<tp::TotalSink> result = totals->pop_front();
+    EXPECT_FALSE(result.invalidated);
+    ASSERT_NE(result.value, nullptr);
+    EXPECT_EQ(result.value->total().total(), 20);
+    EXPECT_EQ(result.version, notice.version);
+    EXPECT_TRUE(totals->non_blocking_empty());
+}
+
+TEST(ServerTreeCheckpointTests, restores_values_and_resumes_interrupted_async_computes) {
+    const std::string filename = "server_tree_checkpoint_test.bin";
+    std::uint64_t saved_version = 0;
+
+    {
+        CollectionGraph saved_graph(/*block_slow=*/true);
+
+        tp::Settings settings;
+        settings.set_scale(10);
+        saved_graph.server_tree.update_source(settings);
+        saved_graph.server_tree.update_source(item("a", 1));
+        saved_graph.server_tree.update_source(item("b", 2));
+
+        saved_version = saved_graph.server_tree.view()->value_version(tp::Total::descriptor());
+
+        // Saved while the Slow elements are still being computed
+        ASSERT_TRUE(saved_graph.server_tree.save_checkpoint(filename));
+    }
+
+    CollectionGraph graph;
+    EXPECT_FALSE(graph.server_tree.restore_checkpoint(filename + ".missing"));
+    ASSERT_TRUE(graph.server_tree.restore_checkpoint(filename));
+    std::remove(filename.c_str());
+
+    auto view = graph.server_tree.view();
+    EXPECT_EQ(view->element_keys(tp::Scaled::descriptor()), (std::vector<std::string>{"a", "b"}));
+    EXPECT_TRUE(view->valid(tp::Scaled::descriptor()));
+    EXPECT_TRUE(view->valid(tp::Total::descriptor()));
+    ASSERT_NE(graph.scaled("b"), nullptr);
+    EXPECT_EQ(graph.scaled("b")->scaled(), 20);
+    EXPECT_EQ(graph.scaled("b")->item().value(), 2);
+    EXPECT_EQ(graph.total()->total(), 30);
+    EXPECT_EQ(graph.total()->scaled_size(), 2);
+    EXPECT_EQ(view->value_version(tp::Total::descriptor()), saved_version);
+
+    // Only the interrupted computes run again
+    EXPECT_EQ(graph.wait_for_slow("a")->slow().doubled(), 20);
+    EXPECT_EQ(graph.wait_for_slow("b")->slow().doubled(), 40);
+    EXPECT_EQ(graph.scaled_computes.load(), 0);
+    EXPECT_EQ(graph.slow_computes.load(), 2);
+
+    // Updates build on the restored values
+    graph.server_tree.update_source(item("a", 4));
+    EXPECT_EQ(graph.scaled_computes.load(), 1);
+    EXPECT_EQ(graph.scaled("a")->scaled(), 40);
+    EXPECT_EQ(graph.total()->total(), 60);
+    EXPECT_GT(graph.server_tree.view()->value_version(tp::Total::descriptor()), saved_version);
+    EXPECT_EQ(graph.wait_for_slow("a")->slow().doubled(), 80);
+}
+
+} // namespace test
+} // namespace proj
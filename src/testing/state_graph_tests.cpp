@@ -0,0 +1,118 @@
+#include "server/compute_functions.h"
+#include "server/server_tree.h"
+#include <gtest/gtest.h>
+#include <google/protobuf/util/message_differencer.h>
+#include <proj/state.graph.h>
+
+#include <memory>
+#include <vector>
+
+namespace proj {
+namespace test {
+
+namespace {
+
+// Runs the compute functions the ServerTree registers and records every sink value
+struct RecordingHandlers : svr::Compute {
+    std::vector<proto::Sink2> sent;
+
+    void send(const proto::Sink2& sink) { sent.emplace_back(sink); }
+};
+
+} // namespace
+
+TEST(StateGraphTests, nodes_are_only_computed_once_every_input_is_valid) {
+    proto::StateGraph<RecordingHandlers> graph;
+
+    proto::Source1 source1;
+    source1.set_state("a");
+    graph.update(source1);
+
+    EXPECT_TRUE(graph.source1_valid());
+    EXPECT_TRUE(graph.inner1_valid());
+    EXPECT_EQ(graph.inner1().state(), "_a_");
+
+    // Inner3 also needs Inner2 and Source2
+    EXPECT_FALSE(graph.inner3_valid());
+    EXPECT_TRUE(graph.inner3().state().empty());
+
+    // Sinks are sent either way
+    ASSERT_EQ(graph.handlers().sent.size(), 1u);
+    EXPECT_FALSE(graph.sink2_valid());
+    EXPECT_TRUE(graph.handlers().sent.back().final_update().empty());
+
+    proto::Source2 source2;
+    source2.set_state("b");
+    graph.update(source2);
+
+    EXPECT_TRUE(graph.inner3_valid());
+    EXPECT_EQ(graph.inner3().state(), "_b__a___b__");
+    EXPECT_FALSE(graph.inner4_valid());
+
+    proto::Source3 source3;
+    source3.set_state("c");
+    graph.update(source3);
+
+    ASSERT_EQ(graph.handlers().sent.size(), 3u);
+    EXPECT_TRUE(graph.sink2_valid());
+    EXPECT_FALSE(graph.handlers().sent.back().final_update().empty());
+}
+
+TEST(StateGraphTests, sends_the_same_sink_values_as_the_server_tree) {
+    auto queue = std::make_shared<util::BlockingQueue<std::shared_ptr<const proto::Sink2>>>();
+
+    svr::ServerTree server_tree(1, 1);
+    server_tree.add_output(queue);
+
+    svr::Compute compute;
+    compute.register_compute_functions(&server_tree);
+
+    proto::StateGraph<RecordingHandlers> graph;
+
+    auto update = [&](const auto& value) {
+        server_tree.update_source(value);
+        graph.update(value);
+    };
+
+    proto::Source1 source1;
+    proto::Source2 source2;
+    proto::Source3 source3;
+
+    // Starts with invalid sinks and then updates every source a few times in a mixed order
+    for (auto i = 0; i < 4; ++i) {
+        source3.set_state("c" + std::to_string(i));
+        update(source3);
+        source1.set_state("a" + std::to_string(i));
+        update(source1);
+        source2.set_state("b" + std::to_string(i));
+        update(source2);
+        source1.set_state("a" + std::to_string(i * 10));
+        update(source1);
+    }
+
+    std::vector<std::shared_ptr<const proto::Sink2>> server_tree_sent;
+    while (not queue->non_blocking_empty()) {
+        server_tree_sent.emplace_back(queue->pop_front());
+    }
+
+    // The ServerTree only sends valid sinks with new values while the graph sends them on every update
+    std::vector<proto::Sink2> graph_sent;
+    for (const proto::Sink2& sent : graph.handlers().sent) {
+        bool changed = (graph_sent.empty() or sent.final_update() != graph_sent.back().final_update());
+        if (not sent.final_update().empty() and changed) {
+            graph_sent.emplace_back(sent);
+        }
+    }
+    ASSERT_EQ(server_tree_sent.size(), graph_sent.size());
+
+    for (auto i = 0u; i < graph_sent.size(); ++i) {
+        EXPECT_TRUE(google::protobuf::util::MessageDifferencer::Equals(*server_tree_sent[i], graph_sent[i]))
+            << "update " << i << ":\n"
+            << server_tree_sent[i]->DebugString() << "\n"
+            << graph_sent[i].DebugString();
+    }
+    EXPECT_FALSE(graph_sent.back().final_update().empty());
+}
+
+} // namespace test
+} // namespace proj
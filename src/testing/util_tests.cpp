@@ -1,6 +1,23 @@
 #include "util/util.h"
 #include "util/generic_guard.h"
+#include "util/latency_histogram.h"
+#include "util/lru_cache.h"
+#include "util/mapped_file.h"
+#include "util/message_util.h"
+#include "util/mpsc_ring.h"
+#include "util/persistent_map.h"
+#include "util/work_stealing_pool.h"
 #include <gtest/gtest.h>
+#include <google/protobuf/util/message_differencer.h>
+#include <proj/state.pb.h>
+
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
 
 namespace proj {
 namespace test {
@@ -196,5 +213,280 @@ TEST(UtilTests, to_lower_works) {
     EXPECT_EQ(util::to_lower("BlaRgy bLarG!"), "blargy blarg!");
 }
 
+TEST(LruCacheTests, evicts_least_recently_used_when_over_cost) {
+    util::LruCache<std::string, int> cache(10);
+
+    cache.insert("a", 1, 4);
+    cache.insert("b", 2, 4);
+    ASSERT_NE(cache.find("a"), nullptr); // "b" becomes the least recently used
+
+    cache.insert("c", 3, 4);
+    EXPECT_EQ(cache.size(), 2u);
+    EXPECT_EQ(cache.total_cost(), 8u);
+    EXPECT_EQ(cache.find("b"), nullptr);
+    ASSERT_NE(cache.find("a"), nullptr);
+    EXPECT_EQ(*cache.find("a"), 1);
+    ASSERT_NE(cache.find("c"), nullptr);
+    EXPECT_EQ(*cache.find("c"), 3);
+}
+
+TEST(LruCacheTests, replacing_an_entry_updates_value_and_cost) {
+    util::LruCache<std::string, int> cache(10);
+
+    cache.insert("a", 1, 4);
+    cache.insert("a", 5, 6);
+    EXPECT_EQ(cache.size(), 1u);
+    EXPECT_EQ(cache.total_cost(), 6u);
+    ASSERT_NE(cache.find("a"), nullptr);
+    EXPECT_EQ(*cache.find("a"), 5);
+}
+
+TEST(LruCacheTests, entries_larger_than_the_max_cost_are_not_cached) {
+    util::LruCache<std::string, int> cache(10);
+
+    cache.insert("a", 1, 4);
+    cache.insert("huge", 2, 11);
+    EXPECT_EQ(cache.find("huge"), nullptr);
+    EXPECT_NE(cache.find("a"), nullptr);
+}
+
+TEST(PersistentMapTests, modifications_leave_earlier_versions_unchanged) {
+    util::PersistentMap<std::string, int> empty;
+    auto one = empty.insert_or_assign("a", 1);
+    auto two = one.insert_or_assign("b", 2);
+    auto replaced = two.insert_or_assign("a", 3);
+    auto erased = replaced.erase("b");
+
+    EXPECT_TRUE(empty.empty());
+    EXPECT_EQ(one.size(), 1u);
+    EXPECT_EQ(two.size(), 2u);
+    ASSERT_NE(two.find("a"), nullptr);
+    EXPECT_EQ(*two.find("a"), 1);
+    ASSERT_NE(replaced.find("a"), nullptr);
+    EXPECT_EQ(*replaced.find("a"), 3);
+    EXPECT_EQ(replaced.size(), 2u);
+    EXPECT_EQ(erased.find("b"), nullptr);
+    EXPECT_NE(replaced.find("b"), nullptr);
+    EXPECT_EQ(erased.erase("missing").size(), 1u);
+}
+
+TEST(PersistentMapTests, matches_std_map_after_random_modifications) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> key_dist(0, 199);
+
+    std::map<int, int> expected;
+    util::PersistentMap<int, int> map;
+
+    for (auto i = 0; i < 5000; ++i) {
+        int key = key_dist(gen);
+        if (i % 3 == 0) {
+            expected.erase(key);
+            map = map.erase(key);
+        } else {
+            expected[key] = i;
+            map = map.insert_or_assign(key, i);
+        }
+    }
+
+    std::vector<std::pair<int, int>> entries;
+    map.for_each([&](int key, int value) { entries.emplace_back(key, value); });
+    EXPECT_EQ(entries, (std::vector<std::pair<int, int>>(expected.begin(), expected.end())));
+    EXPECT_EQ(map.size(), expected.size());
+}
+
+TEST(MpscRingTests, pops_in_push_order_until_empty) {
+    util::MpscRing<int> ring(3);
+    EXPECT_EQ(ring.capacity(), 4u);
+    EXPECT_TRUE(ring.empty());
+
+    for (int i = 0; i < 4; ++i) {
+        int value = i;
+        EXPECT_TRUE(ring.try_push(std::move(value)));
+    }
+    int extra = 4;
+    EXPECT_FALSE(ring.try_push(std::move(extra))); // full
+
+    int value = -1;
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(ring.try_pop(&value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(ring.try_pop(&value));
+    EXPECT_TRUE(ring.empty());
+}
+
+TEST(MpscRingTests, every_value_from_every_producer_is_popped_once) {
+    constexpr int num_producers = 4;
+    constexpr int values_per_producer = 10000;
+
+    util::MpscRing<int> ring(64);
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < num_producers; ++p) {
+        producers.emplace_back([&ring, p] {
+            for (int i = 0; i < values_per_producer; ++i) {
+                int value = p * values_per_producer + i;
+                while (not ring.try_push(std::move(value))) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // Values from each producer arrive in the order that producer pushed them
+    std::vector<int> last_seen(num_producers, -1);
+    int value;
+    for (int received = 0; received < num_producers * values_per_producer;) {
+        if (ring.try_pop(&value)) {
+            int producer = value / values_per_producer;
+            EXPECT_GT(value % values_per_producer, last_seen[static_cast<std::size_t>(producer)]);
+            last_seen[static_cast<std::size_t>(producer)] = value % values_per_producer;
+            ++received;
+        }
+    }
+
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    EXPECT_TRUE(ring.empty());
+}
+
+TEST(WorkStealingPoolTests, outside_tasks_run_in_submission_order) {
+    std::vector<int> order;
+    std::promise<void> submitted;
+    std::shared_future<void> all_submitted = submitted.get_future().share();
+    {
+        util::WorkStealingPool pool(1);
+
+        // Holds the only worker until every task is queued
+        pool.submit([all_submitted] { all_submitted.wait(); });
+        for (int i = 0; i < 10; ++i) {
+            pool.submit([&order, i] { order.emplace_back(i); });
+        }
+        submitted.set_value();
+    } // drains the pool
+
+    EXPECT_EQ(order, (std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(WorkStealingPoolTests, a_workers_own_tasks_run_newest_first) {
+    std::vector<int> order;
+    {
+        util::WorkStealingPool pool(1);
+
+        pool.submit([&] {
+            for (int i = 0; i < 3; ++i) {
+                pool.submit([&order, i] { order.emplace_back(i); });
+            }
+        });
+    }
+
+    EXPECT_EQ(order, (std::vector<int>{2, 1, 0}));
+}
+
+TEST(MappedFileTests, maps_the_whole_file) {
+    const std::string filename = "mapped_file_test.bin";
+    const std::string contents("binary\0data", 11);
+    {
+        std::ofstream file(filename, std::ios::binary);
+        file << contents;
+    }
+
+    auto mapped = util::MappedFile::open(filename);
+    ASSERT_NE(mapped, nullptr);
+    EXPECT_EQ(std::string(mapped->data(), mapped->size()), contents);
+
+    // The mapping stays valid after the file is removed
+    std::remove(filename.c_str());
+    EXPECT_EQ(std::string(mapped->data(), mapped->size()), contents);
+}
+
+TEST(MappedFileTests, missing_and_empty_files_are_not_mapped) {
+    const std::string filename = "mapped_file_test_empty.bin";
+    std::ofstream(filename).close();
+
+    EXPECT_EQ(util::MappedFile::open(filename), nullptr);
+    EXPECT_EQ(util::MappedFile::open("mapped_file_test_missing.bin"), nullptr);
+    std::remove(filename.c_str());
+}
+
+TEST(LatencyHistogramTests, small_values_are_exact) {
+    util::LatencyHistogram histogram;
+    EXPECT_EQ(histogram.percentile(0.5), 0u);
+
+    for (auto i = 1u; i <= 50u; ++i) {
+        histogram.record(i);
+    }
+
+    EXPECT_EQ(histogram.count(), 50u);
+    EXPECT_EQ(histogram.total(), 50u * 51u / 2u);
+    EXPECT_EQ(histogram.max(), 50u);
+    EXPECT_EQ(histogram.percentile(0.0), 1u);
+    EXPECT_EQ(histogram.percentile(0.5), 25u);
+    EXPECT_EQ(histogram.percentile(1.0), 50u);
+}
+
+TEST(LatencyHistogramTests, large_values_are_within_bucket_precision) {
+    util::LatencyHistogram histogram;
+
+    for (std::uint64_t value = 1000u; value <= 1000000000u; value *= 10u) {
+        histogram.record(value);
+        histogram.record(value);
+
+        std::uint64_t bound = histogram.percentile(1.0);
+        EXPECT_GE(bound, value);
+        EXPECT_LE(bound, value + value / 32u);
+    }
+    // 1000 shares a bucket with 992 to 1007
+    EXPECT_EQ(histogram.percentile(0.0), 1007u);
+}
+
+TEST(LatencyHistogramTests, concurrent_records_are_all_counted) {
+    util::LatencyHistogram histogram;
+
+    std::vector<std::thread> threads;
+    for (auto t = 0u; t < 4u; ++t) {
+        threads.emplace_back([&histogram] {
+            for (auto i = 0u; i < 10000u; ++i) {
+                histogram.record(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(histogram.count(), 40000u);
+    EXPECT_EQ(histogram.total(), 4u * (9999u * 10000u / 2u));
+    EXPECT_EQ(histogram.max(), 9999u);
+}
+
+TEST(MessageUtilTests, field_delta_turns_the_old_message_into_the_new_one) {
+    proj::proto::Sink2 before;
+    before.set_final_update("a");
+    before.mutable_inner5()->mutable_inner4()->set_state("unchanged");
+    before.mutable_inner6()->set_state("old");
+    before.mutable_inner7()->set_state("removed");
+
+    proj::proto::Sink2 after = before;
+    after.mutable_inner6()->set_state("new");
+    after.mutable_inner6()->mutable_inner4()->set_state("added");
+    after.clear_inner7();
+
+    google::protobuf::FieldMask changed;
+    util::diff_fields(before, after, &changed);
+    std::vector<std::string> paths(changed.paths().begin(), changed.paths().end());
+    EXPECT_EQ(paths, (std::vector<std::string>{"inner6.state", "inner6.inner4", "inner7"}));
+
+    // Only the changed fields are sent
+    proj::proto::Sink2 values;
+    util::apply_field_delta(changed, after, &values);
+    EXPECT_TRUE(values.final_update().empty());
+    EXPECT_FALSE(values.inner5().has_inner4());
+
+    util::apply_field_delta(changed, values, &before);
+    EXPECT_TRUE(google::protobuf::util::MessageDifferencer::Equals(before, after));
+}
+
 } // namespace test
 } // namespace proj
@@ -0,0 +1,78 @@
+#include "util/arena_pool.h"
+
+#include <algorithm>
+
+namespace util {
+
+namespace {
+
+constexpr std::size_t block_alignment = 4096u;
+
+std::size_t round_up_block_size(std::size_t size) {
+    return ((size + block_alignment - 1u) / block_alignment) * block_alignment;
+}
+
+} // namespace
+
+ArenaPool::PooledArena::PooledArena(std::size_t size) : block(new char[size]), block_size(size) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block.get();
+    options.initial_block_size = block_size;
+    arena = std::make_unique<google::protobuf::Arena>(options);
+}
+
+std::shared_ptr<ArenaPool> ArenaPool::create(std::size_t initial_block_size, std::size_t max_pooled_arenas) {
+    return std::shared_ptr<ArenaPool>(new ArenaPool(initial_block_size, max_pooled_arenas));
+}
+
+ArenaPool::ArenaPool(std::size_t initial_block_size, std::size_t max_pooled_arenas)
+    : block_size_(round_up_block_size(initial_block_size)), max_pooled_arenas_(max_pooled_arenas) {}
+
+std::shared_ptr<google::protobuf::Arena> ArenaPool::acquire() {
+    std::unique_ptr<PooledArena> pooled;
+    {
+        std::lock_guard<std::mutex> scoped_lock(lock_);
+        if (not free_arenas_.empty()) {
+            pooled = std::move(free_arenas_.back());
+            free_arenas_.pop_back();
+        }
+    }
+
+    if (not pooled) {
+        pooled = std::make_unique<PooledArena>(block_size());
+    }
+
+    google::protobuf::Arena* arena = pooled->arena.get();
+    return std::shared_ptr<google::protobuf::Arena>(arena,
+                                                    [pool = shared_from_this(), raw = pooled.release()](auto*) {
+                                                        pool->release(std::unique_ptr<PooledArena>(raw));
+                                                    });
+}
+
+std::size_t ArenaPool::block_size() const {
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+    return block_size_;
+}
+
+void ArenaPool::release(std::unique_ptr<PooledArena> pooled) {
+    // Threads other than the first allocate their own blocks, so the space allocated always exceeds the
+    // initial block once an arena is shared. Only the bytes actually used count towards outgrowing it.
+    std::size_t space_used = static_cast<std::size_t>(pooled->arena->SpaceUsed());
+
+    std::lock_guard<std::mutex> scoped_lock(lock_);
+
+    if (space_used > pooled->block_size) {
+        // Outgrew its initial block. Future arenas get a block big enough for this workload.
+        block_size_ = std::max(block_size_, round_up_block_size(space_used));
+        return;
+    }
+
+    if (pooled->block_size < block_size_ or free_arenas_.size() >= max_pooled_arenas_) {
+        return;
+    }
+
+    pooled->arena->Reset();
+    free_arenas_.emplace_back(std::move(pooled));
+}
+
+} // namespace util
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <google/protobuf/arena.h>
+
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace util {
+
+/**
+ * @brief Recycles protobuf arenas so steady state allocations come from reused memory
+ *
+ * Every arena starts with a pool owned initial block. When the last reference to an
+ * acquired arena is released the arena is reset and returned to the pool, keeping its
+ * initial block. Arenas that outgrew their initial block are dropped instead and the
+ * block size for new arenas grows to match, so the pool converges on blocks that fit
+ * a whole workload (e.g. one propagation epoch).
+ */
+class ArenaPool : public std::enable_shared_from_this<ArenaPool> {
+public:
+    static std::shared_ptr<ArenaPool> create(std::size_t initial_block_size, std::size_t max_pooled_arenas = 8);
+
+    ArenaPool(const ArenaPool&) = delete;
+    ArenaPool(ArenaPool&&) noexcept = delete;
+    ArenaPool& operator=(const ArenaPool&) = delete;
+    ArenaPool& operator=(ArenaPool&&) noexcept = delete;
+
+    /**
+     * @brief The returned arena keeps the pool alive and is recycled once all copies are released
+     */
+    std::shared_ptr<google::protobuf::Arena> acquire();
+
+    std::size_t block_size() const;
+
+private:
+    explicit ArenaPool(std::size_t initial_block_size, std::size_t max_pooled_arenas);
+
+    struct PooledArena {
+        std::unique_ptr<char[]> block;
+        std::size_t block_size;
+        std::unique_ptr<google::protobuf::Arena> arena;
+
+        explicit PooledArena(std::size_t size);
+    };
+
+    mutable std::mutex lock_;
+    std::size_t block_size_;
+    std::size_t max_pooled_arenas_;
+    std::vector<std::unique_ptr<PooledArena>> free_arenas_;
+
+    void release(std::unique_ptr<PooledArena> pooled);
+};
+
+/**
+ * @brief A standard allocator that takes its memory from an arena, or from the heap when the arena is null
+ *
+ * Every copy holds a reference to the arena, so containers and `std::allocate_shared` control blocks
+ * keep the arena alive for as long as they use its memory. Deallocation is a no-op for arena memory.
+ */
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() = default;
+    explicit ArenaAllocator(std::shared_ptr<google::protobuf::Arena> arena) : arena_(std::move(arena)) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(std::size_t n) {
+        if (arena_) {
+            return static_cast<T*>(arena_->AllocateAligned(n * sizeof(T), alignof(T)));
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, std::size_t n) {
+        if (not arena_) {
+            std::allocator<T>().deallocate(ptr, n);
+        }
+    }
+
+    const std::shared_ptr<google::protobuf::Arena>& arena() const { return arena_; }
+
+private:
+    std::shared_ptr<google::protobuf::Arena> arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return lhs.arena() == rhs.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return not(lhs == rhs);
+}
+
+} // namespace util
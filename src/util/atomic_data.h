@@ -37,8 +37,8 @@ public:
     const T& unsafe_data() const;
 
 private:
-    std::mutex lock_;
-    std::condition_variable condition_;
+    mutable std::mutex lock_;
+    mutable std::condition_variable condition_;
     T data_;
 };
 
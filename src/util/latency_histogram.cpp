@@ -0,0 +1,83 @@
+#include "util/latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace util {
+
+namespace {
+
+unsigned highest_bit(std::uint64_t value) {
+    unsigned bit = 0;
+    for (unsigned shift = 32u; shift > 0u; shift /= 2u) {
+        if (value >> shift) {
+            value >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+}
+
+} // namespace
+
+void LatencyHistogram::record(std::uint64_t value) {
+    bucket_counts_[bucket_index(value)].fetch_add(1u, std::memory_order_relaxed);
+    count_.fetch_add(1u, std::memory_order_relaxed);
+    total_.fetch_add(value, std::memory_order_relaxed);
+
+    std::uint64_t current_max = max_.load(std::memory_order_relaxed);
+    while (value > current_max and not max_.compare_exchange_weak(current_max, value, std::memory_order_relaxed)) {
+    }
+}
+
+std::uint64_t LatencyHistogram::count() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t LatencyHistogram::total() const {
+    return total_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t LatencyHistogram::max() const {
+    return max_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t LatencyHistogram::percentile(double quantile) const {
+    std::uint64_t num_samples = count();
+    if (num_samples == 0u) {
+        return 0u;
+    }
+
+    // The sample at this (1 based) rank is the percentile
+    double exact_rank = std::ceil(std::clamp(quantile, 0.0, 1.0) * static_cast<double>(num_samples));
+    auto rank = std::max(static_cast<std::uint64_t>(exact_rank), std::uint64_t(1u));
+
+    std::uint64_t seen = 0;
+    for (auto i = 0u; i < num_buckets; ++i) {
+        seen += bucket_counts_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucket_upper_bound(i), max());
+        }
+    }
+    return max();
+}
+
+std::size_t LatencyHistogram::bucket_index(std::uint64_t value) {
+    if (value < 2u * sub_bucket_count) {
+        return value;
+    }
+    // The top `sub_bucket_bits + 1` bits of the value pick the bucket
+    unsigned shift = highest_bit(value) - sub_bucket_bits;
+    return shift * sub_bucket_count + (value >> shift);
+}
+
+std::uint64_t LatencyHistogram::bucket_upper_bound(std::size_t index) {
+    if (index < 2u * sub_bucket_count) {
+        return index;
+    }
+    std::size_t shift = index / sub_bucket_count - 1u;
+    std::uint64_t sub_bucket = index - shift * sub_bucket_count;
+    return ((sub_bucket + 1u) << shift) - 1u;
+}
+
+} // namespace util
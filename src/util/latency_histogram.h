@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace util {
+
+/**
+ * @brief A histogram of non-negative integer samples (typically durations in nanoseconds)
+ *
+ * Values below 64 are counted exactly. Larger values fall into one of 32 buckets per power
+ * of two (HDR style), so every percentile is within about 3% of the recorded value. Recording
+ * only performs relaxed atomic increments, so any number of threads may record at once without
+ * locks. Reads taken while other threads record may be slightly inconsistent with each other.
+ */
+class LatencyHistogram {
+public:
+    void record(std::uint64_t value);
+
+    std::uint64_t count() const;
+    std::uint64_t total() const;
+    std::uint64_t max() const;
+
+    /**
+     * @param quantile is in [0, 1], e.g. 0.99 for the 99th percentile
+     * @return the smallest bucket bound that at least `quantile` of the samples are below, or 0 if nothing was recorded
+     */
+    std::uint64_t percentile(double quantile) const;
+
+private:
+    static constexpr unsigned sub_bucket_bits = 5u;
+    static constexpr std::uint64_t sub_bucket_count = 1u << sub_bucket_bits;
+    static constexpr std::size_t num_buckets = (64u - sub_bucket_bits + 1u) * sub_bucket_count;
+
+    std::array<std::atomic<std::uint64_t>, num_buckets> bucket_counts_ = {};
+    std::atomic<std::uint64_t> count_ = 0;
+    std::atomic<std::uint64_t> total_ = 0;
+    std::atomic<std::uint64_t> max_ = 0;
+
+    static std::size_t bucket_index(std::uint64_t value);
+    static std::uint64_t bucket_upper_bound(std::size_t index);
+};
+
+} // namespace util
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <list>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+namespace util {
+
+/**
+ * @brief A map that evicts its least recently used entries once their total cost exceeds a cap
+ *
+ * The cost of each entry is supplied on insertion (typically its size in bytes).
+ */
+template <typename Key, typename Value>
+class LruCache {
+public:
+    explicit LruCache(std::size_t max_cost);
+
+    /**
+     * @return the cached value (marking it as most recently used) or nullptr if it is not present.
+     *         The pointer is invalidated by the next call to `insert`.
+     */
+    const Value* find(const Key& key);
+
+    void insert(Key key, Value value, std::size_t cost);
+
+    std::size_t size() const;
+    std::size_t total_cost() const;
+    std::size_t max_cost() const;
+
+private:
+    struct Entry {
+        Value value;
+        std::size_t cost;
+        typename std::list<const Key*>::iterator recency;
+    };
+
+    std::size_t max_cost_;
+    std::size_t total_cost_ = 0;
+
+    std::unordered_map<Key, Entry> entries_;
+    std::list<const Key*> recency_; // most recently used first
+
+    void evict_until(std::size_t max_cost);
+};
+
+template <typename Key, typename Value>
+LruCache<Key, Value>::LruCache(std::size_t max_cost) : max_cost_(max_cost) {}
+
+template <typename Key, typename Value>
+const Value* LruCache<Key, Value>::find(const Key& key) {
+    auto iter = entries_.find(key);
+    if (iter == entries_.end()) {
+        return nullptr;
+    }
+
+    Entry& entry = iter->second;
+    recency_.splice(recency_.begin(), recency_, entry.recency);
+    return &entry.value;
+}
+
+template <typename Key, typename Value>
+void LruCache<Key, Value>::insert(Key key, Value value, std::size_t cost) {
+    if (cost > max_cost_) {
+        return; // would evict itself
+    }
+
+    auto iter = entries_.find(key);
+
+    if (iter != entries_.end()) {
+        Entry& entry = iter->second;
+        total_cost_ -= entry.cost;
+        entry.value = std::move(value);
+        entry.cost = cost;
+        recency_.splice(recency_.begin(), recency_, entry.recency);
+
+    } else {
+        // Make room first so the new entry is never the one evicted
+        evict_until(max_cost_ - cost);
+
+        std::tie(iter, std::ignore) = entries_.emplace(std::move(key), Entry{std::move(value), cost, {}});
+        recency_.emplace_front(&iter->first);
+        iter->second.recency = recency_.begin();
+    }
+
+    total_cost_ += cost;
+    evict_until(max_cost_);
+}
+
+template <typename Key, typename Value>
+std::size_t LruCache<Key, Value>::size() const {
+    return entries_.size();
+}
+
+template <typename Key, typename Value>
+std::size_t LruCache<Key, Value>::total_cost() const {
+    return total_cost_;
+}
+
+template <typename Key, typename Value>
+std::size_t LruCache<Key, Value>::max_cost() const {
+    return max_cost_;
+}
+
+template <typename Key, typename Value>
+void LruCache<Key, Value>::evict_until(std::size_t max_cost) {
+    while (total_cost_ > max_cost and not recency_.empty()) {
+        auto iter = entries_.find(*recency_.back());
+        total_cost_ -= iter->second.cost;
+        recency_.pop_back();
+        entries_.erase(iter);
+    }
+}
+
+} // namespace util
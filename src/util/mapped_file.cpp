@@ -0,0 +1,73 @@
+#include "util/mapped_file.h"
+
+#if defined(__unix__) or defined(__APPLE__)
+#define HAS_MMAP
+#endif
+
+#ifdef HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+namespace util {
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& filename) {
+#ifdef HAS_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat file_stat = {};
+    if (::fstat(fd, &file_stat) != 0 or file_stat.st_size <= 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    auto size = static_cast<std::size_t>(file_stat.st_size);
+
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping holds its own reference to the file
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const char*>(data), size));
+#else
+    std::ifstream file(filename, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (not file or contents.empty()) {
+        return nullptr;
+    }
+
+    char* data = new char[contents.size()];
+    contents.copy(data, contents.size());
+    return std::shared_ptr<const MappedFile>(new MappedFile(data, contents.size()));
+#endif
+}
+
+MappedFile::MappedFile(const char* data, std::size_t size) : data_(data), size_(size) {}
+
+MappedFile::~MappedFile() {
+#ifdef HAS_MMAP
+    ::munmap(const_cast<char*>(data_), size_);
+#else
+    delete[] data_;
+#endif
+}
+
+const char* MappedFile::data() const {
+    return data_;
+}
+
+std::size_t MappedFile::size() const {
+    return size_;
+}
+
+} // namespace util
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+namespace util {
+
+/**
+ * @brief A read-only view of a whole file. Pages are only read from disk when they are first touched.
+ *
+ * Platforms without `mmap` read the file into memory instead.
+ */
+class MappedFile {
+public:
+    /**
+     * @return null if the file doesn't exist, is empty, or can't be mapped
+     */
+    static std::shared_ptr<const MappedFile> open(const std::string& filename);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&&) noexcept = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) noexcept = delete;
+
+    const char* data() const;
+    std::size_t size() const;
+
+private:
+    MappedFile(const char* data, std::size_t size);
+
+    const char* data_;
+    std::size_t size_;
+};
+
+} // namespace util
@@ -3,6 +3,9 @@
 #include <proj/annotations.pb.h>
 
 #include <grpcpp/impl/codegen/proto_utils.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/util/message_differencer.h>
 
 #include <sstream>
 
@@ -95,6 +98,47 @@ bool graphvis_string(::std::ostream& os, gp::Message* message, bool is_sink, boo
     return valid;
 }
 
+void diff_fields(gp::util::MessageDifferencer* differencer,
+                 const gp::Message& before,
+                 const gp::Message& after,
+                 const std::string& prefix,
+                 gp::FieldMask* changed) {
+    const gp::Reflection* refl = before.GetReflection();
+
+    iterate_msg_fields(before, [&](const gp::FieldDescriptor* field, int /*index*/) {
+        std::string path = prefix + field->name();
+
+        if (field->cpp_type() == gp::FieldDescriptor::CPPTYPE_MESSAGE and not field->is_repeated()
+            and refl->HasField(before, field) and refl->HasField(after, field)) {
+            diff_fields(differencer,
+                        refl->GetMessage(before, field),
+                        refl->GetMessage(after, field),
+                        path + ".",
+                        changed);
+            return;
+        }
+
+        if (not differencer->CompareWithFields(before, after, {field}, {field})) {
+            changed->add_paths(std::move(path));
+        }
+    });
+}
+
+void copy_message_field(gp::Message* dst, const gp::Message& src, const gp::FieldDescriptor* field) {
+    const gp::Reflection* src_refl = src.GetReflection();
+    const gp::Reflection* dst_refl = dst->GetReflection();
+
+    if (not field->is_repeated()) {
+        dst_refl->MutableMessage(dst, field)->CopyFrom(src_refl->GetMessage(src, field));
+        return;
+    }
+
+    dst_refl->ClearField(dst, field);
+    for (int i = 0; i < src_refl->FieldSize(src, field); ++i) {
+        dst_refl->AddMessage(dst, field)->CopyFrom(src_refl->GetRepeatedMessage(src, field, i));
+    }
+}
+
 } // namespace
 
 void print_field(std::ostream& os,
@@ -241,6 +285,21 @@ bool message_has_field(const gp::Message& msg, const gp::FieldDescriptor* field)
             or (not field->is_repeated() and refl->HasField(msg, field)));
 }
 
+std::string serialize_deterministic(const gp::Message& message) {
+    std::string bytes;
+    serialize_deterministic(message, &bytes);
+    return bytes;
+}
+
+void serialize_deterministic(const gp::Message& message, std::string* bytes) {
+    // Sized up front so the stream writes straight into the existing buffer
+    bytes->resize(message.ByteSizeLong());
+    gp::io::ArrayOutputStream array_stream(bytes->data(), static_cast<int>(bytes->size()));
+    gp::io::CodedOutputStream coded_stream(&array_stream);
+    coded_stream.SetSerializationDeterministic(true);
+    message.SerializeWithCachedSizes(&coded_stream);
+}
+
 std::unique_ptr<grpc::ByteBuffer> serialize_to_byte_buffer(const gp::Message& message) {
     auto buffer = std::make_unique<grpc::ByteBuffer>();
     bool own_buffer;
@@ -266,4 +325,50 @@ std::string graphvis_string(const gp::Message& message) {
     return ss.str();
 }
 
+void diff_fields(const gp::Message& before, const gp::Message& after, gp::FieldMask* changed) {
+    assert(before.GetDescriptor() == after.GetDescriptor());
+    gp::util::MessageDifferencer differencer;
+    diff_fields(&differencer, before, after, "", changed);
+}
+
+void apply_field_delta(const gp::FieldMask& changed, const gp::Message& values, gp::Message* state) {
+    assert(values.GetDescriptor() == state->GetDescriptor());
+
+    for (const std::string& path : changed.paths()) {
+        const gp::Message* src = &values;
+        gp::Message* dst = state;
+        const gp::FieldDescriptor* field = nullptr;
+
+        // Walk down to the message holding the last field in the path
+        std::size_t start = 0;
+        while (true) {
+            std::size_t end = std::min(path.find('.', start), path.size());
+            field = dst->GetDescriptor()->FindFieldByName(path.substr(start, end - start));
+
+            if (not field or end == path.size()) {
+                break;
+            }
+            if (field->cpp_type() != gp::FieldDescriptor::CPPTYPE_MESSAGE or field->is_repeated()) {
+                field = nullptr; // Not a path this message type can have
+                break;
+            }
+            src = &src->GetReflection()->GetMessage(*src, field);
+            dst = dst->GetReflection()->MutableMessage(dst, field);
+            start = end + 1;
+        }
+
+        if (not field) {
+            continue;
+        }
+
+        if (not message_has_field(*src, field)) {
+            dst->GetReflection()->ClearField(dst, field);
+        } else if (field->cpp_type() == gp::FieldDescriptor::CPPTYPE_MESSAGE) {
+            copy_message_field(dst, *src, field);
+        } else {
+            copy_field(dst, *src, field->index());
+        }
+    }
+}
+
 } // namespace util
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <google/protobuf/field_mask.pb.h>
 #include <google/protobuf/message.h>
 #include <grpcpp/support/byte_buffer.h>
 
@@ -57,9 +58,39 @@ void copy_field(google::protobuf::Message* dst, const google::protobuf::Message&
 
 bool message_has_field(const google::protobuf::Message& msg, const google::protobuf::FieldDescriptor* field);
 
+/**
+ * @brief Serializes with a stable field (and map entry) order so equal messages produce equal bytes
+ */
+std::string serialize_deterministic(const google::protobuf::Message& message);
+
+/**
+ * @brief Same as above but reuses the capacity of `bytes`, which is overwritten
+ */
+void serialize_deterministic(const google::protobuf::Message& message, std::string* bytes);
+
 std::unique_ptr<grpc::ByteBuffer> serialize_to_byte_buffer(const google::protobuf::Message& message);
 void deserialize_from_byte_buffer(grpc::ByteBuffer* buffer, google::protobuf::Message* message);
 
 std::string graphvis_string(const google::protobuf::Message& message);
 
+/**
+ * @brief Adds the path of every field that differs between `before` and `after` to `changed`
+ *
+ * Singular message fields set in both are compared field by field so paths name the innermost
+ * changes (e.g. "inner6.state"). Repeated and map fields are compared as a whole.
+ */
+void diff_fields(const google::protobuf::Message& before,
+                 const google::protobuf::Message& after,
+                 google::protobuf::FieldMask* changed);
+
+/**
+ * @brief Copies every field named in `changed` from `values` to `state`, clearing those not set in `values`
+ *
+ * Applying the paths from `diff_fields(before, after)` with `values = after` turns `before` into
+ * `after`. So does applying them with only those fields copied from `after`.
+ */
+void apply_field_delta(const google::protobuf::FieldMask& changed,
+                       const google::protobuf::Message& values,
+                       google::protobuf::Message* state);
+
 } // namespace util
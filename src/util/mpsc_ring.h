@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace util {
+
+/**
+ * @brief Bounded lock-free queue for many producer threads and a single consumer thread
+ *
+ * Based on Dmitry Vyukov's bounded MPMC queue. Every cell carries a sequence number that tells
+ * producers whether the cell is free and the consumer whether it has been filled, so producers
+ * only contend on a single compare-and-swap and never block each other or the consumer.
+ */
+template <typename T>
+class MpscRing {
+public:
+    /**
+     * @param capacity is rounded up to the next power of two
+     */
+    explicit MpscRing(std::size_t capacity);
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing(MpscRing&&) noexcept = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+    MpscRing& operator=(MpscRing&&) noexcept = delete;
+
+    /**
+     * @brief Safe to call from any thread. `value` is only moved from if there was room for it.
+     *
+     * `position` (if given) is set to the number of values pushed before this one, which is
+     * also the number of values `try_pop` returns before it.
+     *
+     * @return false if the ring is full
+     */
+    bool try_push(T&& value, std::size_t* position = nullptr);
+
+    /**
+     * @brief Must only be called from the consumer thread
+     * @return false if the ring is empty
+     */
+    bool try_pop(T* value);
+
+    /**
+     * @brief Must only be called from the consumer thread
+     */
+    bool empty() const;
+
+    std::size_t capacity() const;
+
+private:
+    // Keeps the producer and consumer positions on separate cache lines
+    static constexpr std::size_t cache_line_size = 64;
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+
+    alignas(cache_line_size) std::atomic<std::size_t> enqueue_position_;
+    alignas(cache_line_size) std::size_t dequeue_position_;
+};
+
+template <typename T>
+MpscRing<T>::MpscRing(std::size_t capacity) : enqueue_position_(0), dequeue_position_(0) {
+    std::size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    cells_ = std::make_unique<Cell[]>(size);
+    mask_ = size - 1;
+
+    for (auto i = 0u; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+bool MpscRing<T>::try_push(T&& value, std::size_t* pushed_position) {
+    Cell* cell;
+    std::size_t position = enqueue_position_.load(std::memory_order_relaxed);
+
+    while (true) {
+        cell = &cells_[position & mask_];
+        std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+
+        if (difference == 0) {
+            // The cell is free, claim it
+            if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // The consumer hasn't freed this cell yet
+            return false;
+        } else {
+            // Another producer claimed the cell first
+            position = enqueue_position_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+
+    if (pushed_position) {
+        *pushed_position = position;
+    }
+    return true;
+}
+
+template <typename T>
+bool MpscRing<T>::try_pop(T* value) {
+    Cell& cell = cells_[dequeue_position_ & mask_];
+
+    if (cell.sequence.load(std::memory_order_acquire) != dequeue_position_ + 1) {
+        return false;
+    }
+
+    *value = std::move(cell.value);
+    cell.value = T();
+
+    // Free the cell for the producers' next lap around the ring
+    cell.sequence.store(dequeue_position_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_position_;
+    return true;
+}
+
+template <typename T>
+bool MpscRing<T>::empty() const {
+    const Cell& cell = cells_[dequeue_position_ & mask_];
+    return cell.sequence.load(std::memory_order_acquire) != dequeue_position_ + 1;
+}
+
+template <typename T>
+std::size_t MpscRing<T>::capacity() const {
+    return mask_ + 1;
+}
+
+} // namespace util
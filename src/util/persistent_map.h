@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+
+namespace util {
+
+/**
+ * @brief An immutable ordered map where every modification returns a new map sharing most of its nodes
+ *
+ * Implemented as a treap with path copying: a modification copies the O(log n) nodes on the path
+ * to the modified key and shares the rest with the original map, so earlier versions stay valid
+ * (and cheap to keep) while readers hold them. Priorities are hashes of the keys, so the shape of
+ * the tree only depends on the keys it holds.
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename Hash = std::hash<Key>>
+class PersistentMap {
+public:
+    PersistentMap() = default;
+
+    /**
+     * @return the value for `key`, or nullptr. The pointer is valid for as long as this map (or a copy of it) is.
+     */
+    const Value* find(const Key& key) const;
+
+    /**
+     * @return a map with `key` set to `value`
+     */
+    PersistentMap insert_or_assign(const Key& key, Value value) const;
+
+    /**
+     * @return a map without `key` (this map if `key` isn't present)
+     */
+    PersistentMap erase(const Key& key) const;
+
+    /**
+     * @brief Calls `func(key, value)` for every entry in key order
+     */
+    template <typename Func>
+    void for_each(const Func& func) const;
+
+    std::size_t size() const;
+    bool empty() const;
+
+private:
+    struct Node;
+    using NodePtr = std::shared_ptr<const Node>;
+
+    struct Node {
+        Key key;
+        Value value;
+        std::size_t priority;
+        NodePtr left;
+        NodePtr right;
+        std::size_t size; // of the subtree rooted at this node
+    };
+
+    NodePtr root_;
+
+    explicit PersistentMap(NodePtr root) : root_(std::move(root)) {}
+
+    static std::size_t size(const NodePtr& node) { return node ? node->size : 0u; }
+    static NodePtr make_node(Key key, Value value, std::size_t priority, NodePtr left, NodePtr right);
+    static NodePtr with_children(const Node& node, NodePtr left, NodePtr right);
+
+    static NodePtr insert(const NodePtr& node, const Key& key, Value* value, std::size_t priority); // absent key
+    static NodePtr assign(const NodePtr& node, const Key& key, Value* value); // present key
+    static NodePtr erase(const NodePtr& node, const Key& key);
+    static std::pair<NodePtr, NodePtr> split(const NodePtr& node, const Key& key); // keys below and above `key`
+    static NodePtr merge(const NodePtr& lower, const NodePtr& upper);
+
+    template <typename Func>
+    static void for_each(const NodePtr& node, const Func& func);
+};
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+const Value* PersistentMap<Key, Value, Compare, Hash>::find(const Key& key) const {
+    const Node* node = root_.get();
+    while (node) {
+        if (Compare()(key, node->key)) {
+            node = node->left.get();
+        } else if (Compare()(node->key, key)) {
+            node = node->right.get();
+        } else {
+            return &node->value;
+        }
+    }
+    return nullptr;
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+PersistentMap<Key, Value, Compare, Hash> PersistentMap<Key, Value, Compare, Hash>::insert_or_assign(const Key& key,
+                                                                                                    Value value) const {
+    if (find(key)) {
+        return PersistentMap(assign(root_, key, &value));
+    }
+    return PersistentMap(insert(root_, key, &value, Hash()(key)));
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+PersistentMap<Key, Value, Compare, Hash> PersistentMap<Key, Value, Compare, Hash>::erase(const Key& key) const {
+    if (not find(key)) {
+        return *this;
+    }
+    return PersistentMap(erase(root_, key));
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+template <typename Func>
+void PersistentMap<Key, Value, Compare, Hash>::for_each(const Func& func) const {
+    for_each(root_, func);
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+std::size_t PersistentMap<Key, Value, Compare, Hash>::size() const {
+    return size(root_);
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+bool PersistentMap<Key, Value, Compare, Hash>::empty() const {
+    return root_ == nullptr;
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr PersistentMap<Key, Value, Compare, Hash>::make_node(
+    Key key, Value value, std::size_t priority, NodePtr left, NodePtr right) {
+    std::size_t subtree_size = size(left) + size(right) + 1u;
+    return std::make_shared<const Node>(
+        Node{std::move(key), std::move(value), priority, std::move(left), std::move(right), subtree_size});
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr
+PersistentMap<Key, Value, Compare, Hash>::with_children(const Node& node, NodePtr left, NodePtr right) {
+    return make_node(node.key, node.value, node.priority, std::move(left), std::move(right));
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr PersistentMap<Key, Value, Compare, Hash>::insert(
+    const NodePtr& node, const Key& key, Value* value, std::size_t priority) {
+    if (not node) {
+        return make_node(key, std::move(*value), priority, nullptr, nullptr);
+    }
+
+    if (priority > node->priority) {
+        auto [lower, upper] = split(node, key);
+        return make_node(key, std::move(*value), priority, std::move(lower), std::move(upper));
+    }
+    if (Compare()(key, node->key)) {
+        return with_children(*node, insert(node->left, key, value, priority), node->right);
+    }
+    return with_children(*node, node->left, insert(node->right, key, value, priority));
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr
+PersistentMap<Key, Value, Compare, Hash>::assign(const NodePtr& node, const Key& key, Value* value) {
+    if (Compare()(key, node->key)) {
+        return with_children(*node, assign(node->left, key, value), node->right);
+    }
+    if (Compare()(node->key, key)) {
+        return with_children(*node, node->left, assign(node->right, key, value));
+    }
+    // Same key and priority so the shape doesn't change
+    return make_node(node->key, std::move(*value), node->priority, node->left, node->right);
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr
+PersistentMap<Key, Value, Compare, Hash>::erase(const NodePtr& node, const Key& key) {
+    if (Compare()(key, node->key)) {
+        return with_children(*node, erase(node->left, key), node->right);
+    }
+    if (Compare()(node->key, key)) {
+        return with_children(*node, node->left, erase(node->right, key));
+    }
+    return merge(node->left, node->right);
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+std::pair<typename PersistentMap<Key, Value, Compare, Hash>::NodePtr,
+          typename PersistentMap<Key, Value, Compare, Hash>::NodePtr>
+PersistentMap<Key, Value, Compare, Hash>::split(const NodePtr& node, const Key& key) {
+    if (not node) {
+        return {nullptr, nullptr};
+    }
+    if (Compare()(node->key, key)) {
+        auto [lower, upper] = split(node->right, key);
+        return {with_children(*node, node->left, std::move(lower)), std::move(upper)};
+    }
+    auto [lower, upper] = split(node->left, key);
+    return {std::move(lower), with_children(*node, std::move(upper), node->right)};
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+typename PersistentMap<Key, Value, Compare, Hash>::NodePtr
+PersistentMap<Key, Value, Compare, Hash>::merge(const NodePtr& lower, const NodePtr& upper) {
+    if (not lower) {
+        return upper;
+    }
+    if (not upper) {
+        return lower;
+    }
+    if (lower->priority > upper->priority) {
+        return with_children(*lower, lower->left, merge(lower->right, upper));
+    }
+    return with_children(*upper, merge(lower, upper->left), upper->right);
+}
+
+template <typename Key, typename Value, typename Compare, typename Hash>
+template <typename Func>
+void PersistentMap<Key, Value, Compare, Hash>::for_each(const NodePtr& node, const Func& func) {
+    if (node) {
+        for_each(node->left, func);
+        func(node->key, node->value);
+        for_each(node->right, func);
+    }
+}
+
+} // namespace util
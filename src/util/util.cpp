@@ -1,5 +1,11 @@
 #include "util/util.h"
 
+#if defined(__unix__) or defined(__APPLE__)
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
 namespace util {
 
 std::string to_upper(std::string str) {
@@ -12,4 +18,17 @@ std::string to_lower(std::string str) {
     return str;
 }
 
+bool sync_to_disk(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#if defined(__unix__) or defined(__APPLE__)
+    return ::fsync(::fileno(file)) == 0;
+#elif defined(_WIN32)
+    return ::_commit(::_fileno(file)) == 0;
+#else
+    return true;
+#endif
+}
+
 } // namespace util
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdio>
 #include <string>
 #include <vector>
 
@@ -15,4 +16,9 @@ std::string to_upper(std::string str);
 
 std::string to_lower(std::string str);
 
+/**
+ * @brief Flushes `file` and waits for its contents to reach the disk
+ */
+bool sync_to_disk(std::FILE* file);
+
 } // namespace util
@@ -0,0 +1,121 @@
+#include "util/work_stealing_pool.h"
+
+#include <algorithm>
+
+namespace util {
+
+namespace {
+
+// Identifies the pool and worker that owns the current thread (if any)
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local unsigned current_worker = 0;
+
+} // namespace
+
+WorkStealingPool::WorkStealingPool(unsigned num_threads) {
+    num_threads = std::max(num_threads, 1u);
+
+    for (auto i = 0u; i < num_threads; ++i) {
+        workers_.emplace_back(std::make_unique<Worker>());
+    }
+    for (auto i = 0u; i < num_threads; ++i) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> scoped_lock(sleep_lock_);
+        stop_.store(true);
+    }
+    sleep_condition_.notify_all();
+
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(Task task) {
+    {
+        Worker& worker = (current_pool == this ? *workers_[current_worker] : injected_);
+        std::lock_guard<std::mutex> scoped_lock(worker.lock);
+        worker.tasks.emplace_back(std::move(task));
+        ++pending_tasks_;
+    }
+
+    {
+        // Taking the lock prevents a worker from missing the notification between
+        // checking for pending tasks and going to sleep
+        std::lock_guard<std::mutex> scoped_lock(sleep_lock_);
+    }
+    sleep_condition_.notify_one();
+}
+
+unsigned WorkStealingPool::thread_count() const {
+    return static_cast<unsigned>(workers_.size());
+}
+
+bool WorkStealingPool::try_pop(unsigned index, Task* task) {
+    Worker& worker = *workers_[index];
+    std::lock_guard<std::mutex> scoped_lock(worker.lock);
+
+    if (worker.tasks.empty()) {
+        return false;
+    }
+    *task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    --pending_tasks_;
+    return true;
+}
+
+bool WorkStealingPool::try_take_injected(Task* task) {
+    std::lock_guard<std::mutex> scoped_lock(injected_.lock);
+
+    if (injected_.tasks.empty()) {
+        return false;
+    }
+    *task = std::move(injected_.tasks.front());
+    injected_.tasks.pop_front();
+    --pending_tasks_;
+    return true;
+}
+
+bool WorkStealingPool::try_steal(unsigned thief_index, Task* task) {
+    for (auto offset = 1u; offset < thread_count(); ++offset) {
+        Worker& victim = *workers_[(thief_index + offset) % thread_count()];
+        std::lock_guard<std::mutex> scoped_lock(victim.lock);
+
+        if (not victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --pending_tasks_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(unsigned index) {
+    current_pool = this;
+    current_worker = index;
+
+    Task task;
+
+    while (true) {
+        if (try_pop(index, &task) or try_take_injected(&task) or try_steal(index, &task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> unlockable_lock(sleep_lock_);
+        sleep_condition_.wait(unlockable_lock, [this] { return stop_.load() or pending_tasks_.load() > 0; });
+
+        // Remaining tasks are drained before the pool shuts down
+        if (stop_.load() and pending_tasks_.load() == 0) {
+            break;
+        }
+    }
+}
+
+} // namespace util
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+/**
+ * @brief A fixed size thread pool where every worker owns its own task deque
+ *
+ * Tasks submitted from a worker thread are pushed onto that worker's deque and popped
+ * LIFO, so work released by a finished task tends to run on the same (cache warm) thread.
+ * Idle workers steal FIFO from the other deques. Tasks submitted from outside the pool go
+ * to a shared queue that workers take from in submission order, once their own deque is
+ * empty and before stealing, so outside work is never overtaken by newer outside work.
+ */
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(unsigned num_threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool(WorkStealingPool&&) noexcept = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(WorkStealingPool&&) noexcept = delete;
+
+    void submit(Task task);
+
+    unsigned thread_count() const;
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    Worker injected_; // tasks submitted from outside the pool, taken FIFO
+
+    std::mutex sleep_lock_;
+    std::condition_variable sleep_condition_;
+
+    // Changed under the lock of the deque the task is pushed to or popped from, so it never
+    // counts a task that was already taken
+    std::atomic<std::size_t> pending_tasks_ = 0;
+    std::atomic_bool stop_ = false;
+
+    bool try_pop(unsigned index, Task* task);
+    bool try_take_injected(Task* task);
+    bool try_steal(unsigned thief_index, Task* task);
+
+    void run(unsigned index);
+};
+
+} // namespace util